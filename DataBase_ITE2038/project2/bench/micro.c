@@ -0,0 +1,421 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  micro.c
+ *
+ *    Description:  Microbenchmarks of the page layer primitives:
+ *                  page reads and file_write_page under sequential and
+ *                  random patterns, in-page key search over full pages,
+ *                  leaf insertion shifting and leaf/internal splits.
+ *                  Prints one JSON object per benchmark so results can
+ *                  be collected and compared across commits.
+ *
+ *                  Build from project2:
+ *                  gcc -O2 -Iinclude -o micro bench/micro.c src/bpt.c src/file.c \
+ *                      src/stats.c src/hist.c src/trace.c src/scan.c src/ost.c \
+ *                      src/ahi.c src/pin.c src/cache.c \
+ *                      src/shadow.c src/wal.c src/buf.c src/ingest.c \
+ *                      src/compact.c -lpthread
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "bpt.h"
+#include "file.h"
+
+static char * table_path = "micro.db";
+static uint32_t table_psz = DEFAULT_PAGE_SIZE;
+static int io_pages = 4096;
+static int iters = 100000;
+static int split_iters = 1000;
+static char * filter = NULL;
+static uint64_t rng = 88172645463325252ull;
+
+/* Accumulated cost of the timed sections of one benchmark.
+ * Cycles come from the time stamp counter where there is one
+ * and are reported as 0 elsewhere.
+ */
+typedef struct bench_clock {
+    uint64_t ns;
+    uint64_t cycles;
+    uint64_t ns0;
+    uint64_t cycles0;
+} bench_clock;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+static uint64_t now_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+static void clock_start(bench_clock * bc) {
+    bc->ns0 = now_ns();
+    bc->cycles0 = now_cycles();
+}
+
+
+static void clock_stop(bench_clock * bc) {
+    bc->cycles += now_cycles() - bc->cycles0;
+    bc->ns += now_ns() - bc->ns0;
+}
+
+
+static uint64_t next_rand(void) {
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 2685821657736338717ull;
+}
+
+
+static bool selected(const char * name) {
+    return filter == NULL || strstr(name, filter) != NULL;
+}
+
+
+static void report(const char * name, int ops, bench_clock * bc) {
+    printf("{\"bench\": \"%s\", \"page_size\": %u, \"ops\": %d, "
+            "\"ns_per_op\": %.2f, \"cycles_per_op\": %.1f}\n",
+            name, page_size, ops, bc->ns / (double)ops,
+            bc->cycles / (double)ops);
+    fflush(stdout);
+}
+
+
+/* Allocates io_pages empty leaves once so the I/O
+ * benchmarks run over a file of known size.  Leaves, since
+ * file_write_page keeps internal pages resident in memory.
+ */
+static pagenum_t io_first_page(void) {
+    static pagenum_t first = 0;
+    page_t * p;
+    int i;
+
+    if (first != 0)
+        return first;
+    p = calloc(1, sizeof(page_t));
+    if (p == NULL) {
+        perror("I/O page.");
+        exit(EXIT_FAILURE);
+    }
+    ((LeafPage *)p)->is_leaf = true;
+    first = file_alloc_page();
+    file_write_page(first, p);
+    for (i = 1; i < io_pages; i++)
+        file_write_page(file_alloc_page(), p);
+    free(p);
+    return first;
+}
+
+
+static void bench_io(const char * name, bool write, bool random) {
+    bench_clock bc = { 0 };
+    page_t * p;
+    pagenum_t first, pn;
+    int i;
+
+    if (!selected(name))
+        return;
+    first = io_first_page();
+    p = calloc(1, sizeof(page_t));
+    if (p == NULL) {
+        perror("I/O page.");
+        exit(EXIT_FAILURE);
+    }
+    ((LeafPage *)p)->is_leaf = true;
+
+    // Reads skip file_read_page, which would serve the leaves from the cache.
+    clock_start(&bc);
+    for (i = 0; i < iters; i++) {
+        pn = first + (random ? next_rand() % io_pages : (uint64_t)(i % io_pages));
+        if (write)
+            file_write_page(pn, p);
+        else
+            pread(fileno(fp_db), p, page_size, (off_t)(pn * page_size));
+    }
+    clock_stop(&bc);
+    free(p);
+    report(name, iters, &bc);
+}
+
+
+/* Searches random keys in a full internal page
+ * and a full leaf page, without I/O.
+ */
+static void bench_search(void) {
+    bench_clock bc = { 0 };
+    InternalPage * ip;
+    LeafPage * lp;
+    volatile int sink = 0;
+    int i, nkeys;
+
+    ip = calloc(1, sizeof(InternalPage));
+    lp = calloc(1, sizeof(LeafPage));
+    if (ip == NULL || lp == NULL) {
+        perror("Search pages.");
+        exit(EXIT_FAILURE);
+    }
+
+    if (selected("intl_search")) {
+        ip->is_leaf = false;
+        ip->kcnt = intl_order - 1;
+        for (i = 0; i < ip->kcnt; i++) {
+            ip->records[i].key = (i + 1) * 2;
+            ip->records[i].pn = i + 2;
+        }
+        nkeys = ip->kcnt * 2 + 2;
+        clock_start(&bc);
+        for (i = 0; i < iters; i++)
+            sink += intl_child_index(ip, (int)(next_rand() % nkeys));
+        clock_stop(&bc);
+        report("intl_search", iters, &bc);
+    }
+
+    if (selected("leaf_search")) {
+        memset(&bc, 0, sizeof(bc));
+        lp->is_leaf = true;
+        lp->kcnt = leaf_order - 1;
+        for (i = 0; i < lp->kcnt; i++)
+            lp->records[i].key = (i + 1) * 2;
+        nkeys = lp->kcnt * 2 + 2;
+        clock_start(&bc);
+        for (i = 0; i < iters; i++)
+            sink += leaf_key_index(lp, (int)(next_rand() % nkeys));
+        clock_stop(&bc);
+        report("leaf_search", iters, &bc);
+    }
+
+    free(ip);
+    free(lp);
+}
+
+
+// Fills a leaf with cnt records of keys base, base + 2, ...
+static void fill_leaf(pagenum_t lpn, int base, int cnt) {
+    LeafPage lp;
+    int i;
+    file_read_page(lpn, (page_t *)&lp);
+    lp.is_leaf = true;
+    lp.kcnt = cnt;
+    lp.rspn = 0;
+    for (i = 0; i < cnt; i++) {
+        lp.records[i].key = base + i * 2;
+        snprintf(lp.records[i].value, sizeof(lp.records[i].value), "v%d", base + i * 2);
+    }
+    file_write_page(lpn, (page_t *)&lp);
+}
+
+
+/* Makes an empty internal root with a single
+ * leftmost child and installs it in the header page.
+ */
+static pagenum_t new_root(pagenum_t lspn) {
+    HeaderPage hp;
+    InternalPage rp;
+    pagenum_t rpn = make_intl();
+    file_read_page(rpn, (page_t *)&rp);
+    rp.lspn = lspn;
+    file_write_page(rpn, (page_t *)&rp);
+    file_read_page(0, (page_t *)&hp);
+    hp.rpn = rpn;
+    file_write_page(0, (page_t *)&hp);
+    return rpn;
+}
+
+
+/* Worst case shifting: every insert goes to slot 0
+ * of a leaf holding leaf_order - 2 records.
+ */
+static void bench_leaf_insert(void) {
+    bench_clock bc = { 0 };
+    pagenum_t lpn;
+    int i, n = split_iters * 10;
+
+    if (!selected("leaf_insert_shift"))
+        return;
+    lpn = make_leaf();
+    for (i = 0; i < n; i++) {
+        fill_leaf(lpn, 2, leaf_order - 2);
+        clock_start(&bc);
+        insert_into_leaf(lpn, 1, "v1");
+        clock_stop(&bc);
+    }
+    report("leaf_insert_shift", n, &bc);
+}
+
+
+/* Splits a full leaf hanging as rightmost child of a
+ * root with room, including the insertion into the root.
+ */
+static void bench_leaf_split(void) {
+    bench_clock bc = { 0 };
+    InternalPage rp;
+    pagenum_t rpn, lpn;
+    descent path;
+    int i, base = 1;
+
+    if (!selected("leaf_split"))
+        return;
+    rpn = new_root(make_leaf());
+    for (i = 0; i < split_iters; i++) {
+        file_read_page(rpn, (page_t *)&rp);
+        if (rp.kcnt >= intl_order - 3) {
+            rpn = new_root(make_leaf());
+            file_read_page(rpn, (page_t *)&rp);
+        }
+        lpn = make_leaf();
+        fill_leaf(lpn, base, leaf_order - 1);
+        insert_into_intl(rpn, rp.kcnt, base, lpn);
+        path.depth = 1;
+        path.pn[0] = rpn;
+        path.idx[0] = rp.kcnt + 1;
+
+        clock_start(&bc);
+        insert_into_leaf_after_splitting(&path, lpn, base + 1, "split");
+        clock_stop(&bc);
+        base += leaf_order * 2 + 2;
+    }
+    report("leaf_split", split_iters, &bc);
+}
+
+
+/* Splits a full internal page hanging as rightmost child
+ * of a root with room.  Its children are a fixed set of
+ * leaves, which the split does not touch.
+ */
+static void bench_intl_split(void) {
+    bench_clock bc = { 0 };
+    InternalPage rp, ip;
+    pagenum_t rpn, ipn, * children;
+    descent path;
+    int i, j, base = 1;
+
+    if (!selected("intl_split"))
+        return;
+    children = malloc(intl_order * sizeof(pagenum_t));
+    if (children == NULL) {
+        perror("Children array.");
+        exit(EXIT_FAILURE);
+    }
+    for (j = 0; j < intl_order; j++)
+        children[j] = make_leaf();
+
+    rpn = new_root(make_leaf());
+    for (i = 0; i < split_iters; i++) {
+        file_read_page(rpn, (page_t *)&rp);
+        if (rp.kcnt >= intl_order - 3) {
+            rpn = new_root(make_leaf());
+            file_read_page(rpn, (page_t *)&rp);
+        }
+        ipn = make_intl();
+        file_read_page(ipn, (page_t *)&ip);
+        ip.lspn = children[0];
+        ip.kcnt = intl_order - 1;
+        for (j = 0; j < ip.kcnt; j++) {
+            ip.records[j].key = base + (j + 1) * 2;
+            ip.records[j].pn = children[j + 1];
+        }
+        file_write_page(ipn, (page_t *)&ip);
+        insert_into_intl(rpn, rp.kcnt, base, ipn);
+        path.depth = 1;
+        path.pn[0] = rpn;
+        path.idx[0] = rp.kcnt + 1;
+
+        clock_start(&bc);
+        insert_into_intl_after_splitting(&path, ipn, ip.kcnt, base + intl_order * 2 + 1,
+                children[0]);
+        clock_stop(&bc);
+        base += intl_order * 2 + 4;
+    }
+    free(children);
+    report("intl_split", split_iters, &bc);
+}
+
+
+static void usage(void) {
+    printf("Usage: ./micro [options]\n"
+    "\t-f <file>   -- Scratch table file (default micro.db, recreated).\n"
+    "\t-p <bytes>  -- Page size.\n"
+    "\t-n <pages>  -- Pages touched by the I/O benchmarks.\n"
+    "\t-i <iters>  -- Iterations of the I/O and search benchmarks.\n"
+    "\t-s <iters>  -- Iterations of the split benchmarks.\n"
+    "\t-b <name>   -- Only run benchmarks whose name contains <name>.\n");
+}
+
+
+int main( int argc, char ** argv ) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:p:n:i:s:b:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            table_path = optarg;
+            break;
+        case 'p':
+            table_psz = (uint32_t)atoi(optarg);
+            break;
+        case 'n':
+            io_pages = atoi(optarg);
+            break;
+        case 'i':
+            iters = atoi(optarg);
+            break;
+        case 's':
+            split_iters = atoi(optarg);
+            break;
+        case 'b':
+            filter = optarg;
+            break;
+        default:
+            usage();
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (io_pages < 1 || iters < 1 || split_iters < 1) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    // Always start from an empty table of the requested page size.
+    unlink(table_path);
+    if (open_table_with_page_size(table_path, table_psz) == -1) {
+        fprintf(stderr, "Cannot create table %s\n", table_path);
+        exit(EXIT_FAILURE);
+    }
+
+    bench_io("page_read_seq", false, false);
+    bench_io("page_read_rand", false, true);
+    bench_io("page_write_seq", true, false);
+    bench_io("page_write_rand", true, true);
+    bench_search();
+    bench_leaf_insert();
+    bench_leaf_split();
+    bench_intl_split();
+
+    fclose(fp_db);
+    unlink(table_path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,577 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  ycsb.c
+ *
+ *    Description:  YCSB-style benchmark driver for the db_* API.
+ *                  Runs a load phase and a configurable workload
+ *                  (read-only, 50/50, update-heavy, read-mostly,
+ *                  scan-heavy) over
+ *                  uniform, zipfian or latest key distributions with
+ *                  several client threads, and reports throughput and
+ *                  latency percentiles.
+ *
+ *                  Build from project2:
+ *                  gcc -O2 -Iinclude -o ycsb bench/ycsb.c src/bpt.c src/file.c \
+ *                      src/stats.c src/hist.c src/trace.c src/scan.c src/ost.c \
+ *                      src/ahi.c src/pin.c src/cache.c \
+ *                      src/shadow.c src/wal.c src/buf.c src/ingest.c \
+ *                      src/compact.c -lpthread -lm
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "bpt.h"
+#include "file.h"
+#include "ahi.h"
+#include "cache.h"
+#include "wal.h"
+#include "buf.h"
+#include "ingest.h"
+#include "stats.h"
+
+// Workloads, named after the YCSB core workloads they follow.
+enum workload {
+    WL_LOAD,        // inserts only
+    WL_READ,        // C: 100% find
+    WL_MIXED,       // A: 50% find, 50% insert/delete
+    WL_UPDATE,      // A: 50% find, 50% update
+    WL_READMOSTLY,  // B: 95% find, 5% insert/delete
+    WL_SCAN         // E: 95% short scans, 5% insert
+};
+
+enum distribution {
+    DIST_UNIFORM,
+    DIST_ZIPFIAN,
+    DIST_LATEST
+};
+
+enum op_type {
+    OP_FIND,
+    OP_INSERT,
+    OP_DELETE,
+    OP_SCAN,
+    OP_UPDATE,
+    OP_TYPES
+};
+
+static const char * op_names[OP_TYPES] = { "find", "insert", "delete", "scan", "update" };
+
+// Benchmark configuration. Set from the command line.
+static char * table_path = "ycsb.db";
+static uint32_t table_psz = DEFAULT_PAGE_SIZE;
+static enum workload workload = WL_MIXED;
+static enum distribution dist = DIST_ZIPFIAN;
+static int record_cnt = 100000;
+static int op_cnt = 100000;
+static int thread_cnt = 4;
+static int scan_len = 50;
+static double zipf_theta = 0.99;
+static uint64_t seed = 1;
+static bool skip_load = false;
+static double wal_secs = 0;     // recovery target when logged
+static bool buffered = false;
+static bool ingest = false;
+
+// Largest key inserted so far. Used by the latest distribution.
+static volatile int max_key;
+
+/* Zipfian generator constants, following
+ * Gray et al., "Quickly Generating Billion-Record
+ * Synthetic Databases", as used by YCSB.
+ */
+static double zipf_zetan, zipf_alpha, zipf_eta;
+
+// Latencies of one operation type recorded by one thread, in ns.
+typedef struct lat_buf {
+    uint64_t * ns;
+    int cnt;
+    int cap;
+} lat_buf;
+
+typedef struct client {
+    pthread_t tid;
+    int id;
+    int ops;
+    uint64_t rng;
+    lat_buf lat[OP_TYPES];
+    int miss;           // finds that did not hit a record
+    int * scan_keys;
+    char (* scan_values)[120];
+} client;
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+// xorshift64*, one state per client thread.
+static uint64_t next_rand(uint64_t * state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ull;
+}
+
+
+static double next_double(uint64_t * state) {
+    return (next_rand(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+static double zeta(int n, double theta) {
+    int i;
+    double sum = 0;
+    for (i = 1; i <= n; i++)
+        sum += 1.0 / pow(i, theta);
+    return sum;
+}
+
+
+static void zipf_init(int n) {
+    double zeta2 = zeta(2, zipf_theta);
+    zipf_zetan = zeta(n, zipf_theta);
+    zipf_alpha = 1.0 / (1.0 - zipf_theta);
+    zipf_eta = (1 - pow(2.0 / n, 1 - zipf_theta)) / (1 - zeta2 / zipf_zetan);
+}
+
+
+/* Returns a zipfian rank in [0, n), rank 0 the most popular.
+ * zipf_zetan is computed for record_cnt and reused for
+ * the slowly growing key space, as YCSB does.
+ */
+static int zipf_next(uint64_t * state, int n) {
+    double u = next_double(state);
+    double uz = u * zipf_zetan;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, zipf_theta)) return 1;
+    return (int)(n * pow(zipf_eta * u - zipf_eta + 1, zipf_alpha)) % n;
+}
+
+
+/* Picks the key of the next read.
+ * Zipfian ranks are scattered over the key space so
+ * popular keys do not all sit in the same leaf.
+ */
+static int next_key(client * c) {
+    int n = max_key;
+    int rank;
+
+    switch (dist) {
+    case DIST_UNIFORM:
+        return 1 + (int)(next_rand(&c->rng) % n);
+    case DIST_ZIPFIAN:
+        rank = zipf_next(&c->rng, n);
+        return 1 + (int)(((uint64_t)rank * 2654435761ull) % n);
+    case DIST_LATEST:
+        rank = zipf_next(&c->rng, n);
+        return n - rank;
+    }
+    return 1;
+}
+
+
+static void make_value(int key, char * value) {
+    snprintf(value, 120, "v%d", key);
+}
+
+
+static void record_latency(client * c, enum op_type op, uint64_t ns) {
+    lat_buf * lb = &c->lat[op];
+    if (lb->cnt == lb->cap) {
+        lb->cap = lb->cap ? lb->cap * 2 : 1024;
+        lb->ns = realloc(lb->ns, lb->cap * sizeof(uint64_t));
+        if (lb->ns == NULL) {
+            perror("Latency buffer.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    lb->ns[lb->cnt++] = ns;
+}
+
+
+static int do_find(client * c, int key) {
+    char value[120];
+    int ret;
+    ret = db_find(key, value);
+    if (ret != 0)
+        c->miss++;
+    return ret;
+}
+
+
+static int do_insert(int key) {
+    char value[120];
+    int ret, cur;
+    make_value(key, value);
+    ret = db_insert(key, value);
+    cur = max_key;
+    while (ret == 0 && key > cur
+            && !__atomic_compare_exchange_n(&max_key, &cur, key, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+    return ret;
+}
+
+
+static int do_delete(int key) {
+    return db_delete(key);
+}
+
+
+static int do_update(client * c, int key) {
+    char value[120];
+    int ret;
+    make_value(key, value);
+    ret = db_update(key, value);
+    if (ret != DB_UPDATED)
+        c->miss++;
+    return ret;
+}
+
+
+// Scans up to scan_len records from key.
+static void do_scan(client * c, int key) {
+    int len = 1 + (int)(next_rand(&c->rng) % scan_len);
+    if (c->scan_keys == NULL) {
+        c->scan_keys = malloc(scan_len * sizeof(int));
+        c->scan_values = malloc(scan_len * sizeof(*c->scan_values));
+        if (c->scan_keys == NULL || c->scan_values == NULL) {
+            perror("Scan buffers.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (find_range(key, INT32_MAX, false, c->scan_keys, c->scan_values, len) == 0)
+        c->miss++;
+}
+
+
+/* Inserts keys 1 .. record_cnt, in an order scattered
+ * by a multiplicative hash so the load phase does not
+ * degenerate into sequential appends.
+ */
+static void * load_thread(void * arg) {
+    client * c = (client *)arg;
+    int n = record_cnt;
+    int i, key;
+    uint64_t t0;
+
+    for (i = c->id; i < n; i += thread_cnt) {
+        key = 1 + (int)(((uint64_t)i * 2654435761ull) % n);
+        t0 = now_ns();
+        if (do_insert(key) != 0) {
+            fprintf(stderr, "Cannot insert key %d\n", key);
+            exit(EXIT_FAILURE);
+        }
+        record_latency(c, OP_INSERT, now_ns() - t0);
+        c->ops++;
+    }
+    return NULL;
+}
+
+
+static void * run_thread(void * arg) {
+    client * c = (client *)arg;
+    int i, key;
+    double r, read_ratio;
+    uint64_t t0;
+    enum op_type op;
+
+    read_ratio = workload == WL_READ ? 1.0 :
+        workload == WL_MIXED || workload == WL_UPDATE ? 0.5 : 0.95;
+
+    for (i = 0; i < op_cnt / thread_cnt; i++) {
+        r = next_double(&c->rng);
+        if (r < read_ratio) {
+            op = workload == WL_SCAN ? OP_SCAN : OP_FIND;
+            key = next_key(c);
+        } else if (workload == WL_UPDATE) {
+            op = OP_UPDATE;
+            key = next_key(c);
+        } else if (workload == WL_SCAN || (next_rand(&c->rng) & 1)) {
+            op = OP_INSERT;
+            key = max_key + 1;
+        } else {
+            op = OP_DELETE;
+            key = next_key(c);
+        }
+
+        t0 = now_ns();
+        switch (op) {
+        case OP_FIND:
+            do_find(c, key);
+            break;
+        case OP_SCAN:
+            do_scan(c, key);
+            break;
+        case OP_INSERT:
+            do_insert(key);
+            break;
+        case OP_DELETE:
+            do_delete(key);
+            break;
+        case OP_UPDATE:
+            do_update(c, key);
+            break;
+        default:
+            break;
+        }
+        record_latency(c, op, now_ns() - t0);
+        c->ops++;
+    }
+    return NULL;
+}
+
+
+static int cmp_u64(const void * a, const void * b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static uint64_t percentile(uint64_t * sorted, int n, double p) {
+    int idx = (int)ceil(p / 100.0 * n) - 1;
+    if (idx < 0) idx = 0;
+    if (idx >= n) idx = n - 1;
+    return sorted[idx];
+}
+
+
+/* Runs the clients through fn and prints one
+ * summary line per operation type.
+ */
+static void run_phase(const char * name, void * (*fn)(void *)) {
+    client * clients;
+    uint64_t t0, elapsed, * all, sum;
+    int i, t, n, total = 0, miss = 0;
+    enum op_type op;
+    db_stats st;
+
+    clients = calloc(thread_cnt, sizeof(client));
+    if (clients == NULL) {
+        perror("Client array.");
+        exit(EXIT_FAILURE);
+    }
+
+    t0 = now_ns();
+    for (t = 0; t < thread_cnt; t++) {
+        clients[t].id = t;
+        clients[t].rng = seed * 0x9E3779B97F4A7C15ull + t + 1;
+        pthread_create(&clients[t].tid, NULL, fn, &clients[t]);
+    }
+    for (t = 0; t < thread_cnt; t++) {
+        pthread_join(clients[t].tid, NULL);
+        total += clients[t].ops;
+        miss += clients[t].miss;
+    }
+    elapsed = now_ns() - t0;
+    db_stats_snapshot(&st);
+    db_stats_reset();
+
+    printf("[%s] ops=%d threads=%d time=%.3fs throughput=%.0f ops/s",
+            name, total, thread_cnt, elapsed / 1e9,
+            total / (elapsed / 1e9));
+    if (miss)
+        printf(" find_miss=%d", miss);
+    if (st.c[STAT_LEAF_HIT] + st.c[STAT_LEAF_MISS] > 0)
+        printf(" leaf_hit=%.2f%%", st.c[STAT_LEAF_HIT] * 100.0
+                / (st.c[STAT_LEAF_HIT] + st.c[STAT_LEAF_MISS]));
+    printf("\n");
+
+    for (op = 0; op < OP_TYPES; op++) {
+        n = 0;
+        for (t = 0; t < thread_cnt; t++)
+            n += clients[t].lat[op].cnt;
+        if (n == 0)
+            continue;
+        all = malloc(n * sizeof(uint64_t));
+        if (all == NULL) {
+            perror("Latency merge buffer.");
+            exit(EXIT_FAILURE);
+        }
+        for (t = 0, i = 0; t < thread_cnt; t++) {
+            memcpy(all + i, clients[t].lat[op].ns,
+                    clients[t].lat[op].cnt * sizeof(uint64_t));
+            i += clients[t].lat[op].cnt;
+        }
+        qsort(all, n, sizeof(uint64_t), cmp_u64);
+        for (i = 0, sum = 0; i < n; i++)
+            sum += all[i];
+        printf("[%s] %-6s count=%d avg=%.1fus p50=%.1fus p95=%.1fus "
+                "p99=%.1fus p99.9=%.1fus max=%.1fus\n",
+                name, op_names[op], n, sum / (double)n / 1e3,
+                percentile(all, n, 50) / 1e3, percentile(all, n, 95) / 1e3,
+                percentile(all, n, 99) / 1e3, percentile(all, n, 99.9) / 1e3,
+                all[n - 1] / 1e3);
+        free(all);
+    }
+
+    for (t = 0; t < thread_cnt; t++) {
+        for (op = 0; op < OP_TYPES; op++)
+            free(clients[t].lat[op].ns);
+        free(clients[t].scan_keys);
+        free(clients[t].scan_values);
+    }
+    free(clients);
+}
+
+
+static void usage(void) {
+    printf("Usage: ./ycsb [options]\n"
+    "\t-f <file>     -- Table file (default ycsb.db).\n"
+    "\t-p <bytes>    -- Page size of a newly created table.\n"
+    "\t-w <workload> -- load, read, mixed, update, readmostly or scan.\n"
+    "\t-d <dist>     -- uniform, zipfian or latest.\n"
+    "\t-n <records>  -- Records inserted by the load phase.\n"
+    "\t-o <ops>      -- Operations of the run phase.\n"
+    "\t-t <threads>  -- Client threads.\n"
+    "\t-s <len>      -- Maximum scan length.\n"
+    "\t-z <theta>    -- Zipfian constant (default 0.99).\n"
+    "\t-S <seed>     -- Random seed.\n"
+    "\t-L            -- Skip the load phase (table already loaded).\n"
+    "\t-a            -- Turn the adaptive hash index on.\n"
+    "\t-c <frames>   -- Leaf cache frames (default 1024).\n"
+    "\t-r <policy>   -- Leaf cache replacement: clock or 2q (default).\n"
+    "\t-k <shards>   -- Leaf cache shards (default 16).\n"
+    "\t-l <secs>     -- Log writes ahead, recovering within secs.\n"
+    "\t-b            -- Buffer writes in internal pages (new table).\n"
+    "\t-e            -- Take writes into the ingest tier (needs -l).\n");
+}
+
+
+int main( int argc, char ** argv ) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:p:w:d:n:o:t:s:z:S:Lac:r:k:l:beh")) != -1) {
+        switch (opt) {
+        case 'f':
+            table_path = optarg;
+            break;
+        case 'p':
+            table_psz = (uint32_t)atoi(optarg);
+            break;
+        case 'w':
+            if (strcmp(optarg, "load") == 0) workload = WL_LOAD;
+            else if (strcmp(optarg, "read") == 0) workload = WL_READ;
+            else if (strcmp(optarg, "mixed") == 0) workload = WL_MIXED;
+            else if (strcmp(optarg, "update") == 0) workload = WL_UPDATE;
+            else if (strcmp(optarg, "readmostly") == 0) workload = WL_READMOSTLY;
+            else if (strcmp(optarg, "scan") == 0) workload = WL_SCAN;
+            else {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            if (strcmp(optarg, "uniform") == 0) dist = DIST_UNIFORM;
+            else if (strcmp(optarg, "zipfian") == 0) dist = DIST_ZIPFIAN;
+            else if (strcmp(optarg, "latest") == 0) dist = DIST_LATEST;
+            else {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            record_cnt = atoi(optarg);
+            break;
+        case 'o':
+            op_cnt = atoi(optarg);
+            break;
+        case 't':
+            thread_cnt = atoi(optarg);
+            break;
+        case 's':
+            scan_len = atoi(optarg);
+            break;
+        case 'z':
+            zipf_theta = atof(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'L':
+            skip_load = true;
+            break;
+        case 'a':
+            db_ahi_enable(true);
+            break;
+        case 'c':
+            db_cache_set_frames((uint32_t)atoi(optarg));
+            break;
+        case 'r':
+            if (strcmp(optarg, "clock") == 0) db_cache_set_policy(CACHE_CLOCK);
+            else if (strcmp(optarg, "2q") == 0) db_cache_set_policy(CACHE_2Q);
+            else {
+                usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'k':
+            db_cache_set_shards((uint32_t)atoi(optarg));
+            break;
+        case 'l':
+            wal_secs = atof(optarg);
+            break;
+        case 'b':
+            buffered = true;
+            break;
+        case 'e':
+            ingest = true;
+            break;
+        default:
+            usage();
+            exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+        }
+    }
+
+    if (record_cnt < 2 || thread_cnt < 1 || scan_len < 1) {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (open_table_with_page_size(table_path, table_psz) == -1) {
+        fprintf(stderr, "Cannot open table %s\n", table_path);
+        exit(EXIT_FAILURE);
+    }
+    if (wal_secs > 0) {
+        db_wal_set_recovery_target(wal_secs);
+        db_enable_wal();
+    }
+    if (buffered && db_enable_buffers() != 0) {
+        fprintf(stderr, "Cannot buffer %s: it has internal pages\n", table_path);
+        exit(EXIT_FAILURE);
+    }
+    if (ingest && db_enable_ingest() != 0) {
+        fprintf(stderr, "Cannot take %s through the ingest tier: it is not logged\n",
+                table_path);
+        exit(EXIT_FAILURE);
+    }
+    printf("table=%s page_size=%u leaf_order=%d intl_order=%d\n",
+            table_path, page_size, leaf_order, intl_order);
+
+    zipf_init(record_cnt);
+
+    if (!skip_load)
+        run_phase("load", load_thread);
+    max_key = record_cnt;
+
+    if (workload != WL_LOAD)
+        run_phase("run", run_thread);
+
+    return EXIT_SUCCESS;
+}
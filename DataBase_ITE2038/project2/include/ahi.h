@@ -0,0 +1,51 @@
+#ifndef __AHI_H__
+#define __AHI_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "file.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Adaptive hash index.
+ * An optional in-memory map from hot keys to the leaf page
+ * and slot holding them, so that finds of those keys skip
+ * the descent.  Keys get in once they have been found
+ * AHI_PROMOTE_HITS times.  Entries carry the version of their
+ * leaf; every page write bumps the version, so entries of
+ * pages that were modified, split or merged are ignored and
+ * replaced on the next descent.
+ */
+
+#define AHI_BITS 16
+#define AHI_SIZE (1 << AHI_BITS)
+
+// Page versions are kept per page number modulo AHI_VERSIONS.
+#define AHI_VERSIONS (1 << 16)
+
+#define AHI_PROMOTE_HITS 8
+// Hotness halves every AHI_DECAY_PERIOD descents.
+#define AHI_DECAY_PERIOD (1 << 20)
+
+extern bool ahi_enabled;
+extern uint32_t ahi_ver[AHI_VERSIONS];
+
+static inline void ahi_page_written(pagenum_t pn) {
+    __atomic_add_fetch(&ahi_ver[pn & (AHI_VERSIONS - 1)], 1, __ATOMIC_RELAXED);
+}
+
+int ahi_lookup(int64_t key, char * value);
+void ahi_note(int64_t key, pagenum_t lpn, int slot);
+
+// C API.
+
+void db_ahi_enable(bool on);
+
+#endif /* __AHI_H__*/
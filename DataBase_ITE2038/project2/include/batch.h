@@ -0,0 +1,63 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Headless batch mode.
+ * Reads a command stream and prints only query results.
+ *
+ * Text format, one command per line, '#' starts a comment:
+ *   i <k> <v>   insert
+ *   f <k>       find, prints "<k> <v>" or "<k> -"
+ *   d <k>       delete
+ *   u <k> <v>   upsert
+ *   U <k> <v>   update
+ *   I <k> <v>   insert unless k is there
+ *   X <k> <e> <v>   set k to v if its value is e
+ *               these four print the outcome: inserted, updated,
+ *               buffered, not_found, exists or mismatch
+ *   a <k1> <k2> count, min/max key, sum and avg of the range
+ *   c <k1> <k2> number of keys in the range
+ *   k <k>       rank of k, the number of keys below it
+ *   K <n>       n-th key from 0, prints "<k> <v>" or "-"
+ *   C           keep subtree record counts
+ *   A <0|1>     adaptive hash index off or on
+ *   W           shadow page the table
+ *   n           take a snapshot of the last commit
+ *   N <k>       find in the snapshot, prints "<k> <v>" or "<k> -"
+ *   w           log writes ahead
+ *   P           checkpoint now
+ *   b           buffer writes in internal pages
+ *   F           flush buffered writes to the leaves
+ *   e           take writes into the ingest tier
+ *   E           merge the ingest tier into the tree
+ *   M <n>       compact in the background at n page I/Os a second, 0 stops
+ *   m           compact the whole tree now
+ *   g <n>       trace one query in n, 0 stops
+ *   s / h / H / G   statistics, histograms (text/JSON), trace dump
+ *   q           stop
+ *
+ * Binary format, a stream of little-endian records:
+ *   uint8 opcode ('i', 'f' or 'd'), int64 key,
+ *   and for 'i' a uint8 value length followed by the value bytes.
+ *   The stream starts with the 4 bytes of BATCH_MAGIC.
+ */
+
+#define BATCH_MAGIC "BPT1"
+
+// Size of the input and output buffers.
+#define BATCH_BUF_SIZE (1 << 20)
+
+int run_batch(FILE * in, bool binary);
+
+#endif /* __BATCH_H__*/
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <pthread.h>
 #include "file.h"
 #ifdef WINDOWS
 #define bool char
@@ -85,6 +86,38 @@ typedef struct node {
     struct node * next; // Used for queue.
 } node;
 
+/* Path of one descent from the root to a leaf: the internal
+ * pages passed, root first, and the entry followed in each
+ * (0 for lspn, i for records[i - 1].pn).  Pages keep no
+ * parent pointers; splits and merges walk back up the path
+ * of the descent that found the leaf instead.
+ */
+#define DESCENT_MAX 32
+
+typedef struct descent {
+    int depth;                  // internal pages on the path
+    pagenum_t pn[DESCENT_MAX];
+    int idx[DESCENT_MAX];
+} descent;
+
+/* Outcomes of the single-descent writes: db_upsert, db_update,
+ * db_insert_if_absent and db_compare_and_swap.  Negative
+ * outcomes wrote nothing.
+ */
+#define DB_INSERTED   0
+#define DB_UPDATED    1
+#define DB_BUFFERED   2         // upsert left as a message, see buf.h and ingest.h
+#define DB_NOT_FOUND  (-1)     // update or swap of a missing key
+#define DB_EXISTS     (-2)     // insert of a key already there
+#define DB_MISMATCH   (-3)     // swap whose expected value differs
+
+/* Right edge appends.  After APPEND_RUN inserts in a row
+ * past the last key, a split at the right edge leaves the
+ * old page APPEND_FILL percent full instead of half full.
+ */
+#define APPEND_RUN 8
+#define APPEND_FILL 90
+
 // GLOBALS.
 
 /* The order determines the maximum and minimum
@@ -99,6 +132,15 @@ typedef struct node {
  */
 extern int order;
 
+/* Orders of the on-disk leaf and internal pages,
+ * derived from the page size of the opened table.
+ */
+extern int leaf_order;
+extern int intl_order;
+
+// Height of the on-disk tree in edges, -1 when empty.
+extern int tree_height;
+
 /* The queue is used to print the tree in
  * level order, starting from the root
  * printing each entire rank on a separate
@@ -113,6 +155,11 @@ extern node * queue;
  */
 extern bool verbose_output;
 
+/* Engine latch.  db_find and find_range hold it shared,
+ * db_insert and db_delete exclusively.
+ */
+extern pthread_rwlock_t db_latch;
+
 
 // FUNCTION PROTOTYPES.
 
@@ -126,16 +173,20 @@ void usage_3( void );
 void enqueue( node * new_node );
 node * dequeue( void );
 int height( node * root );
+int disk_height( void );
 int path_to_root( node * root, node * child );
 void print_leaves( node * root );
 void print_tree( node * root );
-void find_and_print(node * root, int key, bool verbose); 
-void find_and_print_range(node * root, int range1, int range2, bool verbose); 
-int find_range( node * root, int key_start, int key_end, bool verbose,
-        int returned_keys[], void * returned_pointers[]); 
+void find_and_print(int key, bool verbose); 
+void find_and_print_range(int range1, int range2, bool verbose); 
+int find_range(int key_start, int key_end, bool verbose,
+        int returned_keys[], char returned_values[][120], int max); 
 //node * find_leaf( node * root, int key, bool verbose );
+int intl_child_index(InternalPage * ip, int key);
+int leaf_key_index(LeafPage * lp, int key);
 pagenum_t find_leaf(int key, bool verbose);
-Record * find(int key, bool verbose);
+pagenum_t find_leaf_path(int key, descent * d);
+int find_record(int64_t key, char *ret_val);
 int db_find(int64_t key, char *ret_val);
 int cut( int length );
 
@@ -143,39 +194,41 @@ int cut( int length );
 // Insertion.
 
 int open_table(char *pathname);
+int open_table_with_page_size(char *pathname, uint32_t psz);
 Record * make_record(int key, char* value);
 //node * make_node( void );
 pagenum_t make_intl( void );
 pagenum_t make_leaf( void );
-int get_left_index(pagenum_t ppn, pagenum_t left_pn);
 int insert_into_leaf( pagenum_t lpn, int key, char * value);
-node * insert_into_leaf_after_splitting(node * root, node * leaf, int key,
-        Record * pointer);
+int insert_into_leaf_after_splitting(descent * d, pagenum_t lpn, int key, char * value);
 //node * insert_into_node(node * root, node * parent, int left_index, int key, node * right);
 pagenum_t insert_into_intl(pagenum_t ppn, int left_index, int key, pagenum_t right_p);
-pagenum_t insert_into_intl_after_splitting(pagenum_t ppn, int left_index, int key, pagenum_t right_pn);
+int insert_into_intl_after_splitting(descent * d, pagenum_t pn, int left_index, int key,
+        pagenum_t right_pn);
 //node * insert_into_node_after_splitting(node * root, node * parent,
         //int left_index,
         //int key, node * right);
 //node * insert_into_parent(node * root, node * left, int key, node * right);
-int insert_into_parent(pagenum_t left_pn, int key, pagenum_t right_pn);
+int insert_into_parent(descent * d, pagenum_t left_pn, int key, pagenum_t right_pn);
 int insert_into_new_root(pagenum_t left_pn, int key, pagenum_t right_pn);
 
 pagenum_t start_new_tree(int key, char * value);
 node * insert( node * root, int key, int value );
 int db_insert(int64_t key, char* value);
+int db_upsert(int64_t key, char * value);
+int db_update(int64_t key, char * value);
+int db_insert_if_absent(int64_t key, char * value);
+int db_compare_and_swap(int64_t key, char * expected, char * value);
 
 // Deletion.
 
-int get_neighbor_index( node * n );
-node * adjust_root(node * root);
-node * coalesce_nodes(node * root, node * n, node * neighbor,
-        int neighbor_index, int k_prime);
-node * redistribute_nodes(node * root, node * n, node * neighbor,
-        int neighbor_index,
-        int k_prime_index, int k_prime);
-node * delete_entry( node * root, node * n, int key, void * pointer );
-node * delete( node * root, int key );
+int get_neighbor_index(const descent * d);
+void adjust_root(pagenum_t rpn, page_t * root);
+void coalesce_pages(descent * d, pagenum_t pn, page_t * n, pagenum_t neighbor_pn,
+        page_t * neighbor, int neighbor_index, int k_prime);
+void redistribute_pages(descent * d, pagenum_t pn, page_t * n, pagenum_t neighbor_pn,
+        page_t * neighbor, int neighbor_index, int k_prime_index, int k_prime);
+void delete_entry(descent * d, pagenum_t pn, int key);
 int db_delete(int64_t key);
 
 void destroy_tree_nodes(node * root);
@@ -0,0 +1,56 @@
+#ifndef __BUF_H__
+#define __BUF_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "file.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Message buffers.
+ * On a table with HDR_BUFFERED set, internal pages give up
+ * most of their fanout to hold messages (BUF_MSG_CAPACITY):
+ * inserts, upserts and deletes that have not reached their
+ * leaf yet.  A write adds its message to the root.  When a
+ * buffer overflows, the messages for the child that has most
+ * of them go down to that child in one batch, so a leaf is
+ * read and written once for many writes.
+ *
+ * A buffer holds one message per key.  The newest message on
+ * the way down from the root decides a lookup; an insert only
+ * decides when nothing below holds the key.  Scans walk the
+ * leaves only and flush every buffer first.
+ *
+ * Internal pages of a buffered table are not merged, so an
+ * internal page may be left with a single child.  Buffers
+ * and subtree counts (HDR_COUNTED) exclude each other.
+ */
+
+// Message kinds.
+#define MSG_INSERT  0       // insert unless the key is there
+#define MSG_UPSERT  1       // insert or overwrite
+#define MSG_DELETE  2
+
+// Set when the opened table is buffered.
+extern bool tree_buffered;
+
+void buf_fold(buf_msg * o, const buf_msg * m);
+void buf_apply(const buf_msg * m, int n);
+void buf_put(int key, int op, const char * value);
+int buf_find(int key, char * value);
+int64_t buf_flush_all(void);
+void buf_scan_lock(void);
+
+// C API.
+
+int db_enable_buffers(void);
+int db_flush_buffers(void);
+
+#endif /* __BUF_H__*/
@@ -0,0 +1,31 @@
+#ifndef __BULK_H__
+#define __BULK_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Parallel bottom-up bulk build.
+ * The whole tree is laid out in one preallocated range of
+ * pages, level after level, so the page number, children and
+ * right sibling of every page follow from its position.
+ * Worker threads build the leaves and the lower internal
+ * levels by key range without talking to each other; the
+ * few pages of the top levels are built by the caller.
+ */
+
+// Fraction of each page filled by the build.
+#define BULK_DEFAULT_FILL 0.9
+
+int db_bulk_load(int n, const int keys[], char values[][120], int threads,
+        double fill);
+
+#endif /* __BULK_H__*/
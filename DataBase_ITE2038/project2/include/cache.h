@@ -0,0 +1,115 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "file.h"
+#include "pin.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Leaf page cache.
+ * A fixed number of frames holding leaf pages, filled by
+ * reads that miss and written through by file_write_page,
+ * so a frame always matches the file.  A frame whose index
+ * sits in a pinned parent (SWZ_LEAF) is unswizzled before
+ * it is replaced.
+ *
+ * The frames are split into shards by page number, each
+ * with its own latch, hash table and replacement state, so
+ * threads missing on different pages do not meet.  Hits
+ * through a swizzled entry take no latch at all: a frame
+ * carries a sequence number, odd while the frame is being
+ * written, and a reader copying the page checks it did not
+ * move, nor the entry, before it trusts the copy.  Hits only
+ * set a reference bit for the same reason.
+ *
+ * Frames of a shard are replaced by one of two policies:
+ * CACHE_CLOCK  the clock algorithm over its frames.
+ * CACHE_2Q     2Q (Johnson and Shasha).  A page read in
+ *              enters a FIFO probation queue, A1in, of
+ *              CACHE_2Q_IN percent of the frames, where hits
+ *              do not count.  Pages leaving it are remembered
+ *              in a ghost queue, A1out, of CACHE_2Q_OUT percent
+ *              of the frames, and one read in again while
+ *              remembered enters the main queue, Am, which
+ *              gives referenced pages a second chance.
+ *
+ * Pages read in while cache_scan is set, by scans and by
+ * the compactor, go on a scan queue under either policy,
+ * and are replaced before any other page.  Hits while
+ * cache_scan is set do not count, and the first one that
+ * does moves the page on to the policy.  A scan over the
+ * rspn chain thus recycles its own frames instead of
+ * pushing the working set out.
+ */
+
+#define CACHE_DEFAULT_FRAMES 1024
+
+// Shards, a power of two, cut down to keep CACHE_SHARD_MIN frames each.
+#define CACHE_DEFAULT_SHARDS 16
+#define CACHE_SHARD_MIN 64
+
+enum cache_policy {
+    CACHE_CLOCK,
+    CACHE_2Q
+};
+
+#define CACHE_DEFAULT_POLICY CACHE_2Q
+
+// Queue sizes of 2Q, in percent of the frames.
+#define CACHE_2Q_IN  25
+#define CACHE_2Q_OUT 50
+
+// Queue a frame is on.
+enum cache_queue {
+    CQ_FREE,
+    CQ_CLOCK,
+    CQ_IN,                          // 2Q A1in
+    CQ_MAIN,                        // 2Q Am
+    CQ_SCAN,                        // read in by a scan, not hit since
+    CQ_COUNT
+};
+
+typedef struct cache_frame {
+    uint32_t seq;                   // odd while pn or page changes
+    pagenum_t pn;                   // 0 while the frame is free
+    page_t * page;
+    bool ref;                       // reference bit
+    uint8_t queue;                  // enum cache_queue
+    uint16_t shard;
+    pin_frame * swz_parent;         // frame holding our tagged index
+    struct cache_frame * hnext;
+    struct cache_frame * prev, * next;  // queue links, head is most recent
+} cache_frame;
+
+// Set by a thread while it reads pages as a scan.
+extern __thread bool cache_scan;
+
+void cache_lock_all(void);
+void cache_unlock_all(void);
+void cache_reset(void);
+bool cache_read(pagenum_t pn, page_t * dest);
+void cache_install(pagenum_t pn, const page_t * src);
+void cache_update(pagenum_t pn, const page_t * src);
+void cache_drop(pagenum_t pn);
+pagenum_t cache_frame_pn(uint32_t idx);
+int64_t cache_index(pagenum_t pn, pin_frame * parent);
+pagenum_t cache_read_child(pin_frame * parent, int i, page_t * dest);
+void cache_swizzle(pin_frame * parent, int i, pagenum_t pn);
+
+// C API.
+
+void db_cache_set_frames(uint32_t frames);
+void db_cache_set_policy(enum cache_policy policy);
+void db_cache_set_shards(uint32_t shards);
+
+#endif /* __CACHE_H__*/
@@ -0,0 +1,55 @@
+#ifndef __COMPACT_H__
+#define __COMPACT_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "file.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Background compaction.
+ * Deletes only merge a leaf once it is empty (Delayed Merge),
+ * so delete-heavy tables are left with sparse leaves.  A
+ * compactor thread takes the leaves deletes left under half
+ * full, and pairs of them with a sibling under the same
+ * parent: two leaves that fit in COMPACT_FILL percent of one
+ * are merged, and a leaf under COMPACT_LOW percent full is
+ * evened out with its sibling otherwise.  Once more leaves
+ * were left than COMPACT_QUEUE, it goes over every sibling
+ * pair of the tree instead.
+ *
+ * Each pair is one write operation of its own under the
+ * exclusive db_latch, and the thread keeps to a budget of
+ * page reads and writes per second, so deletes stay as
+ * they are and foreground work is held up for one pair at
+ * a time.  db_compact goes over the whole tree at once,
+ * without a budget.
+ */
+
+// Fill, in percent of a leaf, below which leaves are worked on.
+#define COMPACT_FILL 80
+#define COMPACT_LOW  25
+
+// Leaves left under half full that are remembered.
+#define COMPACT_QUEUE 1024
+
+// Compactor wakeup period.
+#define COMPACT_TICK_MS 50
+
+void compact_reset(void);
+void compact_open(void);
+void compact_note(int key, int kcnt);
+
+// C API.
+
+int db_compact_start(uint32_t pages_per_sec);
+int64_t db_compact(void);
+
+#endif /* __COMPACT_H__*/
@@ -15,12 +15,54 @@
 
 extern FILE * fp_db;
 
+/* Page size of a table is chosen when the table is created
+ * and recorded in its header page.  Every page of the file,
+ * including the header page, has that size.
+ */
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+
+/* On-disk layout units, budgeted per entry rather than taken
+ * from the structs below.  The page header uses 124 of its 128
+ * bytes (fields + sibling page number), a leaf record 124 of
+ * 128 (key + value) and an internal entry 8 of 16 (key + page
+ * number).  The spare bytes of a leaf record let a buffered
+ * message, which adds an op to it, fit the same unit; those of
+ * the internal entries hold INTL_COUNTS.
+ * Capacities of a page follow from the page size.
+ */
+#define PAGE_HEADER_SIZE 128
+#define LEAF_RECORD_SIZE 128
+#define INTL_RECORD_SIZE 16
+
+#define LEAF_CAPACITY(psz) (((psz) - PAGE_HEADER_SIZE) / LEAF_RECORD_SIZE)
+#define INTL_CAPACITY(psz) (((psz) - PAGE_HEADER_SIZE) / INTL_RECORD_SIZE)
+
+// Header flags.
+#define HDR_COUNTED 0x1     // internal entries carry subtree record counts
+#define HDR_SHADOW  0x2     // pages are shadowed through a page map, see shadow.h
+#define HDR_LOGGED  0x4     // page writes go through the log, see wal.h
+#define HDR_BUFFERED 0x8    // internal pages buffer messages, see buf.h
+#define HDR_INGEST  0x10    // writes go through the ingest tier, see ingest.h
+
+/* Capacities of an internal page on a HDR_BUFFERED table:
+ * a sixteenth of the entries, the rest of the page holding
+ * messages of LEAF_RECORD_SIZE bytes.
+ */
+#define BUF_INTL_CAPACITY(psz) (INTL_CAPACITY(psz) / 16)
+#define BUF_MSG_CAPACITY(psz) (((psz) - PAGE_HEADER_SIZE \
+            - BUF_INTL_CAPACITY(psz) * INTL_RECORD_SIZE) / LEAF_RECORD_SIZE)
+
 /* Subelement of Page */
 
 typedef uint64_t pagenum_t;
 
+// Page size of the opened table. Set by file_open_table.
+extern uint32_t page_size;
+
 typedef struct _page_t {
-    char rsvd[4096];
+    char rsvd[MAX_PAGE_SIZE];
 } page_t;
 
 
@@ -30,6 +72,10 @@ typedef struct _hdr_page {
             int fpn;        // Free Page Number
             int rpn;        // Root Page Number
             int pcnt;       // Page Count (Number of Page). Modified in file layer
+            int psz;        // Page Size in bytes
+            int flags;      // HDR_* bits
+            int mpn;        // Page map root, on HDR_SHADOW tables
+            int64_t clsn;   // Checkpoint LSN, on HDR_LOGGED tables
         };
         page_t rsvd;
     };
@@ -42,39 +88,75 @@ typedef struct _free_page {
     };
 } FreePage;
 
+/* Internal and leaf pages are padded to a whole page_t, since
+ * pages are read and written page_size bytes at a time and the
+ * entries of a MAX_PAGE_SIZE page do not fill it.
+ */
 typedef struct _intl_page {
     union {
         struct {
-            int ppn;              // Next Free Page Number or Parent Page Number
-            bool is_leaf;
-            unsigned char kcnt;     // Key Count (Number of Keys).
+            union {
+                struct {
+                    int nfpn;             // Next Free Page Number, while the page is free
+                    bool is_leaf;
+                    int kcnt;               // Key Count (Number of Keys).
+                    int mcnt;               // Buffered messages, on HDR_BUFFERED tables
+                };
+                char rsvd[120];
+            };
+            int lspn;      // Left Most Sibling Page Number
+            struct {
+                int key;
+                int pn;
+            } records[INTL_CAPACITY(MAX_PAGE_SIZE)];  // INTL_CAPACITY(page_size) used
         };
-        char rsvd[120];
+        page_t pad;
     };
-    int lspn;      // Left Most Sibling Page Number
-    struct {
-        int key;
-        int pn;
-    } records[248];
 } InternalPage;
 
+/* Subtree record counts of an internal page, kept past the
+ * last entry a page of page_size can hold, in the 8 bytes
+ * per entry the INTL_RECORD_SIZE budget leaves unused.  Only kept on HDR_COUNTED tables.
+ * INTL_COUNTS(ip)[0] counts lspn, INTL_COUNTS(ip)[i + 1] records[i].pn.
+ */
+#define INTL_COUNTS(ip) ((uint32_t *)&(ip)->records[INTL_CAPACITY(page_size)])
+
+/* A message buffered in an internal page, see buf.h.
+ * The mcnt messages of a page follow its entries, in key order.
+ */
+typedef struct _buf_msg {
+    int key;
+    char value[120];
+    int op;
+} buf_msg;
+
+#define INTL_MSGS(ip) ((buf_msg *)((char *)(ip) + PAGE_HEADER_SIZE \
+            + BUF_INTL_CAPACITY(page_size) * INTL_RECORD_SIZE))
+
 typedef struct _leaf_page {
     union {
         struct {
-            int ppn;              // Next Free Page Number or Parent Page Number
-            bool is_leaf;
-            unsigned char kcnt;     // Key Count (Number of Keys). 
+            union {
+                struct {
+                    int nfpn;             // Next Free Page Number, while the page is free
+                    bool is_leaf;
+                    int kcnt;               // Key Count (Number of Keys).
+                };
+                char rsvd[120];
+            };
+            int rspn;      // Right Sibling Page Number
+            struct {
+                int key;
+                char value[120];
+            } records[LEAF_CAPACITY(MAX_PAGE_SIZE)];  // LEAF_CAPACITY(page_size) used
         };
-        char rsvd[120];
+        page_t pad;
     };
-    int rspn;      // Right Sibling Page Number
-    struct {
-        int key;
-        char value[120];
-    } records[31];
 } LeafPage;
 
-FILE * fp_db;
+bool file_valid_page_size(uint32_t psz);
+
+int file_open_table(const char * pathname, uint32_t psz);
 
 pagenum_t file_alloc_page(void);
 
@@ -84,4 +166,6 @@ void file_read_page(pagenum_t pagenum, page_t* dest);
 
 void file_write_page(pagenum_t pagenum, const page_t* src);
 
+void file_commit(void);
+
 #endif /* __FILE_H__*/
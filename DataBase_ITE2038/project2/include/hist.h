@@ -0,0 +1,81 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Latency histograms.
+ * Buckets are log-linear as in HdrHistogram: each power
+ * of two is cut into HIST_SUB_BUCKETS linear sub-buckets,
+ * so any recorded value is known within about 3%.
+ * Recording is a few relaxed atomic adds, no lock is taken.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+// Values up to 2^HIST_MAX_BITS ns (about 39 hours) are kept apart.
+#define HIST_MAX_BITS 47
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 2) * HIST_SUB_BUCKETS)
+
+// Histograms, one per API call and per internal phase.
+enum hist_id {
+    HIST_FIND,
+    HIST_INSERT,
+    HIST_DELETE,
+    HIST_SCAN,
+    HIST_UPDATE,        // upsert, update and compare-and-swap
+    HIST_DESCENT,       // find_leaf, root to leaf
+    HIST_LEAF_MODIFY,   // in-place change of a leaf
+    HIST_SPLIT,         // leaf split and its cascade up the tree
+    HIST_IO_WAIT,       // time spent in file reads and writes
+    HIST_COUNT
+};
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+extern bool hist_enabled;
+
+static inline uint64_t hist_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Start of a timed section, 0 when recording is off.
+static inline uint64_t hist_start(void) {
+    return hist_enabled ? hist_now() : 0;
+}
+
+void hist_record(enum hist_id id, uint64_t ns);
+
+// End of a timed section started by hist_start.
+static inline void hist_end(enum hist_id id, uint64_t t0) {
+    if (t0 != 0)
+        hist_record(id, hist_now() - t0);
+}
+
+// C API.
+
+void db_hist_enable(bool on);
+void db_hist_snapshot(enum hist_id id, histogram * out, bool reset);
+void db_hist_reset(void);
+uint64_t db_hist_percentile(const histogram * h, double p);
+const char * db_hist_name(enum hist_id id);
+void db_hist_print(FILE * out, bool json);
+
+#endif /* __HIST_H__*/
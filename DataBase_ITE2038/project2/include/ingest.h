@@ -0,0 +1,66 @@
+#ifndef __INGEST_H__
+#define __INGEST_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "file.h"
+#include "buf.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Ingest tier.
+ * On a table with HDR_INGEST set, writes do not go to the
+ * tree: each one is logged and kept in an in-memory skiplist,
+ * one entry per key holding a MSG_* message, so a write costs
+ * a log append and its commit.  Lookups check the skiplist
+ * before the tree.
+ *
+ * A merge thread freezes the skiplist once it holds
+ * INGEST_MERGE_AT entries, or once writes pause, and merges
+ * the frozen one into the tree in key order, INGEST_BATCH
+ * entries per exclusive db_latch, a leaf read and written
+ * once for all of its entries.  Writes go on into a fresh
+ * skiplist meanwhile; past INGEST_MAX_ENTRIES they wait.
+ *
+ * The skiplists are rebuilt from the log after a restart:
+ * the log is kept from the oldest entry not merged yet (see
+ * wal_hold).  The tier needs a logged table without subtree
+ * counts.  Scans merge it first.
+ */
+
+// Entries that make the merge thread freeze the skiplist.
+#define INGEST_MERGE_AT (1 << 16)
+
+// Entries at which writes wait for the merge thread.
+#define INGEST_MAX_ENTRIES (4 * INGEST_MERGE_AT)
+
+// Entries merged per exclusive db_latch.
+#define INGEST_BATCH 1024
+
+// Merge thread wakeup period.
+#define INGEST_TICK_MS 100
+
+// Set when the opened table has the ingest tier.
+extern bool ingest_on;
+
+void ingest_reset(void);
+void ingest_open(bool on);
+void ingest_replay(const buf_msg * m, uint64_t lsn);
+void ingest_wait(void);
+void ingest_put(int key, int op, const char * value);
+int ingest_find(int key, char * value);
+int64_t ingest_drain(void);
+
+// C API.
+
+int db_enable_ingest(void);
+int db_flush_ingest(void);
+
+#endif /* __INGEST_H__*/
@@ -0,0 +1,42 @@
+#ifndef __OST_H__
+#define __OST_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "file.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Order statistics.
+ * On a table with HDR_COUNTED set, every internal entry also
+ * holds the number of records under its child (INTL_COUNTS),
+ * so counting a range, ranking a key and selecting the k-th
+ * key take one descent each.  Tables without counts answer
+ * the same calls by scanning.
+ */
+
+// Path of a descent, declared in bpt.h.
+struct descent;
+
+// Set when the opened table keeps subtree counts.
+extern bool tree_counted;
+
+uint32_t ost_page_count(page_t * page);
+uint32_t ost_subtree_count(pagenum_t pn);
+void ost_fix_path(const struct descent * d, pagenum_t pn);
+
+// C API.
+
+int db_enable_counts(void);
+int64_t db_count_range(int key_start, int key_end);
+int64_t db_rank(int key);
+int db_select(int64_t k, int * key, char * value);
+
+#endif /* __OST_H__*/
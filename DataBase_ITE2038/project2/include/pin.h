@@ -0,0 +1,75 @@
+#ifndef __PIN_H__
+#define __PIN_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "file.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Resident upper levels.
+ * Every internal page of the opened table is kept in memory,
+ * loaded when the table is opened and written through by
+ * file_write_page afterwards, and never evicted.  Frames come
+ * from a region that grows by PIN_CHUNK frames as the tree
+ * does.
+ *
+ * Frame images are swizzled: an entry (lspn or records[i].pn)
+ * whose child is resident holds a tagged frame index instead
+ * of the page number, SWZ_PIN for a pinned frame and SWZ_LEAF
+ * for a leaf cache frame, so a descent follows them without
+ * any hash lookup and reads a cached leaf straight from its
+ * frame.  Copies handed out by file_read_page are unswizzled,
+ * and images written through are swizzled again, so the
+ * on-disk InternalPage format never sees a tag.
+ */
+
+// Frames added to the region at a time.
+#define PIN_CHUNK 64
+
+// Swizzled entries. Page numbers stay below 2^30.
+#define SWZ_PIN  0x80000000u
+#define SWZ_LEAF 0x40000000u
+#define SWZ_MASK 0x3fffffffu
+
+typedef struct pin_frame {
+    pagenum_t pn;                   // 0 while the frame is free
+    uint32_t idx;                   // index tagged by SWZ_PIN
+    InternalPage * page;            // page_size bytes of image
+    struct pin_frame * swz_parent;  // frame holding our tagged index
+    struct pin_frame * hnext;
+} pin_frame;
+
+// Entry i of an internal page: 0 is lspn, i is records[i - 1].pn.
+static inline uint32_t * pin_entry(InternalPage * ip, int i) {
+    return (uint32_t *)(i == 0 ? &ip->lspn : &ip->records[i - 1].pn);
+}
+
+// Path of a descent, declared in bpt.h.
+struct descent;
+
+// Root page number, mirrored from the header page.
+extern pagenum_t pin_rpn;
+
+// Bumped whenever a frame changes, so a path kept aside can tell it is stale.
+extern uint64_t pin_epoch;
+
+void pin_reset(void);
+void pin_load(pagenum_t rpn);
+void pin_link(void);
+pin_frame * pin_lookup(pagenum_t pn);
+pin_frame * pin_frame_at(uint32_t idx);
+void pin_copy(pin_frame * f, page_t * dest);
+void pin_update(pagenum_t pn, const page_t * src);
+void pin_drop(pagenum_t pn);
+pagenum_t pin_find_leaf(int key, struct descent * d);
+pagenum_t pin_read_leaf(int key, page_t * dest);
+
+#endif /* __PIN_H__*/
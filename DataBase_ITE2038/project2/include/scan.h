@@ -0,0 +1,57 @@
+#ifndef __SCAN_H__
+#define __SCAN_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Parallel range scans.
+ * The key range is cut into sub-ranges at the separator keys
+ * of the upper internal levels, so each sub-range covers about
+ * the same number of subtrees, and every sub-range is scanned
+ * along its own rspn chain on a worker thread.
+ */
+
+// Sub-trees looked for per worker before the range is cut.
+#define SCAN_SPLIT_FANOUT 4
+
+// Workers used by the a command.
+#define SCAN_DEFAULT_THREADS 4
+
+// Records a part of an ordered scan holds back before its turn.
+#define SCAN_QUEUE_RECORDS 1024
+
+/* Called for each record found.  A non-zero return stops the scan.
+ * Unordered scans call it from the workers, concurrently;
+ * ordered ones from one worker at a time.
+ */
+typedef int (* scan_cb)(int key, const char * value, void * arg);
+
+/* Range aggregates, computed inside the scan loop over the
+ * leaf records.  Values are summed as numbers (strtod); values
+ * that are not numbers are left out of sum and avg.
+ */
+typedef struct db_agg {
+    int64_t count;      // records in the range
+    int min_key;        // valid when count > 0
+    int max_key;
+    int64_t nvalues;    // numeric values summed
+    double sum;
+} db_agg;
+
+int db_scan_parallel(int key_start, int key_end, int threads, bool ordered,
+        scan_cb cb, void * arg);
+int db_aggregate_range(int key_start, int key_end, int threads, bool sum,
+        db_agg * out);
+double db_agg_avg(const db_agg * agg);
+void db_agg_print(FILE * out, const db_agg * agg);
+
+#endif /* __SCAN_H__*/
@@ -0,0 +1,64 @@
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Table server.
+ * Owns the opened table and serves it over a Unix domain
+ * socket (and optionally TCP) with a small pool of worker
+ * threads sharing one epoll instance.
+ *
+ * Wire format, little-endian.  Every message is a 16 byte
+ * header followed by blen bytes of body:
+ *
+ *   request:  uint32 blen, uint8 op, uint8 rsvd[3], uint32 id, uint32 rsvd
+ *     SRV_FIND    body: int64 key
+ *     SRV_INSERT  body: int64 key, value bytes (at most 119)
+ *     SRV_DELETE  body: int64 key
+ *     SRV_SCAN    body: int64 key_start, int64 key_end, uint32 limit
+ *                 keys are ints: the range is cut to the int range
+ *
+ *   response: uint32 blen, uint8 op, uint8 status, uint8 rsvd[2], uint32 id,
+ *             uint32 rsvd
+ *     SRV_FIND    body: value bytes when status is SRV_OK
+ *     SRV_INSERT  status SRV_EXISTS when the key is already there
+ *     SRV_SCAN    body: uint32 count, then count times
+ *                 int64 key, uint8 vlen, value bytes
+ *
+ * Requests may be pipelined: a client can send many requests
+ * before reading any response.  Responses of one connection
+ * come back in request order, carrying the request id.
+ */
+
+#define SRV_FIND    1
+#define SRV_INSERT  2
+#define SRV_DELETE  3
+#define SRV_SCAN    4
+
+#define SRV_OK          0
+#define SRV_NOT_FOUND   1
+#define SRV_ERROR       2
+#define SRV_BAD_REQUEST 3
+#define SRV_EXISTS      4
+
+#define SRV_HDR_SIZE 16
+// Largest body a request may carry.
+#define SRV_MAX_BODY 4096
+// Most records a scan returns, whatever limit asks for.
+#define SRV_MAX_SCAN 4096
+
+#define SRV_DEFAULT_WORKERS 4
+
+int server_run(const char * unix_path, int tcp_port, int workers);
+
+#endif /* __SERVER_H__*/
@@ -0,0 +1,61 @@
+#ifndef __SHADOW_H__
+#define __SHADOW_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "file.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Shadow paging.
+ * On a table with HDR_SHADOW set, the page numbers the tree
+ * uses are logical.  A page map turns them into the physical
+ * pages of the file, and a page is never overwritten once a
+ * commit has made it part of the table: its next version goes
+ * to a free physical page.
+ *
+ * The map is kept in map pages of SHADOW_MAP_ENTRIES physical
+ * page numbers, listed by the map root page.  A commit writes
+ * the map pages that changed and a new map root to free pages,
+ * then swaps HeaderPage.mpn in the header page, which is the
+ * only page written in place.  Until then the header lives in
+ * memory, so a crash leaves the table as of the last commit.
+ *
+ * Every write operation commits before it releases db_latch.
+ * A snapshot keeps the map root of a commit and reads the
+ * table as of that commit without any latch.  Page versions
+ * superseded by a commit are recycled once no snapshot taken
+ * before it remains.
+ */
+
+// Physical page numbers a map page holds.
+#define SHADOW_MAP_ENTRIES (page_size / sizeof(uint32_t))
+
+typedef struct db_snapshot db_snapshot;
+
+// Set when the opened table is shadow paged.
+extern bool shadow_on;
+
+void shadow_reset(void);
+void shadow_load(void);
+void shadow_read_header(page_t * dest);
+void shadow_write_header(const page_t * src);
+pagenum_t shadow_locate(pagenum_t pn);
+pagenum_t shadow_place(pagenum_t pn);
+void shadow_commit(void);
+
+// C API.
+
+int db_enable_shadow(void);
+db_snapshot * db_snapshot_open(void);
+int db_snapshot_find(db_snapshot * snap, int64_t key, char * value);
+void db_snapshot_close(db_snapshot * snap);
+
+#endif /* __SHADOW_H__*/
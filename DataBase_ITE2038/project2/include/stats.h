@@ -0,0 +1,101 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Engine statistics.
+ * Each thread counts into its own block, so the
+ * hot paths pay one non-atomic increment.  Blocks
+ * are summed when a snapshot is taken.
+ */
+
+// Counters.
+enum stats_counter {
+    STAT_PAGE_READ,         // pages read from the file
+    STAT_PAGE_WRITE,        // pages written to the file
+    STAT_CACHE_HIT,         // page requests served from memory
+    STAT_CACHE_MISS,        // page requests that went to the file
+    STAT_PAGE_ALLOC,        // pages handed out by file_alloc_page
+    STAT_PAGE_FREE,         // pages returned by file_free_page
+    STAT_FREELIST_HIT,      // allocations served by the free list
+    STAT_FILE_EXTEND,       // allocations that grew the file
+    STAT_LEAF_SPLIT,
+    STAT_INTL_SPLIT,
+    STAT_NEW_ROOT,
+    STAT_MERGE,
+    STAT_REDISTRIBUTE,
+    STAT_FIND,
+    STAT_INSERT,
+    STAT_DELETE,
+    STAT_AHI_HIT,           // finds answered by the adaptive hash index
+    STAT_AHI_PROMOTE,       // keys added to the adaptive hash index
+    STAT_COMMIT,            // write operations committed, shadow paged or logged
+    STAT_PAGE_RECYCLE,      // shadowed page versions freed for reuse
+    STAT_LOG_RECORD,        // records appended to the write-ahead log
+    STAT_CHECKPOINT,        // checkpoints that moved the checkpoint LSN
+    STAT_UPDATE,            // upserts, updates and compare-and-swaps
+    STAT_BUF_FLUSH,         // message batches sent down to a child
+    STAT_INGEST_MERGE,      // ingest tier entries merged into the tree
+    STAT_APPEND_FAST,       // writes that took the kept right edge path
+    STAT_COMPACT_MERGE,     // leaves merged away by compaction
+    STAT_COMPACT_EVEN,      // leaf pairs evened out by compaction
+    STAT_LEAF_HIT,          // leaf reads served by the leaf cache
+    STAT_LEAF_MISS,         // leaf reads the leaf cache missed
+    STAT_CACHE_PROMOTE,     // leaves taken into the 2Q main queue
+    STAT_COUNT
+};
+
+// Splits are also counted by level, leaves being level 0.
+#define STATS_MAX_LEVEL 8
+
+typedef struct stats_block {
+    uint64_t c[STAT_COUNT];
+    uint64_t split[STATS_MAX_LEVEL];
+    int cascade;                // level of the last split of this thread
+    bool in_use;
+    struct stats_block * next;
+} stats_block;
+
+// Aggregated statistics, as returned by db_stats_snapshot.
+typedef struct db_stats {
+    uint64_t c[STAT_COUNT];
+    uint64_t split[STATS_MAX_LEVEL];
+    int height;                 // tree height in edges, -1 if empty
+} db_stats;
+
+extern __thread stats_block * stats_tls;
+
+stats_block * stats_register(void);
+
+static inline void stats_add(enum stats_counter c, uint64_t n) {
+    stats_block * b = stats_tls;
+    if (b == NULL)
+        b = stats_register();
+    b->c[c] += n;
+}
+
+static inline void stats_inc(enum stats_counter c) {
+    stats_add(c, 1);
+}
+
+void stats_split(bool is_leaf);
+void stats_set_height(int height);
+
+// C API.
+
+void db_stats_snapshot(db_stats * st);
+void db_stats_reset(void);
+const char * db_stats_name(enum stats_counter c);
+void db_stats_print(FILE * out, const db_stats * st);
+
+#endif /* __STATS_H__*/
@@ -0,0 +1,61 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Per-query I/O tracing.
+ * One operation in trace_sample is traced: the operation
+ * itself, every page it touches (served from memory or read
+ * from disk) with the time spent on it, and the splits and
+ * merges it triggers.  Events go to a fixed-size ring buffer
+ * and are dumped in the Chrome trace event format, which
+ * chrome://tracing and Perfetto load.
+ */
+
+// Events kept. Older events are overwritten.
+#define TRACE_RING 65536
+
+enum trace_type {
+    TRACE_OP,           // a db_* call, key is the key
+    TRACE_PAGE_READ,    // key is the page number
+    TRACE_PAGE_WRITE,
+    TRACE_SPLIT,        // key is the page split
+    TRACE_MERGE,
+    TRACE_NEW_ROOT
+};
+
+// Where a page came from.
+enum trace_src {
+    TRACE_DISK,
+    TRACE_CACHE
+};
+
+// Sample every trace_sample-th operation, 0 means off.
+extern uint32_t trace_sample;
+
+// Set while the calling thread runs a sampled operation.
+extern __thread bool trace_active;
+
+void trace_op_begin(const char * name, int64_t key);
+void trace_op_end(void);
+void trace_page(enum trace_type type, uint64_t pn, enum trace_src src,
+        uint64_t t0, uint64_t t1);
+void trace_event(enum trace_type type, uint64_t pn);
+
+// C API.
+
+void db_trace_enable(uint32_t sample_every);
+void db_trace_clear(void);
+void db_trace_dump(FILE * out);
+
+#endif /* __TRACE_H__*/
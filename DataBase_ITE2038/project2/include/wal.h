@@ -0,0 +1,70 @@
+#ifndef __WAL_H__
+#define __WAL_H__
+
+// Uncomment the line below if you are compiling on Windows.
+// #define WINDOWS
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "file.h"
+#ifdef WINDOWS
+#define bool char
+#define false 0
+#define true 1
+#endif
+
+/* Write-ahead logging with fuzzy checkpoints.
+ * On a table with HDR_LOGGED set, a page write appends the
+ * page image to the log and leaves the page dirty in memory;
+ * the data file is not touched.  Every write operation ends
+ * with a commit record and one log sync.
+ *
+ * A checkpointer thread writes dirty pages back, oldest first,
+ * copying them out under the shared db_latch a batch at a time
+ * so writers are only held up for the copies.  After a round
+ * the oldest log record still needed, the smallest first-dirty
+ * LSN, goes to HeaderPage.clsn and older log segments are
+ * removed.  Recovery replays the committed records from clsn.
+ *
+ * How far the log may run ahead of clsn follows a recovery time
+ * target and the rate at which page writes were seen to go, so
+ * the checkpointer writes just enough to keep recovery within
+ * the target.
+ *
+ * The ingest tier (ingest.h) logs its entries as records of
+ * their own and holds clsn back to the oldest one not merged
+ * into the tree yet; recovery hands them back to it.
+ */
+
+// The log is kept in files <table>.wal.<n> of this size.
+#define WAL_SEGMENT_SIZE (16u << 20)
+
+// Recovery time target in seconds, unless set otherwise.
+#define WAL_DEFAULT_RECOVERY_SECS 2.0
+
+// Page write rate assumed, bytes/s, until one is measured.
+#define WAL_DEFAULT_WRITE_RATE (64.0 * (1 << 20))
+
+// Checkpointer wakeup period and pages written per batch.
+#define WAL_CKPT_TICK_MS 100
+#define WAL_CKPT_BATCH 64
+
+// Set when the opened table is logged.
+extern bool wal_on;
+
+void wal_reset(void);
+void wal_open(const char * pathname, bool logged);
+bool wal_read(pagenum_t pn, page_t * dest);
+void wal_write(pagenum_t pn, const page_t * src);
+void wal_commit(void);
+uint64_t wal_log(const void * rec, uint32_t len);
+void wal_hold(uint64_t lsn);
+
+// C API.
+
+int db_enable_wal(void);
+int db_checkpoint(void);
+void db_wal_set_recovery_target(double seconds);
+
+#endif /* __WAL_H__*/
@@ -0,0 +1,151 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  ahi.c
+ *
+ *    Description:  Adaptive hash index for hot point lookups.
+ *
+ *                  The index is a direct-mapped table.  Readers run
+ *                  concurrently under the shared db_latch and add
+ *                  entries themselves, so every entry is guarded by
+ *                  a sequence number: odd while an entry is being
+ *                  written, bumped by two when done.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <limits.h>
+#include <string.h>
+#include "ahi.h"
+#include "bpt.h"
+#include "stats.h"
+
+typedef struct ahi_entry {
+    uint32_t seq;
+    int key;
+    int slot;
+    uint32_t ver;       // version of the leaf when the entry was made
+    pagenum_t pn;       // 0 for an empty entry
+} ahi_entry;
+
+bool ahi_enabled = false;
+uint32_t ahi_ver[AHI_VERSIONS];
+
+static ahi_entry ahi_table[AHI_SIZE];
+static uint8_t ahi_heat[AHI_SIZE];
+static uint32_t ahi_notes;
+
+
+static inline uint32_t ahi_hash(int key) {
+    return ((uint32_t)key * 2654435761u) >> (32 - AHI_BITS);
+}
+
+
+static inline uint32_t page_version(pagenum_t pn) {
+    return __atomic_load_n(&ahi_ver[pn & (AHI_VERSIONS - 1)], __ATOMIC_RELAXED);
+}
+
+
+/* Copies the value of key to value if the index holds key and
+ * its leaf has not changed since.  Returns 0, or -1 when the
+ * caller has to descend.
+ */
+int ahi_lookup(int64_t key, char * value) {
+    ahi_entry * e;
+    LeafPage lp;
+    uint32_t s;
+    int k, slot;
+    pagenum_t pn;
+    uint32_t ver;
+
+    if (key < INT_MIN || key > INT_MAX)
+        return -1;
+    e = &ahi_table[ahi_hash((int)key)];
+    s = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+    if (s & 1)
+        return -1;
+    k = __atomic_load_n(&e->key, __ATOMIC_RELAXED);
+    slot = __atomic_load_n(&e->slot, __ATOMIC_RELAXED);
+    ver = __atomic_load_n(&e->ver, __ATOMIC_RELAXED);
+    pn = __atomic_load_n(&e->pn, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) != s)
+        return -1;
+    if (pn == 0 || k != key || ver != page_version(pn))
+        return -1;
+
+    file_read_page(pn, (page_t *)&lp);
+    if (!lp.is_leaf || slot >= lp.kcnt || lp.records[slot].key != key)
+        return -1;
+    strcpy(value, lp.records[slot].value);
+    stats_inc(STAT_AHI_HIT);
+    return 0;
+}
+
+
+static void ahi_put(ahi_entry * e, int key, pagenum_t lpn, int slot) {
+    uint32_t s = __atomic_load_n(&e->seq, __ATOMIC_RELAXED);
+
+    // Another reader is writing this entry; let it.
+    if ((s & 1) || !__atomic_compare_exchange_n(&e->seq, &s, s + 1, false,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->slot, slot, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->ver, page_version(lpn), __ATOMIC_RELAXED);
+    __atomic_store_n(&e->pn, lpn, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->seq, s + 2, __ATOMIC_RELEASE);
+    stats_inc(STAT_AHI_PROMOTE);
+}
+
+
+/* Records that a descent found key at slot of leaf lpn,
+ * and indexes key once it is hot.  Keys already indexed
+ * are refreshed at once.
+ */
+void ahi_note(int64_t key, pagenum_t lpn, int slot) {
+    ahi_entry * e;
+    uint32_t h, i;
+
+    if (key < INT_MIN || key > INT_MAX)
+        return;
+    h = ahi_hash((int)key);
+    e = &ahi_table[h];
+
+    if ((__atomic_add_fetch(&ahi_notes, 1, __ATOMIC_RELAXED) & (AHI_DECAY_PERIOD - 1)) == 0)
+        for (i = 0; i < AHI_SIZE; i++)
+            __atomic_store_n(&ahi_heat[i],
+                    __atomic_load_n(&ahi_heat[i], __ATOMIC_RELAXED) >> 1,
+                    __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&e->key, __ATOMIC_RELAXED) == key
+            && __atomic_load_n(&e->pn, __ATOMIC_RELAXED) != 0) {
+        ahi_put(e, (int)key, lpn, slot);
+        return;
+    }
+    if (__atomic_add_fetch(&ahi_heat[h], 1, __ATOMIC_RELAXED) >= AHI_PROMOTE_HITS) {
+        __atomic_store_n(&ahi_heat[h], 0, __ATOMIC_RELAXED);
+        ahi_put(e, (int)key, lpn, slot);
+    }
+}
+
+
+/* Turns the adaptive hash index on or off.
+ * It starts empty each time it is turned on.
+ */
+void db_ahi_enable(bool on) {
+    pthread_rwlock_wrlock(&db_latch);
+    if (on && !ahi_enabled) {
+        memset(ahi_table, 0, sizeof(ahi_table));
+        memset(ahi_heat, 0, sizeof(ahi_heat));
+    }
+    ahi_enabled = on;
+    pthread_rwlock_unlock(&db_latch);
+}
@@ -0,0 +1,418 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  batch.c
+ *
+ *    Description:  Headless batch command mode.
+ *                  Parses a text or binary command stream out of a
+ *                  large read buffer and writes only query results,
+ *                  through a large output buffer flushed whenever the
+ *                  input runs dry.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "batch.h"
+#include "bpt.h"
+#include "stats.h"
+#include "hist.h"
+#include "trace.h"
+#include "scan.h"
+#include "ost.h"
+#include "ahi.h"
+#include "shadow.h"
+#include "wal.h"
+#include "buf.h"
+#include "ingest.h"
+#include "compact.h"
+
+// Output buffer. stdout keeps it until the process exits.
+static char batch_obuf[BATCH_BUF_SIZE];
+
+typedef struct batch_reader {
+    FILE * in;
+    char * buf;
+    size_t pos;
+    size_t len;
+    bool eof;
+    long line;
+} batch_reader;
+
+
+/* Takes whatever input has arrived, up to the buffer size,
+ * so a pipe or socket peer gets the results of the commands
+ * it sent without waiting for a full buffer.
+ */
+static bool refill(batch_reader * r) {
+    ssize_t n;
+
+    if (r->eof)
+        return false;
+    // Keep the unread tail at the start of the buffer.
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    // Results so far go out before waiting for more commands.
+    fflush(stdout);
+    do
+        n = read(fileno(r->in), r->buf + r->len, BATCH_BUF_SIZE - r->len);
+    while (n < 0 && errno == EINTR);
+    if (n > 0)
+        r->len += n;
+    else
+        r->eof = true;
+    return r->len > 0;
+}
+
+
+// Returns the next byte without consuming it, or -1 at the end.
+static int peek(batch_reader * r) {
+    if (r->pos == r->len && !refill(r))
+        return -1;
+    return (unsigned char)r->buf[r->pos];
+}
+
+
+static int next(batch_reader * r) {
+    int c = peek(r);
+    if (c != -1)
+        r->pos++;
+    return c;
+}
+
+
+// Skips blanks, but not newlines.
+static void skip_blanks(batch_reader * r) {
+    int c;
+    while ((c = peek(r)) == ' ' || c == '\t' || c == '\r')
+        r->pos++;
+}
+
+
+static void skip_line(batch_reader * r) {
+    int c;
+    while ((c = next(r)) != -1 && c != '\n')
+        ;
+    r->line++;
+}
+
+
+static bool read_int(batch_reader * r, int64_t * out) {
+    int64_t v = 0;
+    bool neg = false, any = false;
+    int c;
+
+    skip_blanks(r);
+    if (peek(r) == '-') {
+        neg = true;
+        r->pos++;
+    }
+    while ((c = peek(r)) != -1 && isdigit(c)) {
+        v = v * 10 + (c - '0');
+        r->pos++;
+        any = true;
+    }
+    *out = neg ? -v : v;
+    return any;
+}
+
+
+// Reads a blank-delimited token of at most 119 bytes.
+static bool read_value(batch_reader * r, char * out) {
+    int c, n = 0;
+
+    skip_blanks(r);
+    while ((c = peek(r)) != -1 && !isspace(c)) {
+        if (n < 119)
+            out[n++] = (char)c;
+        r->pos++;
+    }
+    out[n] = '\0';
+    return n > 0;
+}
+
+
+static bool read_bytes(batch_reader * r, void * out, size_t n) {
+    size_t i;
+    int c;
+    for (i = 0; i < n; i++) {
+        if ((c = next(r)) == -1)
+            return false;
+        ((unsigned char *)out)[i] = (unsigned char)c;
+    }
+    return true;
+}
+
+
+static int64_t le64(const unsigned char * b) {
+    uint64_t v = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | b[i];
+    return (int64_t)v;
+}
+
+
+static void print_find(int64_t key) {
+    char value[120];
+    if (db_find(key, value) == 0)
+        printf("%lld %s\n", (long long)key, value);
+    else
+        printf("%lld -\n", (long long)key);
+}
+
+
+// Prints the DB_* outcome of a single-descent write.
+static void print_outcome(int ret) {
+    switch (ret) {
+    case DB_INSERTED:   printf("inserted\n"); break;
+    case DB_UPDATED:    printf("updated\n"); break;
+    case DB_BUFFERED:   printf("buffered\n"); break;
+    case DB_NOT_FOUND:  printf("not_found\n"); break;
+    case DB_EXISTS:     printf("exists\n"); break;
+    default:            printf("mismatch\n"); break;
+    }
+}
+
+
+/* Text commands.  Unknown or malformed commands
+ * are reported on stderr with their line number.
+ */
+static int run_text(batch_reader * r) {
+    int64_t key, key_end;
+    db_agg agg;
+    char value[120], expected[120];
+    db_stats st;
+    db_snapshot * snap = NULL;
+    int c, sel_key, errors = 0;
+
+    while ((c = next(r)) != -1) {
+        switch (c) {
+        case ' ': case '\t': case '\r':
+            continue;
+        case '\n':
+            r->line++;
+            continue;
+        case '#':
+            skip_line(r);
+            continue;
+        case 'i':
+            if (!read_int(r, &key) || !read_value(r, value))
+                goto malformed;
+            if (db_insert(key, value) != 0) {
+                fprintf(stderr, "line %ld: cannot insert %lld\n", r->line,
+                        (long long)key);
+                errors++;
+            }
+            break;
+        case 'f':
+            if (!read_int(r, &key))
+                goto malformed;
+            print_find(key);
+            break;
+        case 'd':
+            if (!read_int(r, &key))
+                goto malformed;
+            db_delete(key);
+            break;
+        case 'u':
+        case 'U':
+        case 'I':
+            if (!read_int(r, &key) || !read_value(r, value))
+                goto malformed;
+            print_outcome(c == 'u' ? db_upsert(key, value)
+                    : c == 'U' ? db_update(key, value)
+                    : db_insert_if_absent(key, value));
+            break;
+        case 'X':
+            if (!read_int(r, &key) || !read_value(r, expected) || !read_value(r, value))
+                goto malformed;
+            print_outcome(db_compare_and_swap(key, expected, value));
+            break;
+        case 'a':
+            if (!read_int(r, &key) || !read_int(r, &key_end))
+                goto malformed;
+            db_aggregate_range(key, key_end, SCAN_DEFAULT_THREADS, true, &agg);
+            db_agg_print(stdout, &agg);
+            break;
+        case 'c':
+            if (!read_int(r, &key) || !read_int(r, &key_end))
+                goto malformed;
+            printf("%lld\n", (long long)db_count_range(key, key_end));
+            break;
+        case 'k':
+            if (!read_int(r, &key))
+                goto malformed;
+            printf("%lld\n", (long long)db_rank(key));
+            break;
+        case 'K':
+            if (!read_int(r, &key))
+                goto malformed;
+            if (db_select(key, &sel_key, value) != 0)
+                printf("-\n");
+            else
+                printf("%d %s\n", sel_key, value);
+            break;
+        case 'C':
+            db_enable_counts();
+            break;
+        case 'A':
+            if (!read_int(r, &key))
+                goto malformed;
+            db_ahi_enable(key != 0);
+            break;
+        case 'W':
+            db_enable_shadow();
+            break;
+        case 'w':
+            db_enable_wal();
+            break;
+        case 'P':
+            db_checkpoint();
+            break;
+        case 'b':
+            db_enable_buffers();
+            break;
+        case 'F':
+            db_flush_buffers();
+            break;
+        case 'e':
+            db_enable_ingest();
+            break;
+        case 'E':
+            db_flush_ingest();
+            break;
+        case 'M':
+            if (!read_int(r, &key) || key < 0)
+                goto malformed;
+            db_compact_start(key);
+            break;
+        case 'm':
+            db_compact();
+            break;
+        case 'n':
+            db_snapshot_close(snap);
+            snap = db_snapshot_open();
+            break;
+        case 'N':
+            if (!read_int(r, &key))
+                goto malformed;
+            if (snap != NULL && db_snapshot_find(snap, key, value) == 0)
+                printf("%lld %s\n", (long long)key, value);
+            else
+                printf("%lld -\n", (long long)key);
+            break;
+        case 's':
+            db_stats_snapshot(&st);
+            db_stats_print(stdout, &st);
+            break;
+        case 'h':
+        case 'H':
+            db_hist_print(stdout, c == 'H');
+            break;
+        case 'g':
+            if (!read_int(r, &key))
+                goto malformed;
+            db_trace_enable(key > 0 ? (uint32_t)key : 0);
+            break;
+        case 'G':
+            db_trace_dump(stdout);
+            break;
+        case 'q':
+            db_snapshot_close(snap);
+            return errors;
+        default:
+            goto malformed;
+        }
+        skip_line(r);
+        continue;
+malformed:
+        fprintf(stderr, "line %ld: malformed command\n", r->line);
+        errors++;
+        skip_line(r);
+    }
+    db_snapshot_close(snap);
+    return errors;
+}
+
+
+static int run_binary(batch_reader * r) {
+    unsigned char hdr[9], len;
+    char magic[4];
+    char value[120];
+    int64_t key;
+    long rec = 0;
+    int errors = 0;
+
+    if (!read_bytes(r, magic, 4) || memcmp(magic, BATCH_MAGIC, 4) != 0) {
+        fprintf(stderr, "binary stream: bad magic\n");
+        return 1;
+    }
+    while (read_bytes(r, hdr, 9)) {
+        rec++;
+        key = le64(hdr + 1);
+        switch (hdr[0]) {
+        case 'i':
+            if (!read_bytes(r, &len, 1) || len > 119
+                    || !read_bytes(r, value, len)) {
+                fprintf(stderr, "record %ld: truncated insert\n", rec);
+                return errors + 1;
+            }
+            value[len] = '\0';
+            if (db_insert(key, value) != 0) {
+                fprintf(stderr, "record %ld: cannot insert %lld\n", rec,
+                        (long long)key);
+                errors++;
+            }
+            break;
+        case 'f':
+            print_find(key);
+            break;
+        case 'd':
+            db_delete(key);
+            break;
+        default:
+            fprintf(stderr, "record %ld: bad opcode 0x%02x\n", rec, hdr[0]);
+            return errors + 1;
+        }
+    }
+    return errors;
+}
+
+
+/* Runs the commands of in against the opened table.
+ * Must be called before anything is written to stdout,
+ * whose buffering it changes.
+ * Returns the number of commands that failed.
+ */
+int run_batch(FILE * in, bool binary) {
+    batch_reader r;
+    int errors;
+
+    r.in = in;
+    r.pos = r.len = 0;
+    r.eof = false;
+    r.line = 1;
+    r.buf = malloc(BATCH_BUF_SIZE);
+    if (r.buf == NULL) {
+        perror("Batch buffer.");
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(stdout, batch_obuf, _IOFBF, BATCH_BUF_SIZE);
+
+    errors = binary ? run_binary(&r) : run_text(&r);
+
+    fflush(stdout);
+    free(r.buf);
+    return errors;
+}
@@ -52,8 +52,19 @@
  *
  */
 
+#include <limits.h>
 #include "bpt.h"
 #include "file.h"
+#include "stats.h"
+#include "hist.h"
+#include "trace.h"
+#include "ost.h"
+#include "ahi.h"
+#include "pin.h"
+#include "buf.h"
+#include "ingest.h"
+#include "compact.h"
+#include "cache.h"
 
 // GLOBALS.
 
@@ -69,6 +80,15 @@
  */
 int order = DEFAULT_ORDER;
 
+/* Orders of the on-disk pages.  Unlike order,
+ * they are not chosen by the user but follow from
+ * the page size of the opened table: a leaf holds at
+ * most leaf_order - 1 records and an internal page
+ * at most intl_order - 1 keys.  See open_table.
+ */
+int leaf_order = LEAF_CAPACITY(DEFAULT_PAGE_SIZE) + 1;
+int intl_order = INTL_CAPACITY(DEFAULT_PAGE_SIZE) + 1;
+
 /* The queue is used to print the tree in
  * level order, starting from the root
  * printing each entire rank on a separate
@@ -83,12 +103,23 @@ node * queue = NULL;
  */
 bool verbose_output = false;
 
+/* Engine latch.  Lookups and scans share it,
+ * inserts and deletes hold it exclusively.
+ */
+pthread_rwlock_t db_latch = PTHREAD_RWLOCK_INITIALIZER;
+
 // Get global variable of file descriptor of datafile.
 extern FILE * fp_db;
 
 // table count
 int table_cnt = 0;
 
+/* Height of the on-disk tree in edges, -1 when
+ * the tree is empty.  Read at open_table and kept
+ * up to date as roots come and go.
+ */
+int tree_height = -1;
+
 // FUNCTION DEFINITIONS.
 
 // OUTPUT AND UTILITIES
@@ -143,16 +174,19 @@ void print_license( int license_part ) {
 /* First message to the user.
  */
 void usage_1( void ) {
-    printf("B+ Tree of Order %d.\n", order);
+    printf("B+ Tree of Page Size %u (leaf order %d, internal order %d).\n",
+            page_size, leaf_order, intl_order);
     printf("Following Silberschatz, Korth, Sidarshan, Database Concepts, "
            "5th ed.\n\n"
-           "To build a B+ tree of a different order, start again and enter "
-           "the order\n"
-           "as an integer argument:  bpt <order>  ");
-    printf("(%d <= order <= %d).\n", MIN_ORDER, MAX_ORDER);
-    printf("To start with input from a file of newline-delimited integers, \n"
-           "start again and enter the order followed by the filename:\n"
-           "bpt <order> <inputfile> .\n");
+           "To create a table with a different page size, start again and "
+           "enter the page size\n"
+           "in bytes as an integer argument:  bpt <page_size>  ");
+    printf("(%d, %d, %d, %d or %d).\n", MIN_PAGE_SIZE, MIN_PAGE_SIZE * 2,
+            MIN_PAGE_SIZE * 4, MIN_PAGE_SIZE * 8, MAX_PAGE_SIZE);
+    printf("To open a table file, start again and enter the page size "
+           "followed by the filename:\n"
+           "bpt <page_size> <tablefile> .\n"
+           "The page size of an existing table is read from its header.\n");
 }
 
 
@@ -161,16 +195,42 @@ void usage_1( void ) {
 void usage_2( void ) {
     printf("Enter any of the following commands after the prompt > :\n"
     "\ti <k>  -- Insert <k> (an integer) as both key and value).\n"
+    "\tu <k> <v> -- Insert <k> with value <v>, or overwrite its value.\n"
     "\tf <k>  -- Find the value under key <k>.\n"
     "\tp <k> -- Print the path from the root to key k and its associated "
            "value.\n"
     "\tr <k1> <k2> -- Print the keys and values found in the range "
             "[<k1>, <k2>\n"
+    "\ta <k1> <k2> -- Print count, min/max key, sum and avg of the range "
+            "[<k1>, <k2>].\n"
+    "\tc <k1> <k2> -- Print the number of keys in the range [<k1>, <k2>].\n"
+    "\tk <k> -- Print the rank of <k> (the number of keys below it).\n"
+    "\tK <n> -- Print the <n>-th key and its value, counting from 0.\n"
+    "\tC -- Keep subtree record counts, making c, k and K logarithmic.\n"
+    "\tA <0|1> -- Turn the adaptive hash index for hot keys off or on.\n"
+    "\tW -- Shadow page the table: commit each write by a header swap.\n"
+    "\tn -- Take a snapshot of the last commit, dropping the one held.\n"
+    "\tN <k> -- Find the value under key <k> in the snapshot.\n"
+    "\tw -- Log writes ahead; a checkpointer writes pages back.\n"
+    "\tP -- Checkpoint now: write back every page the log holds.\n"
+    "\tb -- Buffer writes in internal pages (table without internal "
+           "pages).\n"
+    "\tF -- Flush the buffered writes down to the leaves.\n"
+    "\te -- Take writes into an in-memory ingest tier (logged table).\n"
+    "\tE -- Merge the ingest tier into the tree.\n"
+    "\tM <n> -- Compact sparse leaves in the background at <n> page I/Os "
+           "per second (0 stops).\n"
+    "\tm -- Compact the whole tree now.\n"
     "\td <k>  -- Delete key <k> and its associated value.\n"
     "\tx -- Destroy the whole tree.  Start again with an empty tree of the "
            "same order.\n"
     "\tt -- Print the B+ tree.\n"
     "\tl -- Print the keys of the leaves (bottom row of the tree).\n"
+    "\ts -- Print engine statistics (page I/O, splits, height...).\n"
+    "\th -- Print latency histograms (H for JSON).\n"
+    "\tg <n> -- Trace the page accesses of one operation in n "
+           "(0 stops tracing).\n"
+    "\tG -- Dump traced operations in Chrome trace format.\n"
     "\tv -- Toggle output of pointer addresses (\"verbose\") in tree and "
            "leaves.\n"
     "\tq -- Quit. (Or use Ctl-D.)\n"
@@ -181,8 +241,18 @@ void usage_2( void ) {
 /* Brief usage note.
  */
 void usage_3( void ) {
-    printf("Usage: ./bpt [<order>]\n");
-    printf("\twhere %d <= order <= %d .\n", MIN_ORDER, MAX_ORDER);
+    printf("Usage: ./bpt [<page_size> [<tablefile>]]\n");
+    printf("       ./bpt -b|-B <page_size> <tablefile> [<commandfile>]\n");
+    printf("\truns text (-b) or binary (-B) commands without prompts.\n");
+    printf("       ./bpt -S <page_size> <tablefile> <socketpath> "
+            "[<tcp_port> [<workers>]]\n");
+    printf("\tserves the table over a Unix domain socket (and TCP).\n");
+    printf("       ./bpt -L <page_size> <tablefile> <sortedfile> [<threads>]\n");
+    printf("\tbuilds an empty table from key-sorted \"key value\" lines.\n");
+    printf("       ./bpt -E <page_size> <tablefile> [<threads>]\n");
+    printf("\tprints every record as a \"key value\" line, in key order.\n");
+    printf("\twhere page_size is a power of two, %d <= page_size <= %d .\n",
+            MIN_PAGE_SIZE, MAX_PAGE_SIZE);
 }
 
 
@@ -331,75 +401,170 @@ void print_tree( node * root ) {
     printf("\n");
 }
 
+/* Opens the table at pathname, creating it with
+ * the default page size if it does not exist.
+ */
 int open_table(char *pathname) {
-    if ((fp_db = fopen(pathname, "r+")) != NULL)
-        return table_cnt++; 
-    return -1;
-};
+    return open_table_with_page_size(pathname, DEFAULT_PAGE_SIZE);
+}
+
+/* Opens the table at pathname, creating it with
+ * page size psz if it does not exist.  An existing
+ * table keeps the page size stored in its header page.
+ * Page orders are derived from the page size.
+ * Returns the table id, or -1 on failure.
+ */
+int open_table_with_page_size(char *pathname, uint32_t psz) {
+    HeaderPage hp;
+    if (file_open_table(pathname, psz) != 0)
+        return -1;
+    file_read_page(0, (page_t *)&hp);
+    tree_counted = (hp.flags & HDR_COUNTED) != 0;
+    tree_buffered = (hp.flags & HDR_BUFFERED) != 0;
+    leaf_order = LEAF_CAPACITY(page_size) + 1;
+    intl_order = (tree_buffered ? BUF_INTL_CAPACITY(page_size)
+            : INTL_CAPACITY(page_size)) + 1;
+    tree_height = disk_height();
+    stats_set_height(tree_height);
+    ingest_open((hp.flags & HDR_INGEST) != 0);
+    compact_open();
+    return table_cnt++;
+}
+
+
+/* Gives the height of the on-disk tree
+ * by following leftmost children down to a leaf.
+ */
+int disk_height( void ) {
+    HeaderPage hp;
+    InternalPage c;
+    pagenum_t pn;
+    int h = 0;
+
+    file_read_page(0, (page_t *)&hp);
+    pn = hp.rpn;
+    if (pn == 0)
+        return -1;
+    file_read_page(pn, (page_t *)&c);
+    while (!c.is_leaf) {
+        file_read_page(c.lspn, (page_t *)&c);
+        h++;
+    }
+    return h;
+}
 
 /* Finds the record under a given key and prints an
  * appropriate message to stdout.
  */
-void find_and_print(node * root, int key, bool verbose) {
-    Record * r = find(root, key, verbose);
-    if (r == NULL)
+void find_and_print(int key, bool verbose) {
+    char value[120];
+    bool saved = verbose_output;
+    verbose_output = verbose;
+    if (db_find(key, value) != 0)
         printf("Record not found under key %d.\n", key);
     else 
-        printf("Record at %lx -- key %d, value %d.\n",
-                (unsigned long)r, key, r->value);
+        printf("Record -- key %d, value %s.\n", key, value);
+    verbose_output = saved;
 }
 
 
-/* Finds and prints the keys, pointers, and values within a range
+/* Finds and prints the keys and values within a range
  * of keys between key_start and key_end, including both bounds.
  */
-void find_and_print_range( node * root, int key_start, int key_end,
-        bool verbose ) {
+void find_and_print_range(int key_start, int key_end, bool verbose) {
     int i;
     int array_size = key_end - key_start + 1;
-    int returned_keys[array_size];
-    void * returned_pointers[array_size];
-    int num_found = find_range( root, key_start, key_end, verbose,
-            returned_keys, returned_pointers );
+    int * returned_keys;
+    char (* returned_values)[120];
+    int num_found;
+
+    returned_keys = malloc(array_size * sizeof(int));
+    returned_values = malloc(array_size * sizeof(*returned_values));
+    if (returned_keys == NULL || returned_values == NULL) {
+        perror("Range result arrays.");
+        exit(EXIT_FAILURE);
+    }
+    num_found = find_range(key_start, key_end, verbose,
+            returned_keys, returned_values, array_size);
     if (!num_found)
         printf("None found.\n");
     else {
         for (i = 0; i < num_found; i++)
-            printf("Key: %d   Location: %lx  Value: %d\n",
-                    returned_keys[i],
-                    (unsigned long)returned_pointers[i],
-                    ((Record *)
-                     returned_pointers[i])->value);
+            printf("Key: %d   Value: %s\n",
+                    returned_keys[i], returned_values[i]);
     }
+    free(returned_keys);
+    free(returned_values);
 }
 
 
-/* Finds keys and their pointers, if present, in the range specified
- * by key_start and key_end, inclusive.  Places these in the arrays
- * returned_keys and returned_pointers, and returns the number of
- * entries found.
+/* Finds keys and their values, if present, in the range specified
+ * by key_start and key_end, inclusive.  Places at most max of them
+ * in the arrays returned_keys and returned_values, and returns the
+ * number of entries found.
  */
-int find_range( node * root, int key_start, int key_end, bool verbose,
-        int returned_keys[], void * returned_pointers[]) {
+int find_range(int key_start, int key_end, bool verbose,
+        int returned_keys[], char returned_values[][120], int max) {
     int i, num_found;
+    pagenum_t lpn;
+    LeafPage n;
+    uint64_t t0 = hist_start();
+
     num_found = 0;
-    node * n = find_leaf( root, key_start, verbose );
-    if (n == NULL) return 0;
-    for (i = 0; i < n->num_keys && n->keys[i] < key_start; i++) ;
-    if (i == n->num_keys) return 0;
-    while (n != NULL) {
-        for ( ; i < n->num_keys && n->keys[i] <= key_end; i++) {
-            returned_keys[num_found] = n->keys[i];
-            returned_pointers[num_found] = n->pointers[i];
+    trace_op_begin("scan", key_start);
+    buf_scan_lock();
+    // Leaves read by the scan stay probationary in the cache.
+    cache_scan = true;
+    lpn = find_leaf(key_start, verbose);
+    if (lpn != 0)
+        file_read_page(lpn, (page_t *)&n);
+    for (i = 0; lpn != 0 && i < n.kcnt && n.records[i].key < key_start; i++) ;
+    while (lpn != 0 && num_found < max) {
+        for ( ; i < n.kcnt && n.records[i].key <= key_end && num_found < max; i++) {
+            returned_keys[num_found] = n.records[i].key;
+            memcpy(returned_values[num_found], n.records[i].value, 120);
             num_found++;
         }
-        n = n->pointers[order - 1];
+        if (i < n.kcnt)
+            break;
+        lpn = n.rspn;
+        if (lpn != 0)
+            file_read_page(lpn, (page_t *)&n);
         i = 0;
     }
+    cache_scan = false;
+    pthread_rwlock_unlock(&db_latch);
+    trace_op_end();
+    hist_end(HIST_SCAN, t0);
     return num_found;
 }
 
 
+/* Returns the index of the child of an internal
+ * page to follow for key: 0 for lspn, i for
+ * records[i - 1].pn.
+ */
+int intl_child_index(InternalPage * ip, int key) {
+    int i = 0;
+    while (i < ip->kcnt) {
+        if (key >= ip->records[i].key) i++;
+        else break;
+    }
+    return i;
+}
+
+
+/* Returns the slot of key in a leaf page,
+ * or -1 if the leaf does not hold it.
+ */
+int leaf_key_index(LeafPage * lp, int key) {
+    int i;
+    for (i = 0; i < lp->kcnt; i++)
+        if (lp->records[i].key == key) return i;
+    return -1;
+}
+
+
 /* Traces the path from the root to a leaf, searching
  * by key.  Displays information about the path
  * if the verbose flag is set.
@@ -407,17 +572,25 @@ int find_range( node * root, int key_start, int key_end, bool verbose,
  */
 pagenum_t find_leaf(int key, bool verbose) {
     int i = 0;
+    HeaderPage hp;
     InternalPage c;    
     pagenum_t lpn;
+    uint64_t t0 = hist_start();
 
-    if (c == NULL) {
-        perror("Header Page creation.");
-        exit(EXIT_FAILURE);
+    if (!verbose) {
+        lpn = pin_find_leaf(key, NULL);
+        hist_end(HIST_DESCENT, t0);
+        return lpn;
     }
 
     // Set c as Root Page
-    lpn = ((HeaderPage) c).rpn;
-    file_read_page(lpn, &c);
+    file_read_page(0, (page_t *)&hp);
+    lpn = hp.rpn;
+    if (lpn == 0) {
+        hist_end(HIST_DESCENT, t0);
+        return 0;
+    }
+    file_read_page(lpn, (page_t *)&c);
 
     while (!c.is_leaf) {
         if (verbose) {
@@ -426,15 +599,11 @@ pagenum_t find_leaf(int key, bool verbose) {
                 printf("%d ", c.records[i].key);
             printf("%d] ", c.records[i].key);
         }
-        i = 0;
-        while (i < c.kcnt) {
-            if (key >= c.records[i].key) i++;
-            else break;
-        }
+        i = intl_child_index(&c, key);
         if (verbose)
             printf("%d ->\n", i);
-        lpn = c.records[i].key;
-        file_read_page(lpn, &c);
+        lpn = i == 0 ? c.lspn : c.records[i - 1].pn;
+        file_read_page(lpn, (page_t *)&c);
     }
 
     if (verbose) {
@@ -443,42 +612,65 @@ pagenum_t find_leaf(int key, bool verbose) {
             printf("%d ", c.records[i].key);
         printf("%d] ->\n", c.records[i].key);
     }
+    hist_end(HIST_DESCENT, t0);
     return lpn;
 }
 
 
-/* Finds and returns the record to which
- * a key refers.
+/* Like find_leaf, but records the path from the
+ * root in d for a split or merge to walk back up.
  */
-Record * find( node * root, int key, bool verbose ) {
-    int i = 0;
-    node * c = find_leaf( root, key, verbose );
-    if (c == NULL) return NULL;
-    for (i = 0; i < c->num_keys; i++)
-        if (c->keys[i] == key) break;
-    if (i == c->num_keys) 
-        return NULL;
-    else
-        return (Record *)c->pointers[i];
+pagenum_t find_leaf_path(int key, descent * d) {
+    pagenum_t lpn;
+    uint64_t t0 = hist_start();
+
+    lpn = pin_find_leaf(key, d);
+    hist_end(HIST_DESCENT, t0);
+    return lpn;
 }
 
-//Record * find( node * root, int key, bool verbose ) {
-int db_find(int64_t key, char *ret_val) {
+
+/* Looks key up without taking db_latch.
+ * Copies its value to ret_val and returns 0, or returns -1.
+ */
+int find_record(int64_t key, char *ret_val) {
     int i = 0;
-    pagenum_t lpn = find_leaf(key, verbose);
+    pagenum_t lpn;
     LeafPage c;
-    file_read_page(lpn, &c);
-
-    if (c.is_leaf != 1) return -1;
-    for (i = 0; i < c.kcnt; i++)
-        if (c.records[i].key == key) break;
-    if (i == c.kcnt) 
-        return -1;
-    else {
-        strcpy(ret_val, c.records[i].value);
+    if (tree_buffered)
+        return buf_find(key, ret_val);
+    if (ahi_enabled && ahi_lookup(key, ret_val) == 0)
         return 0;
+    if (verbose_output) {
+        lpn = find_leaf(key, true);
+        if (lpn != 0)
+            file_read_page(lpn, (page_t *)&c);
+    } else
+        lpn = pin_read_leaf(key, (page_t *)&c);
+
+    if (lpn == 0 || c.is_leaf != 1)
+        i = -1;
+    else
+        i = leaf_key_index(&c, key);
+    if (i != -1) {
+        strcpy(ret_val, c.records[i].value);
+        if (ahi_enabled)
+            ahi_note(key, lpn, i);
     }
+    return i == -1 ? -1 : 0;
+}
 
+int db_find(int64_t key, char *ret_val) {
+    int ret;
+    uint64_t t0 = hist_start();
+    stats_inc(STAT_FIND);
+    trace_op_begin("find", key);
+    pthread_rwlock_rdlock(&db_latch);
+    ret = ingest_on ? ingest_find(key, ret_val) : find_record(key, ret_val);
+    pthread_rwlock_unlock(&db_latch);
+    trace_op_end();
+    hist_end(HIST_FIND, t0);
+    return ret;
 }
 
 
@@ -493,8 +685,32 @@ int cut( int length ) {
 }
 
 
+/* Finds the place to split a node of length entries on an
+ * append at the right edge: the old node keeps APPEND_FILL
+ * percent of them, and the new one at least one.
+ */
+static int append_cut(int length) {
+    int split = length * APPEND_FILL / 100;
+
+    if (split < cut(length))
+        split = cut(length);
+    return split < length ? split : length - 1;
+}
+
+
 // INSERTION
 
+/* The right edge: the path to the rightmost leaf, kept while
+ * no resident page changes, and the separator from which on
+ * keys go to that leaf.  append_run counts the inserts in a
+ * row past the last key of the tree.
+ */
+static descent edge_path;
+static pagenum_t edge_lpn;
+static int edge_bound;
+static uint64_t edge_epoch = UINT64_MAX;
+static int append_run = 0;
+
 
 /* Creates a new general node, which can be adapted
  * to serve as either a leaf or an internal node.
@@ -504,12 +720,12 @@ pagenum_t make_intl( void ) {
     pagenum_t new_ipn;
     InternalPage new_ip;
     new_ipn = file_alloc_page();
-    file_read_page(new_ipn, &new_ip);
+    file_read_page(new_ipn, (page_t *)&new_ip);
     new_ip.is_leaf = false;
     new_ip.kcnt = 0;
-    new_ip.ppn = 0;
+    new_ip.mcnt = 0;
     new_ip.lspn = 0;
-    file_write_page(new_ipn, &new_ip);
+    file_write_page(new_ipn, (page_t *)&new_ip);
     return new_ipn;
 }
 
@@ -520,56 +736,47 @@ pagenum_t make_intl( void ) {
 pagenum_t make_leaf( void ) {
     LeafPage lp;
     pagenum_t lpn = file_alloc_page();
-    lp.ppn = 0;
+    lp.nfpn = 0;
     lp.is_leaf = true;
     lp.kcnt = 0;
     lp.rspn = 0;
-    file_write_page(lpn, &lp);
+    file_write_page(lpn, (page_t *)&lp);
     return lpn;
 }
 
 
-/* Helper function used in insert_into_parent
- * to find the index of the parent's pointer to 
- * the node to the left of the key to be inserted.
+/* Inserts a new pointer to a record and its corresponding
+ * key into the leaf lpn, whose image the caller read into lp.
  */
-int get_left_index(pagenum_t ppn, pagenum_t left_pn) {
+static void insert_into_leaf_page(pagenum_t lpn, LeafPage * lp, int key, char * value) {
 
-    int left_index = 0;
-    InternalPage pp;
-    file_read_page(ppn, &pn);
-    // Cross the index
-    if (pp.lspn == left_pn)
-        return left_index;
-    left_index++;
-    while (left_index <= pp->kcnt && 
-            pp.records[left_index - 1].pn != left_pn)
-        left_index++;
-    return left_index;
+    int i, insertion_point;
+    uint64_t t0 = hist_start();
+    insertion_point = 0;
+    while (insertion_point < lp->kcnt && lp->records[insertion_point].key < key)
+        insertion_point++;
+
+    for (i = lp->kcnt; i > insertion_point; i--) {
+        lp->records[i].key = lp->records[i - 1].key;
+        strcpy(lp->records[i].value, lp->records[i - 1].value);
+    }
+    lp->records[insertion_point].key = key;
+    strcpy(lp->records[insertion_point].value, value);
+    lp->kcnt++;
+    file_write_page(lpn, (page_t *)lp);
+    hist_end(HIST_LEAF_MODIFY, t0);
 }
 
+
 /* Inserts a new pointer to a record and its corresponding
  * key into a leaf.
- * Returns the altered leaf.
+ * Returns 0.
  */
 
 int insert_into_leaf(pagenum_t lpn, int key, char * value) {
-
-    int i, insertion_point;
     LeafPage lp;
-    file_read_page(lpn, &lp);
-    insertion_point = 0;
-    while (insertion_point < lp.kcnt && lp.records[insertion_point].key < key)
-        insertion_point++;
-
-    for (i = lp.kcnt; i > insertion_point; i--) {
-        lp.records[i].key = leaf.records[i - 1].key;
-        strcpy(lp.records[i].value, lp.records[i - 1].value);
-    }
-    lp.records[insertion_point].key = key;
-    strcpy(lp.records[insertion_point].value, value);
-    lp.kcnt++;
-    file_write_page(lpn, &lp);
+    file_read_page(lpn, (page_t *)&lp);
+    insert_into_leaf_page(lpn, &lp, key, value);
     return 0;
 }
 
@@ -579,21 +786,22 @@ int insert_into_leaf(pagenum_t lpn, int key, char * value) {
  * the tree's order, causing the leaf to be split
  * in half.
  */
-node * insert_into_leaf_after_splitting(pagenum_t lpn, int key, char * value) {
+int insert_into_leaf_after_splitting(descent * d, pagenum_t lpn, int key, char * value) {
 
     pagenum_t new_lpn;
     LeafPage lp;
     LeafPage new_lp;
     Record * temp_records;
-    Record null_record;
     int insertion_index, split, new_key, i, j;
 
-    file_read_page(lpn, &lp);
+    file_read_page(lpn, (page_t *)&lp);
 
     new_lpn = make_leaf();
-    file_read_page(new_lpn, &new_lp);
+    file_read_page(new_lpn, (page_t *)&new_lp);
 
-    temp_records = (Records *)malloc(order * sizeof(Records));
+    stats_split(true);
+    trace_event(TRACE_SPLIT, lpn);
+    temp_records = (Record *)malloc(leaf_order * sizeof(Record));
 
     if (temp_records == NULL) {
         perror("Temporary records array.");
@@ -601,12 +809,13 @@ node * insert_into_leaf_after_splitting(pagenum_t lpn, int key, char * value) {
     }
 
     insertion_index = 0;
-    while (insertion_index < order - 1 && lp.records[insertion_index].key < key)        
+    while (insertion_index < leaf_order - 1 && lp.records[insertion_index].key < key)        
         insertion_index++;
 
     for (i = 0, j = 0; i < lp.kcnt; i++, j++) {
         if (j == insertion_index) j++;
-        temp_records[i] = lp.records[i];
+        temp_records[j].key = lp.records[i].key;
+        memcpy(temp_records[j].value, lp.records[i].value, sizeof(temp_records[j].value));
     }
 
     temp_records[insertion_index].key = key;
@@ -614,15 +823,20 @@ node * insert_into_leaf_after_splitting(pagenum_t lpn, int key, char * value) {
 
     lp.kcnt = 0;
 
-    split = cut(order - 1);
+    split = cut(leaf_order - 1);
+    // An append to the rightmost leaf leaves it nearly full.
+    if (append_run >= APPEND_RUN && lp.rspn == 0 && insertion_index == leaf_order - 1)
+        split = append_cut(leaf_order - 1);
 
     for (i = 0; i < split; i++) {
-        lp.records[i] = temp_records[i];
+        lp.records[i].key = temp_records[i].key;
+        memcpy(lp.records[i].value, temp_records[i].value, sizeof(lp.records[i].value));
         lp.kcnt++;
     }
 
-    for (i = split, j = 0; i < order; i++, j++) {
-        new_lp.records[j] = temp_records[i];
+    for (i = split, j = 0; i < leaf_order; i++, j++) {
+        new_lp.records[j].key = temp_records[i].key;
+        memcpy(new_lp.records[j].value, temp_records[i].value, sizeof(new_lp.records[j].value));
         new_lp.kcnt++;
     }
 
@@ -631,15 +845,12 @@ node * insert_into_leaf_after_splitting(pagenum_t lpn, int key, char * value) {
     new_lp.rspn = lp.rspn;
     lp.rspn = new_lpn;
 
-    for (i = lp.kcnt; i < order - 1; i++)
-        lp.records[i] = null_record;
-    for (i = new_lp.kcnt; i < order - 1; i++)
-        new_lp.records[i] = null_record;
+    new_key = new_lp.records[0].key;
 
-    new_lp.ppn = lp.ppn;
-    new_key = new_lp.record[0].key;
+    file_write_page(lpn, (page_t *)&lp);
+    file_write_page(new_lpn, (page_t *)&new_lp);
 
-    return insert_into_parent(lpn, new_key, new_lpn);
+    return insert_into_parent(d, lpn, new_key, new_lpn);
 }
 
 
@@ -647,12 +858,13 @@ node * insert_into_leaf_after_splitting(pagenum_t lpn, int key, char * value) {
  * into a node into which these can fit
  * without violating the B+ tree properties.
  */
-pagenum_t insert_into_intl(pagenum_t pn, int left_index, int key, pagenum_t right_pn);
+pagenum_t insert_into_intl(pagenum_t pn, int left_index, int key, pagenum_t right_pn) {
 //node * insert_into_node(node * root, node * n, 
 //        int left_index, int key, node * right) {
     int i;
     InternalPage ip;
-    file_read_page(pn, &ip);
+    uint32_t * cnt = INTL_COUNTS(&ip);
+    file_read_page(pn, (page_t *)&ip);
 
     for (i = ip.kcnt; i > left_index; i--) {
         ip.records[i] = ip.records[i - 1];
@@ -660,7 +872,15 @@ pagenum_t insert_into_intl(pagenum_t pn, int left_index, int key, pagenum_t righ
     ip.records[left_index].key = key;
     ip.records[left_index].pn = right_pn;
     ip.kcnt++;
-    file_write_page(pn, &ip);
+    // The left child lost the records the right one got.
+    if (tree_counted) {
+        for (i = ip.kcnt; i > left_index + 1; i--)
+            cnt[i] = cnt[i - 1];
+        cnt[left_index] = ost_subtree_count(left_index == 0
+                ? ip.lspn : ip.records[left_index - 1].pn);
+        cnt[left_index + 1] = ost_subtree_count(right_pn);
+    }
+    file_write_page(pn, (page_t *)&ip);
     return pn;
 }
 
@@ -668,15 +888,18 @@ pagenum_t insert_into_intl(pagenum_t pn, int left_index, int key, pagenum_t righ
 /* Inserts a new key and pointer to a node
  * into a node, causing the node's size to exceed
  * the order, and causing the node to split into two.
+ * The children moved to the new node are not touched.
  */
-pagenum_t insert_into_intl_after_splitting(pagenum_t ppn, int left_index, int key, pagenum_t right_pn) {
+int insert_into_intl_after_splitting(descent * d, pagenum_t pn, int left_index, int key,
+        pagenum_t right_pn) {
 
     int i, j, split, k_prime;
     InternalPage old_ip;
-    pagenum_t new_ipn, child_pn;
-    InternalPage new_ip, child_p;
+    pagenum_t new_ipn;
+    InternalPage new_ip;
     int * temp_keys;
     int * temp_pns;
+    uint32_t * temp_cnts = NULL;
 
     /* First create a temporary set of keys and pointers
      * to hold everything in order, including
@@ -687,21 +910,23 @@ pagenum_t insert_into_intl_after_splitting(pagenum_t ppn, int left_index, int ke
      * the other half to the new.
      */
 
-    temp_pns = malloc( (order + 1) * sizeof(int));
-    if (temp_pointers == NULL) {
+    temp_pns = malloc( (intl_order + 1) * sizeof(int));
+    if (temp_pns == NULL) {
         perror("Temporary pointers array for splitting nodes.");
         exit(EXIT_FAILURE);
     }
-    temp_keys = malloc( order * sizeof(int) );
+    temp_keys = malloc( intl_order * sizeof(int) );
     if (temp_keys == NULL) {
         perror("Temporary keys array for splitting nodes.");
         exit(EXIT_FAILURE);
     }
 
-    file_read_page(ppn, &old_ip);
+    stats_split(false);
+    trace_event(TRACE_SPLIT, pn);
+    file_read_page(pn, (page_t *)&old_ip);
 
     temp_pns[0] = old_ip.lspn;
-    for (i = 0, j = 1; i < old_ip.kcnt + 1; i++, j++) {
+    for (i = 0, j = 1; i < old_ip.kcnt; i++, j++) {
         if (j == left_index + 1) j++;
         temp_pns[j] = old_ip.records[i].pn;
     }
@@ -711,97 +936,121 @@ pagenum_t insert_into_intl_after_splitting(pagenum_t ppn, int left_index, int ke
         temp_keys[j] = old_ip.records[i].key;
     }
 
-    temp_pointers[left_index + 1] = right;
+    temp_pns[left_index + 1] = right_pn;
     temp_keys[left_index] = key;
 
+    // Counts travel with their pointers.
+    if (tree_counted) {
+        temp_cnts = malloc( (intl_order + 1) * sizeof(uint32_t) );
+        if (temp_cnts == NULL) {
+            perror("Temporary counts array for splitting nodes.");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0, j = 0; i <= old_ip.kcnt; i++, j++) {
+            if (j == left_index + 1) j++;
+            temp_cnts[j] = INTL_COUNTS(&old_ip)[i];
+        }
+        temp_cnts[left_index] = ost_subtree_count(temp_pns[left_index]);
+        temp_cnts[left_index + 1] = ost_subtree_count(right_pn);
+    }
+
     /* Create the new node and copy
      * half the keys and pointers to the
      * old and half to the new.
      */  
-    split = cut(order);
+    split = cut(intl_order);
+    if (append_run >= APPEND_RUN && left_index == old_ip.kcnt)
+        split = append_cut(intl_order - 1) + 1;
     new_ipn = make_intl();
-    file_read_page(new_ipn, &new_ip);
+    file_read_page(new_ipn, (page_t *)&new_ip);
     old_ip.kcnt = 0;
     old_ip.lspn = temp_pns[0];
-    old_ip.kcnt++;
     for (i = 0; i < split - 1; i++) {
         old_ip.records[i].key = temp_keys[i];
         old_ip.records[i].pn = temp_pns[i + 1];
         old_ip.kcnt++;
     }
 
-    old_node->pointers[i] = temp_pointers[i];
-
     k_prime = temp_keys[split - 1];
-    new_ip.lspn = temp_pointers[i];
-    for (++i, j = 0; i < order; i++, j++) {
-        new_ip.records[j].pn = temp_pns[i];
+    new_ip.lspn = temp_pns[split];
+    for (i = split, j = 0; i < intl_order; i++, j++) {
         new_ip.records[j].key = temp_keys[i];
+        new_ip.records[j].pn = temp_pns[i + 1];
         new_ip.kcnt++;
     }
+    if (tree_counted) {
+        memcpy(INTL_COUNTS(&old_ip), temp_cnts, split * sizeof(uint32_t));
+        memcpy(INTL_COUNTS(&new_ip), temp_cnts + split,
+                (intl_order + 1 - split) * sizeof(uint32_t));
+    }
+    // Buffered messages from k_prime on belong to the new page.
+    if (tree_buffered) {
+        for (i = 0; i < old_ip.mcnt && INTL_MSGS(&old_ip)[i].key < k_prime; i++) ;
+        new_ip.mcnt = old_ip.mcnt - i;
+        memcpy(INTL_MSGS(&new_ip), &INTL_MSGS(&old_ip)[i], new_ip.mcnt * sizeof(buf_msg));
+        old_ip.mcnt = i;
+    }
     free(temp_pns);
     free(temp_keys);
-    new_ip.ppn = old_ip.ppn;
-    for (i = 0; i <= new_ip.kcnt; i++) {
-        child_pn = new_ip.records[i].pn;
-        file_read_page(child_pn, &child_p);
-        child_p.ppn = new_ipn;
-        file_write_page(child_pn, &child_p);
-    }
+    free(temp_cnts);
+    file_write_page(new_ipn, (page_t *)&new_ip);
+    file_write_page(pn, (page_t *)&old_ip);
 
     /* Insert a new key into the parent of the two
      * nodes resulting from the split, with
      * the old node to the left and the new to the right.
      */
 
-    file_write_page(new_ipn, &new_ip);
-    file_write_page(ppn, &old_ip);
-    return insert_into_parent(old_ipn, k_prime, new_ipn);
+    return insert_into_parent(d, pn, k_prime, new_ipn);
 }
 
 
 
 /* Inserts a new node (leaf or internal node) into the B+ tree.
- * Returns the root of the tree after insertion.
+ * left_pn is the page at the end of path d, which loses
+ * its last step.
+ * Returns 0 on success.
  */
-int insert_into_parent(pagenum_t left_pn, int key, pagenum_t right_pn);
+int insert_into_parent(descent * d, pagenum_t left_pn, int key, pagenum_t right_pn) {
 //int insert_into_parent(node * left, int key, node * right) {
 
     int left_index;
     pagenum_t ppn;
     InternalPage pp;
-    page_t left_p, right_p;
-    file_read_page(left_pn, &left_p);
-    ppn = left_p.ppn;
 
     /* Case: new root. */
 
-    if (ppn == 0)
+    if (d->depth == 0)
         return insert_into_new_root(left_pn, key, right_pn);
 
     /* Case: leaf or node. (Remainder of
      * function body.)  
      */
 
-    /* Find the parent's pointer to the left 
-     * node.
+    /* The parent and its pointer to the left
+     * node are the last step of the descent.
      */
 
-    left_index = get_left_index(ppn, left_pn);
+    d->depth--;
+    ppn = d->pn[d->depth];
+    left_index = d->idx[d->depth];
+    file_read_page(ppn, (page_t *)&pp);
 
 
     /* Simple case: the new key fits into the node. 
      */
 
-    if (pp.kcnt < order - 1)
+    if (pp.kcnt < intl_order - 1) {
         //return insert_into_node(root, parent, left_index, key, right);
-        return insert_into_intl(ppn, left_index, key, right_pn);
+        insert_into_intl(ppn, left_index, key, right_pn);
+        return 0;
+    }
 
     /* Harder case:  split a node in order 
      * to preserve the B+ tree properties.
      */
 
-    return insert_into_intl_after_splitting(ppn, left_index, key, right_pn);
+    return insert_into_intl_after_splitting(d, ppn, left_index, key, right_pn);
 }
 
 
@@ -809,25 +1058,28 @@ int insert_into_parent(pagenum_t left_pn, int key, pagenum_t right_pn);
  * and inserts the appropriate key into
  * the new root.
  */
-pagenum_t insert_into_new_root(pagenum_t left_pn, int key, pagenum_t right_pn) {
+int insert_into_new_root(pagenum_t left_pn, int key, pagenum_t right_pn) {
 
-    pagenum_t rpn = make_node();
+    pagenum_t rpn = make_intl();
+    HeaderPage hp;
     InternalPage rp;
-    LeafPage left_p, right_p;
-    file_read_page(rpn, &rp);
-    file_read_page(left_pn, &left_p);
-    file_read_page(right_pn, &right_p);
+    file_read_page(rpn, (page_t *)&rp);
     rp.lspn = left_pn;
     rp.records[0].key = key;
     rp.records[0].pn = right_pn;
     rp.kcnt++;
-    rp.ppn = 0;
-    left_p.ppn = rpn;
-    right_p.ppn = rpn;
-    file_write_page(rpn, &rp);
-    file_write_page(left_pn, &left_p);
-    file_write_page(right_pn, &right_p);
-    return rpn;
+    if (tree_counted) {
+        INTL_COUNTS(&rp)[0] = ost_subtree_count(left_pn);
+        INTL_COUNTS(&rp)[1] = ost_subtree_count(right_pn);
+    }
+    file_write_page(rpn, (page_t *)&rp);
+    file_read_page(0, (page_t *)&hp);
+    hp.rpn = rpn;
+    file_write_page(0, (page_t *)&hp);
+    stats_inc(STAT_NEW_ROOT);
+    trace_event(TRACE_NEW_ROOT, rpn);
+    stats_set_height(++tree_height);
+    return 0;
 }
 
 
@@ -840,189 +1092,350 @@ pagenum_t start_new_tree(int key, char * value) {
     HeaderPage hp;
     LeafPage lp;
     pagenum_t lpn = make_leaf();
-    file_read_page(0, &hp);
-    file_read_page(lpn, &lp);
+    file_read_page(0, (page_t *)&hp);
+    file_read_page(lpn, (page_t *)&lp);
     hp.rpn = lpn;
     lp.records[0].key = key;
     strcpy(lp.records[0].value, value);
-    lp.ppn = 0;
     lp.kcnt = 1;
-    file_write_page(0, &hp);
-    file_write_page(lpn, &lp);
+    file_write_page(0, (page_t *)&hp);
+    file_write_page(lpn, (page_t *)&lp);
+    tree_height = 0;
+    stats_set_height(tree_height);
     return lpn;
 }
 
 
-//node * insert( node * root, int key, int value ) {
-int db_insert(int64_t key, char* value) {
+/* Finds the leaf for a write of key, taking the kept right
+ * edge path instead of a descent when key is past its
+ * separator.  The caller holds db_latch exclusively.
+ */
+static pagenum_t find_write_leaf(int key, descent * d) {
+    if (edge_epoch == pin_epoch && key >= edge_bound) {
+        *d = edge_path;
+        stats_inc(STAT_APPEND_FAST);
+        return edge_lpn;
+    }
+    return find_leaf_path(key, d);
+}
+
+
+// Keeps the path d to leaf lpn, read into lp, if lp is the rightmost leaf.
+static void note_edge(const descent * d, pagenum_t lpn, const LeafPage * lp) {
+    int h;
+
+    if (lp->rspn != 0 || d->depth == 0 || edge_epoch == pin_epoch)
+        return;
+    // The deepest entry that is not the first gives the separator.
+    edge_bound = INT_MIN;
+    for (h = d->depth - 1; h >= 0; h--)
+        if (d->idx[h] > 0) {
+            edge_bound = pin_lookup(d->pn[h])->page->records[d->idx[h] - 1].key;
+            break;
+        }
+    edge_path = *d;
+    edge_lpn = lpn;
+    edge_epoch = pin_epoch;
+}
+
+
+// Kinds of single-descent writes.
+enum write_mode {
+    WRITE_UPSERT,       // insert or overwrite
+    WRITE_UPDATE,       // overwrite only
+    WRITE_IF_ABSENT,    // insert only
+    WRITE_CAS,          // overwrite a given value only
+    WRITE_INSERT        // insert only, the outcome not wanted
+};
+
+
+/* Writes key as a message, to the ingest tier or else to the
+ * root buffer.  Only the modes whose outcome needs the old
+ * value look the key up first.
+ * Returns a DB_* outcome.
+ */
+static int write_message(int key, char * value, enum write_mode mode, char * expected) {
+    char old[120];
+    bool found;
+
+    if (mode == WRITE_UPSERT || mode == WRITE_INSERT) {
+        if (ingest_on)
+            ingest_put(key, mode == WRITE_UPSERT ? MSG_UPSERT : MSG_INSERT, value);
+        else
+            buf_put(key, mode == WRITE_UPSERT ? MSG_UPSERT : MSG_INSERT, value);
+        return DB_BUFFERED;
+    }
+    found = (ingest_on ? ingest_find(key, old) : buf_find(key, old)) == 0;
+    if (mode == WRITE_IF_ABSENT && found)
+        return DB_EXISTS;
+    if (mode != WRITE_IF_ABSENT && !found)
+        return DB_NOT_FOUND;
+    if (mode == WRITE_CAS && strcmp(old, expected) != 0)
+        return DB_MISMATCH;
+    if (ingest_on)
+        ingest_put(key, MSG_UPSERT, value);
+    else
+        buf_put(key, MSG_UPSERT, value);
+    return found ? DB_UPDATED : DB_INSERTED;
+}
+
+
+/* Writes key with one descent and, unless the leaf splits,
+ * one read-modify-write of the leaf.  The caller holds
+ * db_latch exclusively.
+ * Returns a DB_* outcome.
+ */
+static int write_record(int key, char * value, enum write_mode mode, char * expected) {
 
-    //Record * pointer;
-    HeaderPage hp;
     pagenum_t lpn;
     LeafPage lp;
-    
-    char ret_val[120];
+    descent path;
+    int i = -1;
+    uint64_t t0, t_split;
 
-    /* Does not accept duplicated key. 
-     * Ignore input. 
+    /* Case: ingest tier, or buffered table with an internal root.
+     * The write becomes a message.
      */
-    if (db_find(key, ret_val) == 0) {
-        return 0;
+
+    if (ingest_on || (tree_buffered && tree_height > 0))
+        return write_message(key, value, mode, expected);
+
+    lpn = find_write_leaf(key, &path);
+    if (lpn != 0) {
+        file_read_page(lpn, (page_t *)&lp);
+        i = leaf_key_index(&lp, key);
+        note_edge(&path, lpn, &lp);
     }
-    /* Create a new record for the
-     * value.
+
+    /* Case: the key is there.
+     * Its value is overwritten in place.
      */
 
-    // Set file pointer at start
-    file_read_page(0, &hp);
+    if (i != -1) {
+        if (mode == WRITE_IF_ABSENT || mode == WRITE_INSERT)
+            return DB_EXISTS;
+        if (mode == WRITE_CAS && strcmp(lp.records[i].value, expected) != 0)
+            return DB_MISMATCH;
+        t0 = hist_start();
+        strcpy(lp.records[i].value, value);
+        file_write_page(lpn, (page_t *)&lp);
+        hist_end(HIST_LEAF_MODIFY, t0);
+        return DB_UPDATED;
+    }
+    if (mode == WRITE_UPDATE || mode == WRITE_CAS)
+        return DB_NOT_FOUND;
 
     /* Case: No page under header page.
      * Make New Page
      */
-    if (hp.rpn == 0) 
-        // care return value
-        return start_new_tree(key, value);
 
+    if (lpn == 0) {
+        start_new_tree(key, value);
+        return DB_INSERTED;
+    }
 
-    /* Case: the tree already exists.
-     * (Rest of function body.)
+    // Inserts past the last key of the tree make a run of appends.
+    if (lp.rspn == 0 && (lp.kcnt == 0 || key > lp.records[lp.kcnt - 1].key))
+        append_run++;
+    else
+        append_run = 0;
+
+    /* Case: leaf has room for key and pointer.
      */
 
-    lpn = find_leaf(key, false);
-    file_read_page(lpn, &lp);
+    if (lp.kcnt < leaf_order - 1)
+        insert_into_leaf_page(lpn, &lp, key, value);
 
-    /* Case: leaf has room for key and pointer.
+    /* Case:  leaf must be split.
      */
 
-    if (lp->kcnt < order - 1) {
-        leaf = insert_into_leaf(lpn, key, value);
-        return 0;
+    else {
+        t_split = hist_start();
+        insert_into_leaf_after_splitting(&path, lpn, key, value);
+        hist_end(HIST_SPLIT, t_split);
     }
 
-
-    /* Case:  leaf must be split.
+    /* Splits counted the pages they made; the path
+     * above the leaf still counts one record less.
+     * A split used up the path, so take it again.
      */
+    if (tree_counted) {
+        if (path.depth != tree_height)
+            lpn = find_leaf_path(key, &path);
+        ost_fix_path(&path, lpn);
+    }
+    return DB_INSERTED;
+}
+
 
-    return insert_into_leaf_after_splitting(lpn, key, value);
+/* Runs write_record as a write operation of its own,
+ * traced as name and timed in histogram h.  With the ingest
+ * tier, writes that do not look the key up share db_latch:
+ * they only log and add an entry.
+ */
+static int write_op(const char * name, enum hist_id h, int64_t key, char * value,
+        enum write_mode mode, char * expected) {
+    int ret;
+    uint64_t t0 = hist_start();
+
+    trace_op_begin(name, key);
+    if (ingest_on && (mode == WRITE_UPSERT || mode == WRITE_INSERT)) {
+        ingest_wait();
+        pthread_rwlock_rdlock(&db_latch);
+    } else
+        pthread_rwlock_wrlock(&db_latch);
+    ret = write_record(key, value, mode, expected);
+    // Nothing to commit when nothing was written.
+    if (ret >= 0)
+        file_commit();
+    pthread_rwlock_unlock(&db_latch);
+    trace_op_end();
+    hist_end(h, t0);
+    return ret;
 }
 
 
-// DELETION.
+//node * insert( node * root, int key, int value ) {
+/* Master insertion function.
+ * Does not accept duplicated key: the input is ignored.
+ * Returns 0.
+ */
+int db_insert(int64_t key, char* value) {
+    stats_inc(STAT_INSERT);
+    write_op("insert", HIST_INSERT, key, value, WRITE_INSERT, NULL);
+    return 0;
+}
 
-/* Utility function for deletion.  Retrieves
- * the index of a node's nearest neighbor (sibling)
- * to the left if one exists.  If not (the node
- * is the leftmost child), returns -1 to signify
- * this special case.
+
+/* Inserts key, or overwrites its value if it is there.
+ * Returns DB_INSERTED or DB_UPDATED, or DB_BUFFERED on a
+ * buffered table or one with the ingest tier.
  */
-int get_neighbor_index( node * n ) {
+int db_upsert(int64_t key, char * value) {
+    stats_inc(STAT_UPDATE);
+    return write_op("upsert", HIST_UPDATE, key, value, WRITE_UPSERT, NULL);
+}
 
-    int i;
 
-    /* Return the index of the key to the left
-     * of the pointer in the parent pointing
-     * to n.  
-     * If n is the leftmost child, this means
-     * return -1.
-     */
-    for (i = 0; i <= n->parent->num_keys; i++)
-        if (n->parent->pointers[i] == n)
-            return i - 1;
-
-    // Error state.
-    printf("Search for nonexistent pointer to node in parent.\n");
-    printf("Node:  %#lx\n", (unsigned long)n);
-    exit(EXIT_FAILURE);
+/* Overwrites the value of key.
+ * Returns DB_UPDATED, or DB_NOT_FOUND.
+ */
+int db_update(int64_t key, char * value) {
+    stats_inc(STAT_UPDATE);
+    return write_op("update", HIST_UPDATE, key, value, WRITE_UPDATE, NULL);
 }
 
 
-node * remove_entry_from_node(node * n, int key, node * pointer) {
+/* Inserts key unless it is there.
+ * Returns DB_INSERTED, or DB_EXISTS.
+ */
+int db_insert_if_absent(int64_t key, char * value) {
+    stats_inc(STAT_INSERT);
+    return write_op("insert_if_absent", HIST_INSERT, key, value, WRITE_IF_ABSENT, NULL);
+}
 
-    int i, num_pointers;
 
-    // Remove the key and shift other keys accordingly.
-    i = 0;
-    while (n->keys[i] != key)
-        i++;
-    for (++i; i < n->num_keys; i++)
-        n->keys[i - 1] = n->keys[i];
-
-    // Remove the pointer and shift other pointers accordingly.
-    // First determine number of pointers.
-    num_pointers = n->is_leaf ? n->num_keys : n->num_keys + 1;
-    i = 0;
-    while (n->pointers[i] != pointer)
-        i++;
-    for (++i; i < num_pointers; i++)
-        n->pointers[i - 1] = n->pointers[i];
+/* Overwrites the value of key with value if it is expected.
+ * Returns DB_UPDATED, DB_NOT_FOUND or DB_MISMATCH.
+ */
+int db_compare_and_swap(int64_t key, char * expected, char * value) {
+    stats_inc(STAT_UPDATE);
+    return write_op("cas", HIST_UPDATE, key, value, WRITE_CAS, expected);
+}
 
 
-    // One key fewer.
-    n->num_keys--;
+// DELETION.
 
-    // Set the other pointers to NULL for tidiness.
-    // A leaf uses the last pointer to point to the next leaf.
-    if (n->is_leaf)
-        for (i = n->num_keys; i < order - 1; i++)
-            n->pointers[i] = NULL;
-    else
-        for (i = n->num_keys + 1; i < order; i++)
-            n->pointers[i] = NULL;
+/* Utility function for deletion.  Retrieves
+ * the index of a page's nearest neighbor (sibling)
+ * to the left if one exists, from the last step
+ * of the descent to the page.  If not (the page
+ * is the leftmost child), returns -1 to signify
+ * this special case.
+ */
+int get_neighbor_index(const descent * d) {
+    return d->idx[d->depth - 1] - 1;
+}
 
-    return n;
+
+// Removes the record of key from a leaf.
+static void remove_entry_from_leaf(LeafPage * lp, int key) {
+    int i = leaf_key_index(lp, key);
+    memmove(&lp->records[i], &lp->records[i + 1],
+            (lp->kcnt - i - 1) * sizeof(lp->records[0]));
+    lp->kcnt--;
 }
 
 
-node * adjust_root(node * root) {
+/* Removes key and the pointer to its right from an
+ * internal page, with the count of that pointer.
+ */
+static void remove_entry_from_intl(InternalPage * ip, int key) {
+    uint32_t * cnt = INTL_COUNTS(ip);
+    int i = 0;
+    while (ip->records[i].key != key)
+        i++;
+    memmove(&ip->records[i], &ip->records[i + 1],
+            (ip->kcnt - i - 1) * sizeof(ip->records[0]));
+    if (tree_counted)
+        memmove(&cnt[i + 1], &cnt[i + 2], (ip->kcnt - i - 1) * sizeof(uint32_t));
+    ip->kcnt--;
+}
 
-    node * new_root;
+
+/* Shrinks the tree after a deletion left
+ * the root page rpn, whose image is root, empty.
+ */
+void adjust_root(pagenum_t rpn, page_t * root) {
+    InternalPage * ip = (InternalPage *)root;
+    HeaderPage hp;
 
     /* Case: nonempty root.
      * Key and pointer have already been deleted,
      * so nothing to be done.
      */
 
-    if (root->num_keys > 0)
-        return root;
+    if (ip->kcnt > 0)
+        return;
 
-    /* Case: empty root. 
+    /* Case: empty root.
+     * If it has a child, promote the first (only)
+     * child as the new root.  If it is a leaf
+     * (has no children), then the whole tree is empty.
+     * A buffered root keeps its only child, and its messages.
      */
 
-    // If it has a child, promote 
-    // the first (only) child
-    // as the new root.
-
-    if (!root->is_leaf) {
-        new_root = root->pointers[0];
-        new_root->parent = NULL;
-    }
-
-    // If it is a leaf (has no children),
-    // then the whole tree is empty.
-
-    else
-        new_root = NULL;
-
-    free(root->keys);
-    free(root->pointers);
-    free(root);
+    if (!ip->is_leaf && tree_buffered)
+        return;
 
-    return new_root;
+    file_read_page(0, (page_t *)&hp);
+    hp.rpn = ip->is_leaf ? 0 : ip->lspn;
+    file_write_page(0, (page_t *)&hp);
+    file_free_page(rpn);
+    stats_set_height(--tree_height);
 }
 
 
-/* Coalesces a node that has become
+/* Coalesces a page that has become
  * too small after deletion
- * with a neighboring node that
+ * with a neighboring page that
  * can accept the additional entries
  * without exceeding the maximum.
+ * The page on the right goes.
  */
-node * coalesce_nodes(node * root, node * n, node * neighbor, int neighbor_index, int k_prime) {
+void coalesce_pages(descent * d, pagenum_t pn, page_t * n, pagenum_t neighbor_pn,
+        page_t * neighbor, int neighbor_index, int k_prime) {
+
+    InternalPage * ip, * nip;
+    LeafPage * lp, * nlp;
+    page_t * tmp;
+    pagenum_t tmp_pn;
+    int neighbor_insertion_index;
 
-    int i, j, neighbor_insertion_index, n_end;
-    node * tmp;
+    stats_inc(STAT_MERGE);
+    trace_event(TRACE_MERGE, pn);
 
-    /* Swap neighbor with node if node is on the
+    /* Swap neighbor with page if page is on the
      * extreme left and neighbor is to its right.
      */
 
@@ -1030,247 +1443,261 @@ node * coalesce_nodes(node * root, node * n, node * neighbor, int neighbor_index
         tmp = n;
         n = neighbor;
         neighbor = tmp;
+        tmp_pn = pn;
+        pn = neighbor_pn;
+        neighbor_pn = tmp_pn;
     }
 
-    /* Starting point in the neighbor for copying
-     * keys and pointers from n.
-     * Recall that n and neighbor have swapped places
-     * in the special case of n being a leftmost child.
-     */
-
-    neighbor_insertion_index = neighbor->num_keys;
+    ip = (InternalPage *)n;
+    nip = (InternalPage *)neighbor;
+    neighbor_insertion_index = nip->kcnt;
 
-    /* Case:  nonleaf node.
+    /* Case:  internal page.
      * Append k_prime and the following pointer.
-     * Append all pointers and keys from the neighbor.
+     * Append all pointers and keys from the page,
+     * and their counts.
      */
 
-    if (!n->is_leaf) {
-
-        /* Append k_prime.
-         */
-
-        neighbor->keys[neighbor_insertion_index] = k_prime;
-        neighbor->num_keys++;
-
-
-        n_end = n->num_keys;
-
-        for (i = neighbor_insertion_index + 1, j = 0; j < n_end; i++, j++) {
-            neighbor->keys[i] = n->keys[j];
-            neighbor->pointers[i] = n->pointers[j];
-            neighbor->num_keys++;
-            n->num_keys--;
-        }
-
-        /* The number of pointers is always
-         * one more than the number of keys.
-         */
-
-        neighbor->pointers[i] = n->pointers[j];
-
-        /* All children must now point up to the same parent.
-         */
-
-        for (i = 0; i < neighbor->num_keys + 1; i++) {
-            tmp = (node *)neighbor->pointers[i];
-            tmp->parent = neighbor;
-        }
+    if (!ip->is_leaf) {
+        nip->records[neighbor_insertion_index].key = k_prime;
+        nip->records[neighbor_insertion_index].pn = ip->lspn;
+        memcpy(&nip->records[neighbor_insertion_index + 1], ip->records,
+                ip->kcnt * sizeof(ip->records[0]));
+        if (tree_counted)
+            memcpy(&INTL_COUNTS(nip)[neighbor_insertion_index + 1], INTL_COUNTS(ip),
+                    (ip->kcnt + 1) * sizeof(uint32_t));
+        nip->kcnt += ip->kcnt + 1;
     }
 
-    /* In a leaf, append the keys and pointers of
-     * n to the neighbor.
-     * Set the neighbor's last pointer to point to
-     * what had been n's right neighbor.
+    /* In a leaf, append the records of the page
+     * to the neighbor, which takes over its right sibling.
      */
 
     else {
-        for (i = neighbor_insertion_index, j = 0; j < n->num_keys; i++, j++) {
-            neighbor->keys[i] = n->keys[j];
-            neighbor->pointers[i] = n->pointers[j];
-            neighbor->num_keys++;
-        }
-        neighbor->pointers[order - 1] = n->pointers[order - 1];
+        lp = (LeafPage *)n;
+        nlp = (LeafPage *)neighbor;
+        memcpy(&nlp->records[neighbor_insertion_index], lp->records,
+                lp->kcnt * sizeof(lp->records[0]));
+        nlp->kcnt += lp->kcnt;
+        nlp->rspn = lp->rspn;
     }
 
-    root = delete_entry(root, n->parent, k_prime, n);
-    free(n->keys);
-    free(n->pointers);
-    free(n); 
-    return root;
+    // Children moved over are adopted by the neighbor's image first.
+    file_write_page(neighbor_pn, neighbor);
+    d->depth--;
+    delete_entry(d, d->pn[d->depth], k_prime);
+    file_free_page(pn);
 }
 
 
-/* Redistributes entries between two nodes when
+/* Redistributes entries between two pages when
  * one has become too small after deletion
  * but its neighbor is too big to append the
- * small node's entries without exceeding the
- * maximum
+ * small page's entries without exceeding the
+ * maximum.
  */
-node * redistribute_nodes(node * root, node * n, node * neighbor, int neighbor_index, 
-        int k_prime_index, int k_prime) {  
+void redistribute_pages(descent * d, pagenum_t pn, page_t * n, pagenum_t neighbor_pn,
+        page_t * neighbor, int neighbor_index, int k_prime_index, int k_prime) {
 
-    int i;
-    node * tmp;
+    page_t parent;
+    InternalPage * ip = (InternalPage *)n, * nip = (InternalPage *)neighbor;
+    InternalPage * pp = (InternalPage *)&parent;
+    LeafPage * lp = (LeafPage *)n, * nlp = (LeafPage *)neighbor;
+    uint32_t * cnt = INTL_COUNTS(ip), * ncnt = INTL_COUNTS(nip);
+    pagenum_t ppn = d->pn[d->depth - 1];
 
-    /* Case: n has a neighbor to the left. 
+    stats_inc(STAT_REDISTRIBUTE);
+    file_read_page(ppn, &parent);
+
+    /* Case: the page has a neighbor to the left.
      * Pull the neighbor's last key-pointer pair over
-     * from the neighbor's right end to n's left end.
+     * from the neighbor's right end to the page's left end.
      */
 
     if (neighbor_index != -1) {
-        if (!n->is_leaf)
-            n->pointers[n->num_keys + 1] = n->pointers[n->num_keys];
-        for (i = n->num_keys; i > 0; i--) {
-            n->keys[i] = n->keys[i - 1];
-            n->pointers[i] = n->pointers[i - 1];
-        }
-        if (!n->is_leaf) {
-            n->pointers[0] = neighbor->pointers[neighbor->num_keys];
-            tmp = (node *)n->pointers[0];
-            tmp->parent = n;
-            neighbor->pointers[neighbor->num_keys] = NULL;
-            n->keys[0] = k_prime;
-            n->parent->keys[k_prime_index] = neighbor->keys[neighbor->num_keys - 1];
+        if (!ip->is_leaf) {
+            memmove(&ip->records[1], &ip->records[0], ip->kcnt * sizeof(ip->records[0]));
+            ip->records[0].key = k_prime;
+            ip->records[0].pn = ip->lspn;
+            ip->lspn = nip->records[nip->kcnt - 1].pn;
+            if (tree_counted) {
+                memmove(&cnt[1], &cnt[0], (ip->kcnt + 1) * sizeof(uint32_t));
+                cnt[0] = ncnt[nip->kcnt];
+            }
+            pp->records[k_prime_index].key = nip->records[nip->kcnt - 1].key;
         }
         else {
-            n->pointers[0] = neighbor->pointers[neighbor->num_keys - 1];
-            neighbor->pointers[neighbor->num_keys - 1] = NULL;
-            n->keys[0] = neighbor->keys[neighbor->num_keys - 1];
-            n->parent->keys[k_prime_index] = n->keys[0];
+            memmove(&lp->records[1], &lp->records[0], lp->kcnt * sizeof(lp->records[0]));
+            lp->records[0] = nlp->records[nlp->kcnt - 1];
+            pp->records[k_prime_index].key = lp->records[0].key;
         }
     }
 
-    /* Case: n is the leftmost child.
+    /* Case: the page is the leftmost child.
      * Take a key-pointer pair from the neighbor to the right.
      * Move the neighbor's leftmost key-pointer pair
-     * to n's rightmost position.
+     * to the page's rightmost position.
      */
 
-    else {  
-        if (n->is_leaf) {
-            n->keys[n->num_keys] = neighbor->keys[0];
-            n->pointers[n->num_keys] = neighbor->pointers[0];
-            n->parent->keys[k_prime_index] = neighbor->keys[1];
+    else {
+        if (ip->is_leaf) {
+            lp->records[lp->kcnt] = nlp->records[0];
+            pp->records[k_prime_index].key = nlp->records[1].key;
+            memmove(&nlp->records[0], &nlp->records[1],
+                    (nlp->kcnt - 1) * sizeof(nlp->records[0]));
         }
         else {
-            n->keys[n->num_keys] = k_prime;
-            n->pointers[n->num_keys + 1] = neighbor->pointers[0];
-            tmp = (node *)n->pointers[n->num_keys + 1];
-            tmp->parent = n;
-            n->parent->keys[k_prime_index] = neighbor->keys[0];
-        }
-        for (i = 0; i < neighbor->num_keys - 1; i++) {
-            neighbor->keys[i] = neighbor->keys[i + 1];
-            neighbor->pointers[i] = neighbor->pointers[i + 1];
+            ip->records[ip->kcnt].key = k_prime;
+            ip->records[ip->kcnt].pn = nip->lspn;
+            if (tree_counted) {
+                cnt[ip->kcnt + 1] = ncnt[0];
+                memmove(&ncnt[0], &ncnt[1], nip->kcnt * sizeof(uint32_t));
+            }
+            pp->records[k_prime_index].key = nip->records[0].key;
+            nip->lspn = nip->records[0].pn;
+            memmove(&nip->records[0], &nip->records[1],
+                    (nip->kcnt - 1) * sizeof(nip->records[0]));
         }
-        if (!n->is_leaf)
-            neighbor->pointers[i] = neighbor->pointers[i + 1];
     }
 
-    /* n now has one more key and one more pointer;
+    /* The page now has one more key and one more pointer;
      * the neighbor has one fewer of each.
      */
 
-    n->num_keys++;
-    neighbor->num_keys--;
-
-    return root;
+    ip->kcnt++;
+    nip->kcnt--;
+    if (tree_counted) {
+        INTL_COUNTS(pp)[d->idx[d->depth - 1]] = ost_page_count(n);
+        INTL_COUNTS(pp)[neighbor_index == -1 ? 1 : neighbor_index] = ost_page_count(neighbor);
+    }
+    file_write_page(pn, n);
+    file_write_page(neighbor_pn, neighbor);
+    file_write_page(ppn, &parent);
 }
 
 
 /* Deletes an entry from the B+ tree.
- * Removes the record and its key and pointer
- * from the leaf, and then makes all appropriate
- * changes to preserve the B+ tree properties.
+ * Removes key from page pn at the end of path d, the
+ * record in a leaf or the key and the pointer to its
+ * right in an internal page, and then makes all
+ * appropriate changes to preserve the B+ tree properties.
  */
-//node * delete_entry( node * root, node * n, int key, void * pointer ) {
-void delete_entry(pagenum_t pn, int key, void * pointer ) {
+void delete_entry(descent * d, pagenum_t pn, int key) {
 
-    int min_keys;
-    node * neighbor;
+    page_t n, neighbor, parent;
+    InternalPage * ip = (InternalPage *)&n, * pp = (InternalPage *)&parent;
+    pagenum_t neighbor_pn;
     int neighbor_index;
     int k_prime_index, k_prime;
     int capacity;
 
-    // Remove key and pointer from node.
+    // Remove key and pointer from page.
 
-    n = remove_entry_from_node(n, key, pointer);
+    file_read_page(pn, &n);
+    if (ip->is_leaf)
+        remove_entry_from_leaf((LeafPage *)&n, key);
+    else
+        remove_entry_from_intl(ip, key);
+    file_write_page(pn, &n);
 
-    /* Case:  deletion from the root. 
+    /* Case:  deletion from the root.
      */
 
-    if (n == root) 
-        return adjust_root(root);
-
+    if (d->depth == 0) {
+        adjust_root(pn, &n);
+        return;
+    }
 
-    /* Case:  deletion from a node below the root.
+    /* Case:  deletion from a page below the root.
      * (Rest of function body.)
      */
 
-    /* Determine minimum allowable size of node,
-     * to be preserved after deletion.
-     */
-
-    min_keys = n->is_leaf ? cut(order - 1) : cut(order) - 1;
-
-    /* Case:  node stays at or above minimum.
-     * (The simple case.)
-     */
+    // Delayed Merge: a page is only merged once it is empty.
+    if (ip->kcnt > 0) {
+        if (ip->is_leaf)
+            compact_note(key, ip->kcnt);
+        return;
+    }
 
-    // Delayed Merge
-    // if (n->num_keys >= min_keys)
-    if (n->num_keys > 0)
-        return root;
+    // Internal pages of a buffered table are not merged.
+    if (!ip->is_leaf && tree_buffered)
+        return;
 
-    /* Case:  node falls below minimum.
+    /* Case:  page falls below minimum.
      * Either coalescence or redistribution
      * is needed.
      */
 
-    /* Find the appropriate neighbor node with which
+    /* Find the appropriate neighbor page with which
      * to coalesce.
      * Also find the key (k_prime) in the parent
-     * between the pointer to node n and the pointer
+     * between the pointer to page n and the pointer
      * to the neighbor.
      */
 
-    neighbor_index = get_neighbor_index( n );
+    neighbor_index = get_neighbor_index(d);
     k_prime_index = neighbor_index == -1 ? 0 : neighbor_index;
-    k_prime = n->parent->keys[k_prime_index];
-    neighbor = neighbor_index == -1 ? n->parent->pointers[1] : 
-        n->parent->pointers[neighbor_index];
+    file_read_page(d->pn[d->depth - 1], &parent);
+    // An only child has no neighbor and stays empty.
+    if (pp->kcnt == 0)
+        return;
+    k_prime = pp->records[k_prime_index].key;
+    neighbor_pn = *pin_entry(pp, neighbor_index == -1 ? 1 : neighbor_index);
+    file_read_page(neighbor_pn, &neighbor);
 
-    capacity = n->is_leaf ? order : order - 1;
+    capacity = ip->is_leaf ? leaf_order : intl_order - 1;
 
     /* Coalescence. */
 
-    if (neighbor->num_keys + n->num_keys < capacity)
-        return coalesce_nodes(root, n, neighbor, neighbor_index, k_prime);
+    if (((InternalPage *)&neighbor)->kcnt + ip->kcnt < capacity)
+        coalesce_pages(d, pn, &n, neighbor_pn, &neighbor, neighbor_index, k_prime);
 
     /* Redistribution. */
 
     else
-        return redistribute_nodes(root, n, neighbor, neighbor_index, k_prime_index, k_prime);
+        redistribute_pages(d, pn, &n, neighbor_pn, &neighbor, neighbor_index,
+                k_prime_index, k_prime);
 }
 
 /* Master deletion function.
+ * Returns 0, or -1 if the key is not in the table.
  */
 int db_delete(int64_t key) {
 
     pagenum_t key_leaf_pn;
-    node * key_leaf;
-    //Record * key_record = (Record*)malloc(sizeof(Record));
+    descent path;
     char key_record[120];
-
-   // key_record = db_find(key, ret_val);
-    db_find(key, ret_val);
-    key_leaf_pn = find_leaf(key, false);
-    if (key_record != NULL && key_leaf_pn >= 0) {
-        delete_entry(key_leaf_pn, key, key_record);
-        //free(key_record);
+    int ret = -1;
+    uint64_t t0 = hist_start();
+
+    stats_inc(STAT_DELETE);
+    trace_op_begin("delete", key);
+    pthread_rwlock_wrlock(&db_latch);
+
+    // db_latch is held, so look the key up without it.
+    if ((ingest_on ? ingest_find(key, key_record) : find_record(key, key_record)) == 0) {
+        // With the ingest tier, or on a buffered table, the delete becomes a message.
+        if (ingest_on)
+            ingest_put(key, MSG_DELETE, NULL);
+        else if (tree_buffered && tree_height > 0)
+            buf_put(key, MSG_DELETE, NULL);
+        else {
+            key_leaf_pn = find_leaf_path(key, &path);
+            delete_entry(&path, key_leaf_pn, key);
+            // Merges used up the path; what is left counts one record more.
+            if (tree_counted && tree_height >= 0) {
+                if (path.depth != tree_height)
+                    key_leaf_pn = find_leaf_path(key, &path);
+                ost_fix_path(&path, key_leaf_pn);
+            }
+        }
+        ret = 0;
     }
-    return root;
+    file_commit();
+    pthread_rwlock_unlock(&db_latch);
+    trace_op_end();
+    hist_end(HIST_DELETE, t0);
+    return ret;
 }
 
 void destroy_tree_nodes(node * root) {
@@ -0,0 +1,403 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  buf.c
+ *
+ *    Description:  Message buffers in internal pages: writes enter
+ *                  at the root and go down in batches, lookups
+ *                  apply the messages met on the way down.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <limits.h>
+#include <string.h>
+#include "buf.h"
+#include "bpt.h"
+#include "ingest.h"
+#include "ost.h"
+#include "pin.h"
+#include "stats.h"
+
+bool tree_buffered = false;
+
+
+// The message of key in an internal page image, or NULL.
+static const buf_msg * find_msg(InternalPage * ip, int key) {
+    const buf_msg * m = INTL_MSGS(ip);
+    int lo = 0, hi = ip->mcnt - 1, mid;
+
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (m[mid].key == key)
+            return &m[mid];
+        if (m[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return NULL;
+}
+
+
+// Folds message m into the older message o of the same key.
+void buf_fold(buf_msg * o, const buf_msg * m) {
+    if (m->op != MSG_INSERT)
+        *o = *m;
+    else if (o->op == MSG_DELETE) {
+        // The key is gone, so the insert takes.
+        *o = *m;
+        o->op = MSG_UPSERT;
+    }
+    // An insert after an insert or upsert changes nothing.
+}
+
+
+/* Merges the sorted messages old and the newer sorted messages
+ * young into out.  Returns the number of messages in out.
+ */
+static int merge_msgs(const buf_msg * old, int n_old, const buf_msg * young, int n_young,
+        buf_msg * out) {
+    int i = 0, j = 0, k = 0;
+
+    while (i < n_old || j < n_young) {
+        if (j == n_young || (i < n_old && old[i].key < young[j].key))
+            out[k++] = old[i++];
+        else if (i == n_old || young[j].key < old[i].key)
+            out[k++] = young[j++];
+        else {
+            out[k] = old[i++];
+            buf_fold(&out[k++], &young[j++]);
+        }
+    }
+    return k;
+}
+
+
+/* Applies a message to its leaf with one descent, like a
+ * write of its own, splitting or merging the leaf as needed.
+ */
+static void apply_one(const buf_msg * m) {
+    descent path;
+    pagenum_t lpn;
+    LeafPage lp;
+    int i;
+
+    if ((lpn = find_leaf_path(m->key, &path)) == 0) {
+        if (m->op != MSG_DELETE)
+            start_new_tree(m->key, (char *)m->value);
+        return;
+    }
+    file_read_page(lpn, (page_t *)&lp);
+    i = leaf_key_index(&lp, m->key);
+    if (m->op == MSG_DELETE) {
+        if (i != -1)
+            delete_entry(&path, lpn, m->key);
+    } else if (i != -1) {
+        if (m->op == MSG_UPSERT) {
+            strcpy(lp.records[i].value, m->value);
+            file_write_page(lpn, (page_t *)&lp);
+        }
+    } else if (lp.kcnt < leaf_order - 1)
+        insert_into_leaf(lpn, m->key, (char *)m->value);
+    else
+        insert_into_leaf_after_splitting(&path, lpn, m->key, (char *)m->value);
+}
+
+
+/* Applies the sorted messages m to the leaf image lp at once.
+ * Returns false, leaving lp as it was, when the leaf would
+ * overflow or be left empty.
+ */
+static bool apply_to_leaf(LeafPage * lp, const buf_msg * m, int n) {
+    LeafPage out;
+    int i = 0, j = 0, k = 0;
+    bool take;
+
+    while (i < lp->kcnt || j < n) {
+        if (j == n || (i < lp->kcnt && lp->records[i].key < m[j].key)) {
+            take = false;
+            i++;
+        } else if (i == lp->kcnt || m[j].key < lp->records[i].key) {
+            if (m[j++].op == MSG_DELETE)
+                continue;
+            take = true;
+        } else {
+            if (m[j].op == MSG_DELETE) {
+                i++;
+                j++;
+                continue;
+            }
+            take = m[j++].op == MSG_UPSERT;
+            i++;
+        }
+        if (k == leaf_order - 1)
+            return false;
+        if (take) {
+            out.records[k].key = m[j - 1].key;
+            memcpy(out.records[k].value, m[j - 1].value, sizeof(out.records[k].value));
+        } else
+            out.records[k] = lp->records[i - 1];
+        k++;
+    }
+    if (k == 0)
+        return false;
+    memcpy(lp->records, out.records, k * sizeof(out.records[0]));
+    lp->kcnt = k;
+    return true;
+}
+
+
+/* Applies the sorted messages m, one per key, to the leaves,
+ * reading and writing each leaf once.  Leaves that would
+ * split or empty take their messages one at a time, and so
+ * does an empty tree.  The caller holds db_latch exclusively.
+ */
+void buf_apply(const buf_msg * m, int n) {
+    pagenum_t lpn;
+    LeafPage lp;
+    int i, j, k;
+
+    for (i = 0; i < n; i = j) {
+        if ((lpn = pin_find_leaf(m[i].key, NULL)) == 0) {
+            apply_one(&m[i]);
+            j = i + 1;
+            continue;
+        }
+        for (j = i + 1; j < n && pin_find_leaf(m[j].key, NULL) == lpn; j++) ;
+        file_read_page(lpn, (page_t *)&lp);
+        if (apply_to_leaf(&lp, m + i, j - i))
+            file_write_page(lpn, (page_t *)&lp);
+        else
+            for (k = i; k < j; k++)
+                apply_one(&m[k]);
+    }
+}
+
+
+/* Adds the sorted messages in, newer than the ones it holds,
+ * to the buffer of internal page pn.  While more than keep
+ * messages are left, the messages of the child with most of
+ * them go down to it.  The page is written before they do,
+ * since a split below may change it.
+ */
+static void buf_push(pagenum_t pn, const buf_msg * in, int n, int keep) {
+    page_t page;
+    InternalPage * ip = (InternalPage *)&page;
+    buf_msg * all;
+    pagenum_t * child;
+    int * first;
+    bool * down, leaves;
+    int c, i, cnt, best, left, kcnt;
+
+    file_read_page(pn, &page);
+    if (ip->mcnt + n == 0)
+        return;
+    kcnt = ip->kcnt;
+    all = malloc((ip->mcnt + n) * sizeof(buf_msg));
+    first = malloc((kcnt + 2) * sizeof(int));
+    child = malloc((kcnt + 1) * sizeof(pagenum_t));
+    down = calloc(kcnt + 1, sizeof(bool));
+    if (all == NULL || first == NULL || child == NULL || down == NULL) {
+        perror("Message buffer.");
+        exit(EXIT_FAILURE);
+    }
+    cnt = merge_msgs(INTL_MSGS(ip), ip->mcnt, in, n, all);
+
+    // Messages are in key order, so each child has a run of them.
+    for (c = 0, i = 0; c <= kcnt; c++) {
+        first[c] = i;
+        child[c] = *pin_entry(ip, c);
+        while (i < cnt && (c == kcnt || all[i].key < ip->records[c].key))
+            i++;
+    }
+    first[kcnt + 1] = cnt;
+
+    for (left = cnt; left > keep; left -= first[best + 1] - first[best]) {
+        best = -1;
+        for (c = 0; c <= kcnt; c++)
+            if (!down[c] && (best == -1
+                        || first[c + 1] - first[c] > first[best + 1] - first[best]))
+                best = c;
+        down[best] = true;
+    }
+    for (c = 0, ip->mcnt = 0; c <= kcnt; c++)
+        if (!down[c]) {
+            memcpy(&INTL_MSGS(ip)[ip->mcnt], &all[first[c]],
+                    (first[c + 1] - first[c]) * sizeof(buf_msg));
+            ip->mcnt += first[c + 1] - first[c];
+        }
+    file_write_page(pn, &page);
+
+    /* Internal pages are never freed on a buffered table, so
+     * a child page stays the one for its run.  Leaves may go,
+     * so their runs find their leaves again.
+     */
+    leaves = pin_lookup(child[0]) == NULL;
+    for (c = 0; c <= kcnt; c++) {
+        if (!down[c] || first[c + 1] == first[c])
+            continue;
+        stats_inc(STAT_BUF_FLUSH);
+        if (leaves)
+            buf_apply(all + first[c], first[c + 1] - first[c]);
+        else
+            buf_push(child[c], all + first[c], first[c + 1] - first[c],
+                    BUF_MSG_CAPACITY(page_size));
+    }
+    free(all);
+    free(first);
+    free(child);
+    free(down);
+}
+
+
+/* Adds a message for key to the root.  value is ignored by
+ * deletes.  The caller holds db_latch exclusively and the
+ * root is an internal page.
+ */
+void buf_put(int key, int op, const char * value) {
+    buf_msg m;
+
+    m.key = key;
+    m.op = op;
+    if (value != NULL)
+        strcpy(m.value, value);
+    else
+        m.value[0] = '\0';
+    buf_push(pin_rpn, &m, 1, BUF_MSG_CAPACITY(page_size));
+}
+
+
+/* Looks key up through the buffers on its path, then its leaf.
+ * Copies its value to value and returns 0, or returns -1.
+ * Runs under db_latch, shared or not.
+ */
+int buf_find(int key, char * value) {
+    descent path;
+    LeafPage lp;
+    const buf_msg * m, * ins = NULL;
+    int h, i;
+
+    if (pin_find_leaf(key, &path) == 0)
+        return -1;
+    for (h = 0; h < path.depth; h++) {
+        if ((m = find_msg(pin_lookup(path.pn[h])->page, key)) == NULL)
+            continue;
+        // An insert is older the lower it is, so the lowest one takes.
+        if (m->op == MSG_INSERT) {
+            ins = m;
+            continue;
+        }
+        if (m->op == MSG_DELETE)
+            goto absent;
+        strcpy(value, m->value);
+        return 0;
+    }
+    pin_read_leaf(key, (page_t *)&lp);
+    if ((i = leaf_key_index(&lp, key)) != -1) {
+        strcpy(value, lp.records[i].value);
+        return 0;
+    }
+absent:
+    if (ins == NULL)
+        return -1;
+    strcpy(value, ins->value);
+    return 0;
+}
+
+
+/* Empties every buffer, a level at a time from the top, each
+ * level in key order.  Pages only receive messages from their
+ * parents, so a level stays empty once it is done; heights
+ * above the leaves do not change, while depths do when the
+ * root splits.  The caller holds db_latch exclusively.
+ * Returns the number of messages the pages flushed held.
+ */
+int64_t buf_flush_all(void) {
+    descent path;
+    InternalPage * ip;
+    int64_t key, bound, moved = 0;
+    int h, k, depth;
+
+    for (h = tree_height; h >= 1; h--)
+        for (key = INT_MIN; key <= INT_MAX; key = bound) {
+            pin_find_leaf((int)key, &path);
+            depth = tree_height - h;
+            // The page ends where the first ancestor entry to its right begins.
+            bound = (int64_t)INT_MAX + 1;
+            for (k = depth - 1; k >= 0; k--) {
+                ip = pin_lookup(path.pn[k])->page;
+                if (path.idx[k] < ip->kcnt) {
+                    bound = ip->records[path.idx[k]].key;
+                    break;
+                }
+            }
+            ip = pin_lookup(path.pn[depth])->page;
+            if (ip->mcnt > 0) {
+                moved += ip->mcnt;
+                buf_push(path.pn[depth], NULL, 0, 0);
+            }
+        }
+    return moved;
+}
+
+
+/* Takes db_latch for a scan.  On a buffered table, or one
+ * with the ingest tier, the latch is taken exclusively and
+ * the tier is merged and the buffers are flushed first; the
+ * scan keeps the latch until it releases it as usual.
+ */
+void buf_scan_lock(void) {
+    if (!tree_buffered && !ingest_on) {
+        pthread_rwlock_rdlock(&db_latch);
+        return;
+    }
+    pthread_rwlock_wrlock(&db_latch);
+    if (ingest_on)
+        ingest_drain();
+    if (tree_buffered && buf_flush_all() > 0)
+        file_commit();
+}
+
+
+/* Turns message buffers on for the opened table.  Internal
+ * pages get the buffered layout, so the table must not have
+ * any yet.  Returns 0, or -1 if the table has internal pages
+ * or keeps subtree counts.
+ */
+int db_enable_buffers(void) {
+    HeaderPage hp;
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&db_latch);
+    if (!tree_buffered && (tree_height > 0 || tree_counted))
+        ret = -1;
+    else if (!tree_buffered) {
+        file_read_page(0, (page_t *)&hp);
+        hp.flags |= HDR_BUFFERED;
+        file_write_page(0, (page_t *)&hp);
+        tree_buffered = true;
+        intl_order = BUF_INTL_CAPACITY(page_size) + 1;
+        file_commit();
+    }
+    pthread_rwlock_unlock(&db_latch);
+    return ret;
+}
+
+
+/* Sends every buffered message down to its leaf.
+ * Returns 0.
+ */
+int db_flush_buffers(void) {
+    pthread_rwlock_wrlock(&db_latch);
+    if (tree_buffered && buf_flush_all() > 0)
+        file_commit();
+    pthread_rwlock_unlock(&db_latch);
+    return 0;
+}
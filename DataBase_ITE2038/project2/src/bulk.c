@@ -0,0 +1,228 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  bulk.c
+ *
+ *    Description:  Parallel bulk build of an empty table from sorted input.
+ *
+ *                  Level 0 holds the leaves, level h + 1 the parents of
+ *                  level h.  Level h has cnt[h] pages numbered from
+ *                  first[h], and its children (records for leaves) are
+ *                  spread evenly: page j takes children
+ *                  [j * c / cnt[h], (j + 1) * c / cnt[h]).  Any page can
+ *                  therefore be written knowing only its level and index.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <pthread.h>
+#include <string.h>
+#include "bulk.h"
+#include "bpt.h"
+#include "stats.h"
+#include "ost.h"
+#include "pin.h"
+
+#define BULK_MAX_LEVELS 32
+
+typedef struct bulk_plan {
+    int n;
+    const int * keys;
+    char (* values)[120];
+    int levels;
+    int64_t cnt[BULK_MAX_LEVELS];      // pages per level
+    pagenum_t first[BULK_MAX_LEVELS];  // first page of each level
+} bulk_plan;
+
+typedef struct bulk_job {
+    pthread_t tid;
+    const bulk_plan * plan;
+    int level_end;          // levels [0, level_end) are built by workers
+    int id;
+    int threads;
+} bulk_job;
+
+
+// First child (record for leaves) of page j of level h.
+static int64_t child_start(const bulk_plan * p, int h, int64_t j) {
+    int64_t children = h == 0 ? p->n : p->cnt[h - 1];
+    return j * children / p->cnt[h];
+}
+
+
+// Smallest key under page j of level h.
+static int min_key(const bulk_plan * p, int h, int64_t j) {
+    while (h > 0) {
+        j = child_start(p, h, j);
+        h--;
+    }
+    return p->keys[child_start(p, 0, j)];
+}
+
+
+// First record under page j of level h.
+static int64_t record_start(const bulk_plan * p, int h, int64_t j) {
+    for ( ; h >= 0; h--)
+        j = child_start(p, h, j);
+    return j;
+}
+
+
+static void build_page(const bulk_plan * p, int h, int64_t j, page_t * buf) {
+    LeafPage * lp = (LeafPage *)buf;
+    InternalPage * ip = (InternalPage *)buf;
+    int64_t c, c0 = child_start(p, h, j), c1 = child_start(p, h, j + 1);
+    int i;
+
+    memset(buf, 0, page_size);
+    if (h == 0) {
+        lp->is_leaf = true;
+        lp->kcnt = (int)(c1 - c0);
+        lp->rspn = j + 1 < p->cnt[0] ? p->first[0] + j + 1 : 0;
+        for (c = c0, i = 0; c < c1; c++, i++) {
+            lp->records[i].key = p->keys[c];
+            memcpy(lp->records[i].value, p->values[c], 120);
+        }
+    } else {
+        ip->is_leaf = false;
+        ip->kcnt = (int)(c1 - c0 - 1);
+        ip->lspn = p->first[h - 1] + c0;
+        for (c = c0 + 1, i = 0; c < c1; c++, i++) {
+            ip->records[i].key = min_key(p, h - 1, c);
+            ip->records[i].pn = p->first[h - 1] + c;
+        }
+        if (tree_counted)
+            for (c = c0, i = 0; c < c1; c++, i++)
+                INTL_COUNTS(ip)[i] = (uint32_t)(record_start(p, h - 1, c + 1)
+                        - record_start(p, h - 1, c));
+    }
+    file_write_page(p->first[h] + j, buf);
+}
+
+
+/* Builds this worker's share, a contiguous key range,
+ * of every level below level_end.
+ */
+static void * bulk_worker(void * arg) {
+    bulk_job * job = (bulk_job *)arg;
+    const bulk_plan * p = job->plan;
+    page_t * buf = malloc(sizeof(page_t));
+    int64_t j, j0, j1;
+    int h;
+
+    if (buf == NULL) {
+        perror("Bulk page buffer.");
+        exit(EXIT_FAILURE);
+    }
+    for (h = 0; h < job->level_end; h++) {
+        j0 = p->cnt[h] * job->id / job->threads;
+        j1 = p->cnt[h] * (job->id + 1) / job->threads;
+        for (j = j0; j < j1; j++)
+            build_page(p, h, j, buf);
+    }
+    free(buf);
+    return NULL;
+}
+
+
+/* Builds the tree of an empty table from n records sorted by
+ * strictly increasing key, with threads workers, filling pages
+ * to the fraction fill of their capacity.
+ * Returns 0, or -1 if the table is not empty or the input
+ * is not sorted.
+ */
+int db_bulk_load(int n, const int keys[], char values[][120], int threads,
+        double fill) {
+    HeaderPage hp;
+    bulk_plan plan;
+    bulk_job * jobs;
+    page_t * buf;
+    int64_t children, per_page;
+    int i, h, level_end;
+
+    if (n <= 0)
+        return 0;
+    for (i = 1; i < n; i++)
+        if (keys[i - 1] >= keys[i])
+            return -1;
+    if (fill <= 0 || fill > 1)
+        fill = BULK_DEFAULT_FILL;
+    if (threads < 1)
+        threads = 1;
+
+    pthread_rwlock_wrlock(&db_latch);
+    file_read_page(0, (page_t *)&hp);
+    if (hp.rpn != 0) {
+        pthread_rwlock_unlock(&db_latch);
+        return -1;
+    }
+
+    // Lay the levels out after the last page of the file.
+    plan.n = n;
+    plan.keys = keys;
+    plan.values = values;
+    plan.levels = 0;
+    children = n;
+    do {
+        h = plan.levels++;
+        per_page = (int64_t)((h == 0 ? leaf_order - 1 : intl_order) * fill);
+        if (per_page < (h == 0 ? 1 : 2))
+            per_page = h == 0 ? 1 : 2;
+        plan.cnt[h] = (children + per_page - 1) / per_page;
+        plan.first[h] = h == 0 ? (pagenum_t)hp.pcnt : plan.first[h - 1] + plan.cnt[h - 1];
+        children = plan.cnt[h];
+    } while (children > 1 && plan.levels < BULK_MAX_LEVELS);
+
+    // Reserve the pages before anything is written.
+    hp.pcnt = (int)(plan.first[plan.levels - 1] + plan.cnt[plan.levels - 1]);
+    for (h = 0; h < plan.levels; h++)
+        stats_add(STAT_PAGE_ALLOC, plan.cnt[h]);
+    stats_add(STAT_FILE_EXTEND, hp.pcnt - plan.first[0]);
+
+    // Workers take the levels with at least a page each.
+    for (level_end = 0; level_end < plan.levels && plan.cnt[level_end] >= threads; level_end++)
+        ;
+
+    jobs = calloc(threads, sizeof(bulk_job));
+    buf = malloc(sizeof(page_t));
+    if (jobs == NULL || buf == NULL) {
+        perror("Bulk build.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < threads; i++) {
+        jobs[i].plan = &plan;
+        jobs[i].level_end = level_end;
+        jobs[i].id = i;
+        jobs[i].threads = threads;
+        pthread_create(&jobs[i].tid, NULL, bulk_worker, &jobs[i]);
+    }
+    for (i = 0; i < threads; i++)
+        pthread_join(jobs[i].tid, NULL);
+
+    // Top levels, a handful of pages.
+    for (h = level_end; h < plan.levels; h++)
+        for (children = 0; children < plan.cnt[h]; children++)
+            build_page(&plan, h, children, buf);
+    /* Workers may have written parents before their children,
+     * which left those entries unswizzled.
+     */
+    pin_link();
+
+    // The new tree becomes visible with the header page.
+    hp.rpn = (int)plan.first[plan.levels - 1];
+    file_write_page(0, (page_t *)&hp);
+    file_commit();
+    tree_height = plan.levels - 1;
+    stats_set_height(tree_height);
+    pthread_rwlock_unlock(&db_latch);
+
+    free(buf);
+    free(jobs);
+    return 0;
+}
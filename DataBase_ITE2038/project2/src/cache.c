@@ -0,0 +1,547 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  cache.c
+ *
+ *    Description:  Sharded leaf page cache with clock or 2Q
+ *                  replacement, and the leaf side of pointer
+ *                  swizzling.
+ *
+ *                  Readers under the shared db_latch fill and replace
+ *                  frames, so every change to a frame, and every write
+ *                  of a SWZ_LEAF entry, happens under the latch of the
+ *                  shard of its page.  An entry keeps its page number
+ *                  while readers run, swizzled or not, so it stays in
+ *                  one shard.  Writers replacing entries take every
+ *                  shard latch (cache_lock_all).
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <string.h>
+#include "cache.h"
+#include "stats.h"
+
+// A shard: its frames, their hash table and replacement state.
+typedef struct cache_shard {
+    pthread_mutex_t latch;
+    cache_frame * frames;
+    uint32_t size, hand;
+    cache_frame ** hash;
+    uint32_t mask;
+    // Queues, by enum cache_queue.  CQ_CLOCK frames are not linked.
+    cache_frame * q_head[CQ_COUNT], * q_tail[CQ_COUNT];
+    uint32_t q_len[CQ_COUNT];
+    uint32_t in_max;
+    // 2Q ghost queue: a ring of page numbers, hashed by ghost_slot.
+    pagenum_t * ghost_pn;
+    uint32_t * ghost_next;
+    uint32_t * ghost_hash;
+    uint32_t ghost_size, ghost_mask, ghost_pos;
+} __attribute__((aligned(64))) cache_shard;
+
+#define GHOST_NIL UINT32_MAX
+
+__thread bool cache_scan = false;
+
+static uint32_t cache_size = CACHE_DEFAULT_FRAMES;
+static uint32_t cache_next_shards = CACHE_DEFAULT_SHARDS;
+static enum cache_policy cache_next_policy = CACHE_DEFAULT_POLICY;
+static enum cache_policy cache_policy = CACHE_DEFAULT_POLICY;
+static cache_frame * cache_frames = NULL;
+static char * cache_mem = NULL;
+static cache_shard * cache_shards = NULL;
+static uint32_t cache_nshards = 0;
+static int cache_shard_bits = 0;
+
+
+static inline uint64_t cache_mix(pagenum_t pn) {
+    return pn * 0x9E3779B97F4A7C15ull;
+}
+
+
+static inline cache_shard * shard_of(pagenum_t pn) {
+    return &cache_shards[cache_shard_bits ? cache_mix(pn) >> (64 - cache_shard_bits) : 0];
+}
+
+
+static inline uint32_t cache_slot(cache_shard * sh, pagenum_t pn) {
+    return (uint32_t)(cache_mix(pn) >> 32) & sh->mask;
+}
+
+
+static inline uint32_t ghost_slot(cache_shard * sh, pagenum_t pn) {
+    return (uint32_t)(cache_mix(pn) >> 32) & sh->ghost_mask;
+}
+
+
+// A frame is written between frame_begin and frame_end.
+static inline void frame_begin(cache_frame * f) {
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+static inline void frame_end(cache_frame * f) {
+    __atomic_store_n(&f->seq, f->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+static cache_frame * lookup(cache_shard * sh, pagenum_t pn) {
+    cache_frame * f;
+    for (f = sh->hash[cache_slot(sh, pn)]; f != NULL; f = f->hnext)
+        if (f->pn == pn)
+            return f;
+    return NULL;
+}
+
+
+// Puts the page number back into the parent entry holding the frame.
+static void unswizzle(cache_frame * f) {
+    uint32_t tag = SWZ_LEAF | (uint32_t)(f - cache_frames);
+    InternalPage * ip;
+    int i;
+
+    if (f->swz_parent == NULL)
+        return;
+    ip = f->swz_parent->page;
+    for (i = 0; i <= ip->kcnt; i++)
+        if (__atomic_load_n(pin_entry(ip, i), __ATOMIC_RELAXED) == tag) {
+            __atomic_store_n(pin_entry(ip, i), (uint32_t)f->pn, __ATOMIC_RELAXED);
+            break;
+        }
+    f->swz_parent = NULL;
+}
+
+
+// Moves the single tagged entry of f into parent.
+static void adopt(cache_frame * f, pin_frame * parent) {
+    if (f->swz_parent != parent)
+        unswizzle(f);
+    f->swz_parent = parent;
+}
+
+
+static void q_unlink(cache_shard * sh, cache_frame * f) {
+    if (f->queue != CQ_CLOCK) {
+        *(f->prev != NULL ? &f->prev->next : &sh->q_head[f->queue]) = f->next;
+        *(f->next != NULL ? &f->next->prev : &sh->q_tail[f->queue]) = f->prev;
+        f->prev = f->next = NULL;
+    }
+    sh->q_len[f->queue]--;
+}
+
+
+// Puts f at the head of queue q.
+static void q_push(cache_shard * sh, cache_frame * f, enum cache_queue q) {
+    __atomic_store_n(&f->queue, q, __ATOMIC_RELAXED);
+    sh->q_len[q]++;
+    if (q == CQ_CLOCK)
+        return;
+    f->prev = NULL;
+    f->next = sh->q_head[q];
+    *(f->next != NULL ? &f->next->prev : &sh->q_tail[q]) = f;
+    sh->q_head[q] = f;
+}
+
+
+// Remembers pn in the ghost queue, forgetting its oldest page.
+static void ghost_add(cache_shard * sh, pagenum_t pn) {
+    uint32_t * pp, g = sh->ghost_pos;
+
+    if (sh->ghost_pn[g] != 0) {
+        for (pp = &sh->ghost_hash[ghost_slot(sh, sh->ghost_pn[g])]; *pp != g;
+                pp = &sh->ghost_next[*pp])
+            ;
+        *pp = sh->ghost_next[g];
+    }
+    sh->ghost_pn[g] = pn;
+    sh->ghost_next[g] = sh->ghost_hash[ghost_slot(sh, pn)];
+    sh->ghost_hash[ghost_slot(sh, pn)] = g;
+    sh->ghost_pos = (g + 1) % sh->ghost_size;
+}
+
+
+// Forgets pn, returning whether the ghost queue remembered it.
+static bool ghost_take(cache_shard * sh, pagenum_t pn) {
+    uint32_t * pp;
+
+    for (pp = &sh->ghost_hash[ghost_slot(sh, pn)]; *pp != GHOST_NIL; pp = &sh->ghost_next[*pp])
+        if (sh->ghost_pn[*pp] == pn) {
+            sh->ghost_pn[*pp] = 0;
+            *pp = sh->ghost_next[*pp];
+            return true;
+        }
+    return false;
+}
+
+
+// Empties frame f onto the free queue.
+static void evict(cache_shard * sh, cache_frame * f) {
+    cache_frame ** pp;
+
+    if (f->pn == 0)
+        return;
+    // Readers check the entry after the frame, so it goes first.
+    unswizzle(f);
+    for (pp = &sh->hash[cache_slot(sh, f->pn)]; *pp != NULL; pp = &(*pp)->hnext)
+        if (*pp == f) {
+            *pp = f->hnext;
+            break;
+        }
+    q_unlink(sh, f);
+    q_push(sh, f, CQ_FREE);
+    frame_begin(f);
+    __atomic_store_n(&f->pn, 0, __ATOMIC_RELAXED);
+    frame_end(f);
+}
+
+
+/* Picks the frame to replace: a free one, else the oldest
+ * page a scan read in.  Clock: the first frame without its
+ * reference bit.  2Q: the oldest of A1in while it is over its
+ * size, else the first of Am, from its tail, without its
+ * reference bit.
+ */
+static cache_frame * victim(cache_shard * sh) {
+    cache_frame * f;
+
+    if (sh->q_head[CQ_FREE] != NULL)
+        return sh->q_head[CQ_FREE];
+    if (sh->q_tail[CQ_SCAN] != NULL)
+        return sh->q_tail[CQ_SCAN];
+    if (cache_policy == CACHE_2Q) {
+        if (sh->q_len[CQ_IN] > sh->in_max || sh->q_tail[CQ_MAIN] == NULL) {
+            f = sh->q_tail[CQ_IN];
+            ghost_add(sh, f->pn);
+            return f;
+        }
+        while (__atomic_load_n(&(f = sh->q_tail[CQ_MAIN])->ref, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&f->ref, false, __ATOMIC_RELAXED);
+            q_unlink(sh, f);
+            q_push(sh, f, CQ_MAIN);
+        }
+        return f;
+    }
+    for (;;) {
+        f = &sh->frames[sh->hand];
+        sh->hand = (sh->hand + 1) % sh->size;
+        if (f->pn == 0 || !__atomic_load_n(&f->ref, __ATOMIC_RELAXED))
+            return f;
+        __atomic_store_n(&f->ref, false, __ATOMIC_RELAXED);
+    }
+}
+
+
+/* Counts a hit on f, unless the page is read by a scan.
+ * The caller holds the latch of the shard.
+ */
+static void touch(cache_shard * sh, cache_frame * f) {
+    if (cache_scan)
+        return;
+    __atomic_store_n(&f->ref, true, __ATOMIC_RELAXED);
+    if (f->queue == CQ_SCAN) {
+        q_unlink(sh, f);
+        q_push(sh, f, cache_policy == CACHE_CLOCK ? CQ_CLOCK : CQ_IN);
+    }
+}
+
+
+void cache_lock_all(void) {
+    uint32_t s;
+    for (s = 0; s < cache_nshards; s++)
+        pthread_mutex_lock(&cache_shards[s].latch);
+}
+
+
+void cache_unlock_all(void) {
+    uint32_t s;
+    for (s = cache_nshards; s > 0; s--)
+        pthread_mutex_unlock(&cache_shards[s - 1].latch);
+}
+
+
+/* Sets the number of frames.  Takes effect when the
+ * next table is opened.
+ */
+void db_cache_set_frames(uint32_t frames) {
+    cache_size = frames > 0 ? frames : 1;
+}
+
+
+/* Sets the replacement policy.  Takes effect when the
+ * next table is opened.
+ */
+void db_cache_set_policy(enum cache_policy policy) {
+    cache_next_policy = policy;
+}
+
+
+/* Sets the number of shards, rounded down to a power of
+ * two.  Takes effect when the next table is opened.
+ */
+void db_cache_set_shards(uint32_t shards) {
+    for (cache_next_shards = 1; cache_next_shards * 2 <= shards; cache_next_shards *= 2)
+        ;
+}
+
+
+static void shard_free(cache_shard * sh) {
+    pthread_mutex_destroy(&sh->latch);
+    free(sh->hash);
+    free(sh->ghost_pn);
+    free(sh->ghost_next);
+    free(sh->ghost_hash);
+}
+
+
+// Gives shard sh the n frames from first on.
+static void shard_init(cache_shard * sh, uint16_t idx, cache_frame * first, uint32_t n) {
+    uint32_t i, buckets, gbuckets;
+
+    memset(sh, 0, sizeof(*sh));
+    pthread_mutex_init(&sh->latch, NULL);
+    sh->frames = first;
+    sh->size = n;
+    sh->ghost_size = n * CACHE_2Q_OUT / 100 > 0 ? n * CACHE_2Q_OUT / 100 : 1;
+    sh->in_max = n * CACHE_2Q_IN / 100 > 0 ? n * CACHE_2Q_IN / 100 : 1;
+    for (buckets = 1; buckets < n; buckets <<= 1)
+        ;
+    for (gbuckets = 1; gbuckets < sh->ghost_size; gbuckets <<= 1)
+        ;
+    sh->hash = calloc(buckets, sizeof(cache_frame *));
+    sh->ghost_pn = calloc(sh->ghost_size, sizeof(pagenum_t));
+    sh->ghost_next = malloc(sh->ghost_size * sizeof(uint32_t));
+    sh->ghost_hash = malloc(gbuckets * sizeof(uint32_t));
+    if (sh->hash == NULL || sh->ghost_pn == NULL || sh->ghost_next == NULL
+            || sh->ghost_hash == NULL) {
+        perror("Leaf cache.");
+        exit(EXIT_FAILURE);
+    }
+    memset(sh->ghost_hash, 0xff, gbuckets * sizeof(uint32_t));
+    sh->mask = buckets - 1;
+    sh->ghost_mask = gbuckets - 1;
+    for (i = 0; i < n; i++) {
+        first[i].shard = idx;
+        q_push(sh, &first[i], CQ_FREE);
+    }
+}
+
+
+// Drops every frame and sizes the cache for page_size.
+void cache_reset(void) {
+    uint32_t i, s, n, per, base;
+
+    for (s = 0; s < cache_nshards; s++)
+        shard_free(&cache_shards[s]);
+    free(cache_shards);
+    free(cache_frames);
+    free(cache_mem);
+    for (n = cache_next_shards; n > 1 && cache_size / n < CACHE_SHARD_MIN; n /= 2)
+        ;
+    cache_frames = calloc(cache_size, sizeof(cache_frame));
+    cache_mem = malloc((size_t)cache_size * page_size);
+    cache_shards = aligned_alloc(64, n * sizeof(cache_shard));
+    if (cache_frames == NULL || cache_mem == NULL || cache_shards == NULL) {
+        perror("Leaf cache.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < cache_size; i++)
+        cache_frames[i].page = (page_t *)(cache_mem + (size_t)i * page_size);
+    // The first cache_size % n shards take one frame more.
+    for (s = 0, base = 0; s < n; s++, base += per) {
+        per = cache_size / n + (s < cache_size % n);
+        shard_init(&cache_shards[s], s, &cache_frames[base], per);
+    }
+    cache_nshards = n;
+    for (cache_shard_bits = 0; (1u << cache_shard_bits) < n; cache_shard_bits++)
+        ;
+    cache_policy = cache_next_policy;
+}
+
+
+bool cache_read(pagenum_t pn, page_t * dest) {
+    cache_shard * sh = shard_of(pn);
+    cache_frame * f;
+
+    pthread_mutex_lock(&sh->latch);
+    if ((f = lookup(sh, pn)) != NULL) {
+        memcpy(dest, f->page, page_size);
+        touch(sh, f);
+    }
+    pthread_mutex_unlock(&sh->latch);
+    stats_inc(f != NULL ? STAT_LEAF_HIT : STAT_LEAF_MISS);
+    return f != NULL;
+}
+
+
+// Caches a page just read from or written to the file.
+void cache_install(pagenum_t pn, const page_t * src) {
+    cache_shard * sh = shard_of(pn);
+    cache_frame * f;
+    bool promote = false;
+
+    pthread_mutex_lock(&sh->latch);
+    if ((f = lookup(sh, pn)) == NULL) {
+        f = victim(sh);
+        evict(sh, f);
+        q_unlink(sh, f);
+        frame_begin(f);
+        __atomic_store_n(&f->pn, pn, __ATOMIC_RELAXED);
+        f->hnext = sh->hash[cache_slot(sh, pn)];
+        sh->hash[cache_slot(sh, pn)] = f;
+        __atomic_store_n(&f->ref, !cache_scan, __ATOMIC_RELAXED);
+        if (cache_scan)
+            q_push(sh, f, CQ_SCAN);
+        else if (cache_policy == CACHE_CLOCK)
+            q_push(sh, f, CQ_CLOCK);
+        else {
+            // A page read in again while remembered skips probation.
+            promote = ghost_take(sh, pn);
+            q_push(sh, f, promote ? CQ_MAIN : CQ_IN);
+        }
+    } else {
+        touch(sh, f);
+        frame_begin(f);
+    }
+    memcpy(f->page, src, page_size);
+    frame_end(f);
+    pthread_mutex_unlock(&sh->latch);
+    if (promote)
+        stats_inc(STAT_CACHE_PROMOTE);
+}
+
+
+// Writes a page through to its frame, if it has one.
+void cache_update(pagenum_t pn, const page_t * src) {
+    cache_shard * sh = shard_of(pn);
+    cache_frame * f;
+
+    pthread_mutex_lock(&sh->latch);
+    if ((f = lookup(sh, pn)) != NULL) {
+        frame_begin(f);
+        memcpy(f->page, src, page_size);
+        frame_end(f);
+    }
+    pthread_mutex_unlock(&sh->latch);
+}
+
+
+void cache_drop(pagenum_t pn) {
+    cache_shard * sh = shard_of(pn);
+    cache_frame * f;
+
+    pthread_mutex_lock(&sh->latch);
+    if ((f = lookup(sh, pn)) != NULL)
+        evict(sh, f);
+    pthread_mutex_unlock(&sh->latch);
+}
+
+
+/* Page of a SWZ_LEAF index.  Only good while the entry
+ * holding the index still does, so a caller without the
+ * shard latch reads the entry again afterwards.
+ */
+pagenum_t cache_frame_pn(uint32_t idx) {
+    return __atomic_load_n(&cache_frames[idx].pn, __ATOMIC_ACQUIRE);
+}
+
+
+/* Index of the frame of pn, which parent is about to hold,
+ * or -1 if pn is not cached.  The caller holds every shard
+ * latch.
+ */
+int64_t cache_index(pagenum_t pn, pin_frame * parent) {
+    cache_frame * f = lookup(shard_of(pn), pn);
+    if (f == NULL)
+        return -1;
+    adopt(f, parent);
+    return f - cache_frames;
+}
+
+
+/* Copies the frame of a swizzled entry e to dest without
+ * a latch.  Fails if the frame was being written or the
+ * entry moved meanwhile, or if the hit has to move a scan
+ * page on to the policy.  Returns the page number, or 0.
+ */
+static pagenum_t read_swizzled(uint32_t * entry, uint32_t e, page_t * dest) {
+    cache_frame * f = &cache_frames[e & SWZ_MASK];
+    uint32_t s = __atomic_load_n(&f->seq, __ATOMIC_ACQUIRE);
+    pagenum_t pn;
+
+    if ((s & 1) || (!cache_scan && __atomic_load_n(&f->queue, __ATOMIC_RELAXED) == CQ_SCAN))
+        return 0;
+    pn = __atomic_load_n(&f->pn, __ATOMIC_RELAXED);
+    memcpy(dest, f->page, page_size);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    // The entry first: a frame swizzled into it again was written since.
+    if (__atomic_load_n(entry, __ATOMIC_ACQUIRE) != e
+            || __atomic_load_n(&f->seq, __ATOMIC_RELAXED) != s)
+        return 0;
+    if (!cache_scan && !__atomic_load_n(&f->ref, __ATOMIC_RELAXED))
+        __atomic_store_n(&f->ref, true, __ATOMIC_RELAXED);
+    return pn;
+}
+
+
+/* Copies leaf child i of a pinned frame to dest, following a
+ * swizzled entry without any lookup or latch, and swizzles
+ * the entry on a hash hit.  Returns the leaf page number, or
+ * 0 if the leaf is not cached.
+ */
+pagenum_t cache_read_child(pin_frame * parent, int i, page_t * dest) {
+    uint32_t * entry = pin_entry(parent->page, i);
+    uint32_t e = __atomic_load_n(entry, __ATOMIC_ACQUIRE);
+    cache_shard * sh;
+    cache_frame * f;
+    pagenum_t pn = 0;
+
+    if ((e & SWZ_LEAF) && (pn = read_swizzled(entry, e, dest)) != 0) {
+        stats_inc(STAT_CACHE_HIT);
+        stats_inc(STAT_LEAF_HIT);
+        return pn;
+    }
+    sh = e & SWZ_LEAF ? &cache_shards[cache_frames[e & SWZ_MASK].shard] : shard_of(e);
+    pthread_mutex_lock(&sh->latch);
+    e = __atomic_load_n(entry, __ATOMIC_RELAXED);
+    if (e & SWZ_LEAF)
+        f = &cache_frames[e & SWZ_MASK];
+    else if ((f = lookup(sh, e)) != NULL) {
+        adopt(f, parent);
+        __atomic_store_n(entry, SWZ_LEAF | (uint32_t)(f - cache_frames), __ATOMIC_RELEASE);
+    }
+    if (f != NULL) {
+        memcpy(dest, f->page, page_size);
+        touch(sh, f);
+        pn = f->pn;
+    }
+    pthread_mutex_unlock(&sh->latch);
+    if (f != NULL) {
+        stats_inc(STAT_CACHE_HIT);
+        stats_inc(STAT_LEAF_HIT);
+    }
+    return pn;
+}
+
+
+// Swizzles entry i of parent once pn is cached.
+void cache_swizzle(pin_frame * parent, int i, pagenum_t pn) {
+    cache_shard * sh = shard_of(pn);
+    cache_frame * f;
+
+    pthread_mutex_lock(&sh->latch);
+    if (__atomic_load_n(pin_entry(parent->page, i), __ATOMIC_RELAXED) == pn
+            && (f = lookup(sh, pn)) != NULL) {
+        adopt(f, parent);
+        __atomic_store_n(pin_entry(parent->page, i),
+                SWZ_LEAF | (uint32_t)(f - cache_frames), __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&sh->latch);
+}
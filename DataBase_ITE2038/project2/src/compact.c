@@ -0,0 +1,304 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  compact.c
+ *
+ *    Description:  Background compaction: merges and evens out
+ *                  sparse sibling leaves off the delete path,
+ *                  within a page I/O budget.
+ *
+ *                  cmp_lock guards the queue of leaves deletes
+ *                  left under half full and the thread state.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "compact.h"
+#include "bpt.h"
+#include "ost.h"
+#include "pin.h"
+#include "cache.h"
+#include "stats.h"
+
+// Sentinel of a pass over the tree: past every key.
+#define COMPACT_END ((int64_t)INT_MAX + 1)
+
+static pthread_mutex_t cmp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cmp_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t cmp_thread;
+static bool cmp_running = false;
+static bool cmp_stop = false;
+static uint32_t cmp_budget = 0;        // page reads and writes per second, 0 when off
+
+static int cmp_queue[COMPACT_QUEUE];
+static int cmp_head = 0, cmp_len = 0;
+static bool cmp_rescan = false;        // the queue overflowed
+static int64_t cmp_cursor = COMPACT_END;
+
+
+/* Remembers the leaf of key, left with kcnt records by a
+ * delete, if it is under half full.  The caller holds
+ * db_latch exclusively.
+ */
+void compact_note(int key, int kcnt) {
+    if (!cmp_running || kcnt >= (leaf_order - 1) / 2)
+        return;
+    pthread_mutex_lock(&cmp_lock);
+    if (cmp_len < COMPACT_QUEUE)
+        cmp_queue[(cmp_head + cmp_len++) % COMPACT_QUEUE] = key;
+    else
+        cmp_rescan = true;
+    pthread_mutex_unlock(&cmp_lock);
+}
+
+
+/* Merges the leaf r into its left sibling l, both under the
+ * last page of path d, whose entry separating them is sep.
+ * The parent goes on as a delete of sep would.  Returns the
+ * pages written.
+ */
+static int merge_leaves(descent * d, int key, pagenum_t lpn, LeafPage * l,
+        pagenum_t rpn, LeafPage * r, int sep) {
+    memcpy(&l->records[l->kcnt], r->records, r->kcnt * sizeof(r->records[0]));
+    l->kcnt += r->kcnt;
+    l->rspn = r->rspn;
+    file_write_page(lpn, (page_t *)l);
+    d->depth--;
+    delete_entry(d, d->pn[d->depth], sep);
+    file_free_page(rpn);
+    // The parent still counts the records of l alone.
+    if (tree_counted && tree_height >= 0) {
+        lpn = find_leaf_path(key, d);
+        ost_fix_path(d, lpn);
+    }
+    stats_inc(STAT_COMPACT_MERGE);
+    return 4;
+}
+
+
+/* Moves records between the sibling leaves l and r, the
+ * children i and i + 1 of the page ppn read into parent, so
+ * they hold half each.  Returns the pages written.
+ */
+static int even_leaves(pagenum_t ppn, InternalPage * parent, int i,
+        pagenum_t lpn, LeafPage * l, pagenum_t rpn, LeafPage * r) {
+    int want = (l->kcnt + r->kcnt) / 2, n;
+
+    if (l->kcnt > want) {
+        n = l->kcnt - want;
+        memmove(&r->records[n], r->records, r->kcnt * sizeof(r->records[0]));
+        memcpy(r->records, &l->records[want], n * sizeof(r->records[0]));
+        l->kcnt -= n;
+        r->kcnt += n;
+    } else {
+        n = want - l->kcnt;
+        memcpy(&l->records[l->kcnt], r->records, n * sizeof(r->records[0]));
+        memmove(r->records, &r->records[n], (r->kcnt - n) * sizeof(r->records[0]));
+        l->kcnt += n;
+        r->kcnt -= n;
+    }
+    parent->records[i].key = r->records[0].key;
+    if (tree_counted) {
+        INTL_COUNTS(parent)[i] = l->kcnt;
+        INTL_COUNTS(parent)[i + 1] = r->kcnt;
+    }
+    file_write_page(lpn, (page_t *)l);
+    file_write_page(rpn, (page_t *)r);
+    file_write_page(ppn, (page_t *)parent);
+    stats_inc(STAT_COMPACT_EVEN);
+    return 3;
+}
+
+
+/* Works on the leaf of key and a sibling under the same
+ * parent: the one to its right, or when scan is false and
+ * there is none, the one to its left.  Sets *next to the
+ * key a pass goes on from.  Returns the pages read and
+ * written.  The caller holds db_latch exclusively.
+ */
+static int compact_pair(int key, bool scan, int64_t * next) {
+    descent path;
+    page_t pimg;
+    InternalPage * parent = (InternalPage *)&pimg, * ip;
+    LeafPage l, r;
+    pagenum_t ppn, lpn, rpn;
+    int i, k, sep, cap = leaf_order - 1;
+
+    *next = COMPACT_END;
+    if (tree_height <= 0)
+        return 0;
+    pin_find_leaf(key, &path);
+    // A pass goes on where the parent ends.
+    for (k = path.depth - 2; k >= 0; k--) {
+        ip = pin_lookup(path.pn[k])->page;
+        if (path.idx[k] < ip->kcnt) {
+            *next = ip->records[path.idx[k]].key;
+            break;
+        }
+    }
+    ppn = path.pn[path.depth - 1];
+    file_read_page(ppn, &pimg);
+    i = path.idx[path.depth - 1];
+    if (parent->kcnt == 0 || (scan && i == parent->kcnt))
+        return 0;
+    if (i == parent->kcnt)
+        i--;
+    sep = parent->records[i].key;
+    lpn = *pin_entry(parent, i);
+    rpn = *pin_entry(parent, i + 1);
+    file_read_page(lpn, (page_t *)&l);
+    file_read_page(rpn, (page_t *)&r);
+
+    if (l.kcnt + r.kcnt <= cap * COMPACT_FILL / 100) {
+        // The merged leaf may take more; look at it again.
+        *next = key;
+        return 2 + merge_leaves(&path, key, lpn, &l, rpn, &r, sep);
+    }
+    if (scan)
+        *next = sep;
+    if (l.kcnt < cap * COMPACT_LOW / 100 || r.kcnt < cap * COMPACT_LOW / 100) {
+        k = even_leaves(ppn, parent, i, lpn, &l, rpn, &r);
+        if (scan)
+            *next = r.records[0].key;
+        return 2 + k;
+    }
+    return 2;
+}
+
+
+static double cmp_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Takes the leaves deletes left, or the next pair of a pass
+ * once the queue overflowed, one write operation each, as
+ * the budget allows.
+ */
+static void * compactor(void * arg) {
+    struct timespec ts;
+    double tokens = 0, t, last = cmp_now();
+    int64_t next;
+    int key;
+    bool scan;
+
+    (void)arg;
+    // Pairs the compactor reads are not the working set.
+    cache_scan = true;
+    pthread_mutex_lock(&cmp_lock);
+    while (!cmp_stop) {
+        t = cmp_now();
+        tokens += (t - last) * cmp_budget;
+        if (tokens > cmp_budget)
+            tokens = cmp_budget;
+        last = t;
+        if (cmp_rescan && cmp_cursor == COMPACT_END) {
+            cmp_rescan = false;
+            cmp_len = 0;
+            cmp_cursor = INT_MIN;
+        }
+        if (tokens > 0 && (cmp_len > 0 || cmp_cursor != COMPACT_END)) {
+            scan = cmp_len == 0;
+            if (scan)
+                key = (int)cmp_cursor;
+            else {
+                key = cmp_queue[cmp_head];
+                cmp_head = (cmp_head + 1) % COMPACT_QUEUE;
+                cmp_len--;
+            }
+            pthread_mutex_unlock(&cmp_lock);
+            pthread_rwlock_wrlock(&db_latch);
+            tokens -= compact_pair(key, scan, &next);
+            file_commit();
+            pthread_rwlock_unlock(&db_latch);
+            pthread_mutex_lock(&cmp_lock);
+            if (scan)
+                cmp_cursor = next;
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += COMPACT_TICK_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&cmp_cond, &cmp_lock, &ts);
+    }
+    pthread_mutex_unlock(&cmp_lock);
+    return NULL;
+}
+
+
+// Stops the compactor and forgets the leaves of the previous table.
+void compact_reset(void) {
+    if (cmp_running) {
+        pthread_mutex_lock(&cmp_lock);
+        cmp_stop = true;
+        pthread_cond_signal(&cmp_cond);
+        pthread_mutex_unlock(&cmp_lock);
+        pthread_join(cmp_thread, NULL);
+        cmp_running = false;
+    }
+    cmp_head = cmp_len = 0;
+    cmp_rescan = false;
+    cmp_cursor = COMPACT_END;
+}
+
+
+// Starts the compactor for the opened table if it has a budget.
+void compact_open(void) {
+    if (cmp_budget == 0 || cmp_running)
+        return;
+    cmp_stop = false;
+    if (pthread_create(&cmp_thread, NULL, compactor, NULL) != 0) {
+        perror("Compactor.");
+        exit(EXIT_FAILURE);
+    }
+    cmp_running = true;
+}
+
+
+/* Runs the compactor with a budget of pages_per_sec page
+ * reads and writes, or stops it when that is 0.
+ * Returns 0.
+ */
+int db_compact_start(uint32_t pages_per_sec) {
+    if (pages_per_sec == 0) {
+        compact_reset();
+        cmp_budget = 0;
+        return 0;
+    }
+    pthread_mutex_lock(&cmp_lock);
+    cmp_budget = pages_per_sec;
+    pthread_mutex_unlock(&cmp_lock);
+    compact_open();
+    return 0;
+}
+
+
+/* Goes over every sibling pair of the tree at once.
+ * Returns the number of leaves merged away.
+ */
+int64_t db_compact(void) {
+    int64_t key, next, merged = 0;
+
+    pthread_rwlock_wrlock(&db_latch);
+    cache_scan = true;
+    for (key = INT_MIN; key != COMPACT_END; key = next)
+        if (compact_pair((int)key, true, &next) > 0 && next == key)
+            merged++;
+    cache_scan = false;
+    file_commit();
+    pthread_rwlock_unlock(&db_latch);
+    return merged;
+}
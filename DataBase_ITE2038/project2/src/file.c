@@ -16,41 +16,225 @@
  *
  * =====================================================================================
  */
+#include <string.h>
+#include <unistd.h>
 #include "file.h"
+#include "stats.h"
+#include "hist.h"
+#include "trace.h"
+#include "ahi.h"
+#include "pin.h"
+#include "cache.h"
+#include "shadow.h"
+#include "wal.h"
+#include "ingest.h"
+#include "compact.h"
+
+// File of the opened table.
+FILE * fp_db;
+
+// Page size of the opened table.
+uint32_t page_size = DEFAULT_PAGE_SIZE;
+
+static void write_page(pagenum_t pagenum, const page_t* src);
+
+// Free pages have no frame, whatever their bytes look like.
+static void write_free_page(pagenum_t pagenum, const page_t* src) {
+    pin_drop(pagenum);
+    cache_drop(pagenum);
+    write_page(pagenum, src);
+}
+
+/* Page sizes supported are powers of two
+ * between MIN_PAGE_SIZE and MAX_PAGE_SIZE.
+ */
+bool file_valid_page_size(uint32_t psz) {
+    if (psz < MIN_PAGE_SIZE || psz > MAX_PAGE_SIZE)
+        return false;
+    return (psz & (psz - 1)) == 0;
+}
+
+/* Opens the data file at pathname.
+ * An existing table keeps the page size recorded in its header page,
+ * a new table is created with the page size psz.
+ * Returns 0 on success, -1 otherwise.
+ */
+int file_open_table(const char * pathname, uint32_t psz) {
+    HeaderPage hp;
+
+    // The previous table is checkpointed before fp_db moves on.
+    compact_reset();
+    ingest_reset();
+    wal_reset();
+    if ((fp_db = fopen(pathname, "r+")) != NULL) {
+        // Header fields sit at the start of page 0 whatever the page size is.
+        if (fread(&hp, sizeof(int) * 5, 1, fp_db) != 1) {
+            fclose(fp_db);
+            return -1;
+        }
+        page_size = hp.psz;
+        if (!file_valid_page_size(page_size)) {
+            fclose(fp_db);
+            return -1;
+        }
+        // Recovery may replay a new root into the header page.
+        wal_open(pathname, (hp.flags & HDR_LOGGED) != 0);
+        pread(fileno(fp_db), &hp, sizeof(int) * 5, 0);
+        shadow_reset();
+        if (hp.flags & HDR_SHADOW)
+            shadow_load();
+        pin_reset();
+        cache_reset();
+        pin_load(hp.rpn);
+        return 0;
+    }
+
+    if (!file_valid_page_size(psz))
+        return -1;
+    if ((fp_db = fopen(pathname, "w+")) == NULL)
+        return -1;
+
+    page_size = psz;
+    wal_open(pathname, false);
+    shadow_reset();
+    pin_reset();
+    cache_reset();
+    memset(&hp, 0, page_size);
+    hp.fpn = 0;
+    hp.rpn = 0;
+    hp.pcnt = 1;
+    hp.psz = psz;
+    file_write_page(0, (page_t *)&hp);
+    return 0;
+}
 
 pagenum_t file_alloc_page(void) {
     HeaderPage hp;
     FreePage fp;
     pagenum_t fpn;
-    file_read_page(0, &hp);
+    file_read_page(0, (page_t *)&hp);
+    stats_inc(STAT_PAGE_ALLOC);
     // When Free Page exist
     if (hp.fpn != 0) {
         fpn = hp.fpn;
-        file_read_page(fpn, &fp);
+        file_read_page(fpn, (page_t *)&fp);
         hp.fpn = fp.nfpn;
-        file_write_page(0, &hp);
+        file_write_page(0, (page_t *)&hp);
+        stats_inc(STAT_FREELIST_HIT);
     // When no Free Page left
     // Create new free page
     } else {
+        // Zeroed, so a read of the new page does not take it for a leaf.
+        memset(&fp, 0, page_size);
         fp.nfpn = 0;
         // Setting new free page number as number of pages
         fpn = hp.pcnt++;
-        hp.fpn = fpn;
-        file_write_page(fpn, &fp);
-        file_write_page(0, &hp);
+        write_free_page(fpn, (page_t *)&fp);
+        file_write_page(0, (page_t *)&hp);
+        stats_inc(STAT_FILE_EXTEND);
     }
     return fpn;
 }
 
-void file_free_page(pagenum_t pagenum);
+// Pushes the page on the free page list.
+void file_free_page(pagenum_t pagenum) {
+    HeaderPage hp;
+    FreePage fp;
+    file_read_page(0, (page_t *)&hp);
+    // Clears is_leaf too, so a read of the free page does not cache it.
+    memset(&fp, 0, page_size);
+    fp.nfpn = hp.fpn;
+    hp.fpn = pagenum;
+    write_free_page(pagenum, (page_t *)&fp);
+    file_write_page(0, (page_t *)&hp);
+    stats_inc(STAT_PAGE_FREE);
+}
 
+// Only the first page_size bytes of a page_t are transferred.
+// Positioned I/O, so threads sharing fp_db do not race on its offset.
 void file_read_page(pagenum_t pagenum, page_t* dest) {
-    fseek(fp_db, pagenum * sizeof(page_t), SEEK_SET);
-    fread(dest, sizeof(page_t), 1, fp_db);
+    uint64_t t0 = hist_enabled || trace_active ? hist_now() : 0, t1;
+    pin_frame * f = NULL;
+
+    // The header of a shadow paged table is written at commit.
+    if (pagenum == 0 && shadow_on) {
+        shadow_read_header(dest);
+        stats_inc(STAT_CACHE_HIT);
+        return;
+    }
+    /* Internal pages are served by their resident frames, leaves by
+     * the cache, and pages not checkpointed yet by the log.
+     */
+    if ((pagenum != 0 && ((f = pin_lookup(pagenum)) != NULL || cache_read(pagenum, dest)))
+            || (wal_on && wal_read(pagenum, dest))) {
+        if (f != NULL)
+            pin_copy(f, dest);
+        if (trace_active)
+            trace_page(TRACE_PAGE_READ, pagenum, TRACE_CACHE, t0, hist_now());
+        stats_inc(STAT_CACHE_HIT);
+        return;
+    }
+    pread(fileno(fp_db), dest, page_size,
+            (off_t)((shadow_on ? shadow_locate(pagenum) : pagenum) * page_size));
+    if (pagenum != 0 && ((LeafPage *)dest)->is_leaf)
+        cache_install(pagenum, dest);
+    if (t0 != 0) {
+        t1 = hist_now();
+        if (hist_enabled)
+            hist_record(HIST_IO_WAIT, t1 - t0);
+        trace_page(TRACE_PAGE_READ, pagenum, TRACE_DISK, t0, t1);
+    }
+    // A read reaching the file missed any cache above it.
+    stats_inc(STAT_PAGE_READ);
+    stats_inc(STAT_CACHE_MISS);
 }
 
+static void write_page(pagenum_t pagenum, const page_t* src) {
+    uint64_t t0, t1;
+
+    if (pagenum == 0 && shadow_on) {
+        shadow_write_header(src);
+        return;
+    }
+    // The checkpointer writes logged pages back.
+    if (wal_on) {
+        wal_write(pagenum, src);
+        ahi_page_written(pagenum);
+        return;
+    }
+    t0 = hist_enabled || trace_active ? hist_now() : 0;
+    pwrite(fileno(fp_db), src, page_size,
+            (off_t)((shadow_on ? shadow_place(pagenum) : pagenum) * page_size));
+    ahi_page_written(pagenum);
+    if (t0 != 0) {
+        t1 = hist_now();
+        if (hist_enabled)
+            hist_record(HIST_IO_WAIT, t1 - t0);
+        trace_page(TRACE_PAGE_WRITE, pagenum, TRACE_DISK, t0, t1);
+    }
+    stats_inc(STAT_PAGE_WRITE);
+}
+
+// Writes a tree or header page, keeping the resident and cached frames current.
 void file_write_page(pagenum_t pagenum, const page_t* src) {
-    fseek(fp_db, pagenum * sizeof(page_t), SEEK_SET);
-    fwrite(src, sizeof(page_t), 1, fp_db);
-    fflush(fp_db);
+    write_page(pagenum, src);
+    if (pagenum == 0)
+        pin_rpn = ((const HeaderPage *)src)->rpn;
+    else if (((const LeafPage *)src)->is_leaf) {
+        pin_drop(pagenum);
+        cache_update(pagenum, src);
+    } else {
+        cache_drop(pagenum);
+        pin_update(pagenum, src);
+    }
+}
+
+/* Ends a write operation, committing it on a shadow paged
+ * or logged table.  The caller holds db_latch.
+ */
+void file_commit(void) {
+    if (shadow_on)
+        shadow_commit();
+    else if (wal_on)
+        wal_commit();
 }
@@ -0,0 +1,190 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  hist.c
+ *
+ *    Description:  Lock-free log-linear latency histograms
+ *                  per API call and per internal phase,
+ *                  with snapshot, reset and text/JSON dumps.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <string.h>
+#include "hist.h"
+
+bool hist_enabled = true;
+
+static histogram hists[HIST_COUNT];
+
+static const char * hist_names[HIST_COUNT] = {
+    "find", "insert", "delete", "scan", "update",
+    "descent", "leaf_modify", "split", "io_wait"
+};
+
+// Percentiles printed by db_hist_print.
+static const double hist_pcts[] = { 50, 90, 99, 99.9, 99.99 };
+#define HIST_PCT_CNT (int)(sizeof(hist_pcts) / sizeof(hist_pcts[0]))
+
+
+/* Values below HIST_SUB_BUCKETS get a bucket each.
+ * Above, the top HIST_SUB_BITS + 1 bits select the bucket.
+ */
+static int hist_index(uint64_t v) {
+    int e;
+    if (v < HIST_SUB_BUCKETS)
+        return (int)v;
+    e = 63 - __builtin_clzll(v);
+    if (e > HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS
+        + (int)((v >> (e - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+
+// Highest value a bucket stands for.
+static uint64_t hist_value(int idx) {
+    int e, sub;
+    if (idx < HIST_SUB_BUCKETS)
+        return idx;
+    e = idx / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    sub = idx % HIST_SUB_BUCKETS;
+    return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+
+void hist_record(enum hist_id id, uint64_t ns) {
+    histogram * h = &hists[id];
+    uint64_t max;
+
+    __atomic_fetch_add(&h->buckets[hist_index(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum, ns, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns,
+                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+
+void db_hist_enable(bool on) {
+    hist_enabled = on;
+}
+
+
+/* Copies histogram id into out.  With reset, the copied
+ * counts are taken out of the histogram by atomic exchange,
+ * so values recorded meanwhile land in either the copy or
+ * the next interval, never in both or neither.
+ * count is recomputed from the buckets for the same reason.
+ */
+void db_hist_snapshot(enum hist_id id, histogram * out, bool reset) {
+    histogram * h = &hists[id];
+    int i;
+
+    out->count = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if (reset)
+            out->buckets[i] = __atomic_exchange_n(&h->buckets[i], 0, __ATOMIC_RELAXED);
+        else
+            out->buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        out->count += out->buckets[i];
+    }
+    if (reset) {
+        out->sum = __atomic_exchange_n(&h->sum, 0, __ATOMIC_RELAXED);
+        out->max = __atomic_exchange_n(&h->max, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&h->count, out->count, __ATOMIC_RELAXED);
+    } else {
+        out->sum = __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+        out->max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    }
+}
+
+
+void db_hist_reset(void) {
+    histogram * tmp = malloc(sizeof(histogram));
+    int i;
+    if (tmp == NULL) {
+        perror("Histogram snapshot.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < HIST_COUNT; i++)
+        db_hist_snapshot(i, tmp, true);
+    free(tmp);
+}
+
+
+/* Returns the value under which p percent
+ * of the recorded values fall.
+ */
+uint64_t db_hist_percentile(const histogram * h, double p) {
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+    rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+    if (rank < 1) rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+
+const char * db_hist_name(enum hist_id id) {
+    return id < HIST_COUNT ? hist_names[id] : "unknown";
+}
+
+
+/* Dumps every non-empty histogram, in ns,
+ * as aligned text or as one JSON object.
+ */
+void db_hist_print(FILE * out, bool json) {
+    histogram * h = malloc(sizeof(histogram));
+    bool first = true;
+    int i, j;
+
+    if (h == NULL) {
+        perror("Histogram snapshot.");
+        exit(EXIT_FAILURE);
+    }
+    if (json)
+        fprintf(out, "{");
+    for (i = 0; i < HIST_COUNT; i++) {
+        db_hist_snapshot(i, h, false);
+        if (h->count == 0)
+            continue;
+        if (json) {
+            fprintf(out, "%s\"%s\": {\"count\": %llu, \"mean\": %.1f, \"max\": %llu",
+                    first ? "" : ", ", hist_names[i],
+                    (unsigned long long)h->count, h->sum / (double)h->count,
+                    (unsigned long long)h->max);
+            for (j = 0; j < HIST_PCT_CNT; j++)
+                fprintf(out, ", \"p%g\": %llu", hist_pcts[j],
+                        (unsigned long long)db_hist_percentile(h, hist_pcts[j]));
+            fprintf(out, "}");
+        } else {
+            fprintf(out, "%-12s count=%llu mean=%.0f", hist_names[i],
+                    (unsigned long long)h->count, h->sum / (double)h->count);
+            for (j = 0; j < HIST_PCT_CNT; j++)
+                fprintf(out, " p%g=%llu", hist_pcts[j],
+                        (unsigned long long)db_hist_percentile(h, hist_pcts[j]));
+            fprintf(out, " max=%llu\n", (unsigned long long)h->max);
+        }
+        first = false;
+    }
+    if (json)
+        fprintf(out, "}\n");
+    else if (first)
+        fprintf(out, "No latencies recorded.\n");
+    free(h);
+}
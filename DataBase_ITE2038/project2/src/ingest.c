@@ -0,0 +1,436 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  ingest.c
+ *
+ *    Description:  Ingest tier: logged writes kept in a skiplist
+ *                  and merged into the tree in key order by a
+ *                  background thread.
+ *
+ *                  ing_lock guards the writable skiplist and the
+ *                  frozen pointer.  The frozen skiplist does not
+ *                  change; it is merged and freed under the
+ *                  exclusive db_latch only, so readers holding
+ *                  db_latch may walk it without ing_lock.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "ingest.h"
+#include "bpt.h"
+#include "wal.h"
+#include "ost.h"
+#include "stats.h"
+
+#define SL_MAX_LEVEL 20
+
+typedef struct sl_node {
+    buf_msg m;
+    struct sl_node * next[];
+} sl_node;
+
+typedef struct sl_table {
+    sl_node * head;
+    int level;
+    int64_t cnt;
+    uint64_t first_lsn;         // log record of the first entry
+} sl_table;
+
+bool ingest_on = false;
+
+static pthread_mutex_t ing_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ing_cond = PTHREAD_COND_INITIALIZER;     // wakes the merge thread
+static pthread_cond_t room_cond = PTHREAD_COND_INITIALIZER;    // wakes waiting writers
+static pthread_t merge_thread;
+static bool merge_running = false;
+static bool merge_stop = false;
+
+static sl_table * active = NULL;
+static sl_table * frozen = NULL;
+static sl_node * frozen_pos = NULL;    // next entry of frozen to merge
+static uint32_t sl_seed = 2463534242u;
+
+
+static sl_node * sl_node_new(int level) {
+    sl_node * x = calloc(1, sizeof(sl_node) + level * sizeof(sl_node *));
+    if (x == NULL) {
+        perror("Ingest tier.");
+        exit(EXIT_FAILURE);
+    }
+    return x;
+}
+
+
+static sl_table * sl_new(void) {
+    sl_table * t = malloc(sizeof(sl_table));
+    if (t == NULL) {
+        perror("Ingest tier.");
+        exit(EXIT_FAILURE);
+    }
+    t->head = sl_node_new(SL_MAX_LEVEL);
+    t->level = 1;
+    t->cnt = 0;
+    t->first_lsn = UINT64_MAX;
+    return t;
+}
+
+
+static void sl_free(sl_table * t) {
+    sl_node * x, * next;
+
+    if (t == NULL)
+        return;
+    for (x = t->head; x != NULL; x = next) {
+        next = x->next[0];
+        free(x);
+    }
+    free(t);
+}
+
+
+// A level with a 1/4 chance for each one above the first.
+static int sl_level(void) {
+    uint32_t r;
+    int level = 1;
+
+    sl_seed ^= sl_seed << 13;
+    sl_seed ^= sl_seed >> 17;
+    sl_seed ^= sl_seed << 5;
+    for (r = sl_seed; (r & 3) == 0 && level < SL_MAX_LEVEL; r >>= 2)
+        level++;
+    return level;
+}
+
+
+// The entry of key in t, or NULL.
+static const buf_msg * sl_find(const sl_table * t, int key) {
+    const sl_node * x = t->head;
+    int l;
+
+    for (l = t->level - 1; l >= 0; l--)
+        while (x->next[l] != NULL && x->next[l]->m.key < key)
+            x = x->next[l];
+    x = x->next[0];
+    return x != NULL && x->m.key == key ? &x->m : NULL;
+}
+
+
+// Adds m to t, folding it into the entry of its key if there is one.
+static void sl_put(sl_table * t, const buf_msg * m) {
+    sl_node * update[SL_MAX_LEVEL], * x = t->head;
+    int l, level;
+
+    for (l = t->level - 1; l >= 0; l--) {
+        while (x->next[l] != NULL && x->next[l]->m.key < m->key)
+            x = x->next[l];
+        update[l] = x;
+    }
+    if ((x = x->next[0]) != NULL && x->m.key == m->key) {
+        buf_fold(&x->m, m);
+        return;
+    }
+    level = sl_level();
+    for (l = t->level; l < level; l++)
+        update[l] = t->head;
+    if (level > t->level)
+        t->level = level;
+    x = sl_node_new(level);
+    x->m = *m;
+    for (l = 0; l < level; l++) {
+        x->next[l] = update[l]->next[l];
+        update[l]->next[l] = x;
+    }
+    t->cnt++;
+}
+
+
+/* Freezes the writable skiplist for the merge.  The caller
+ * holds ing_lock, and no skiplist is frozen.
+ */
+static void freeze(void) {
+    frozen = active;
+    frozen_pos = frozen->head->next[0];
+    active = sl_new();
+    pthread_cond_broadcast(&room_cond);
+}
+
+
+/* Merges up to max entries of the frozen skiplist into the
+ * tree and commits them.  The skiplist is dropped once it is
+ * through, and the log is kept from the oldest entry left.
+ * Returns the number of entries merged.  The caller holds
+ * db_latch exclusively.
+ */
+static int merge_batch(int max) {
+    sl_table * t;
+    buf_msg * m;
+    int i, n = 0;
+
+    pthread_mutex_lock(&ing_lock);
+    t = frozen;
+    pthread_mutex_unlock(&ing_lock);
+    if (t == NULL)
+        return 0;
+    if ((m = malloc(max * sizeof(buf_msg))) == NULL) {
+        perror("Ingest merge.");
+        exit(EXIT_FAILURE);
+    }
+    for (; frozen_pos != NULL && n < max; frozen_pos = frozen_pos->next[0])
+        m[n++] = frozen_pos->m;
+    // A buffered root takes the entries as messages newer than its own.
+    if (tree_buffered && tree_height > 0)
+        for (i = 0; i < n; i++)
+            buf_put(m[i].key, m[i].op, m[i].value);
+    else
+        buf_apply(m, n);
+    free(m);
+    stats_add(STAT_INGEST_MERGE, n);
+    // The log may only move past the entries once the tree has them.
+    file_commit();
+
+    if (frozen_pos == NULL) {
+        pthread_mutex_lock(&ing_lock);
+        frozen = NULL;
+        wal_hold(active->first_lsn);
+        pthread_cond_broadcast(&room_cond);
+        pthread_mutex_unlock(&ing_lock);
+        sl_free(t);
+    }
+    return n;
+}
+
+
+/* Freezes the skiplist when it is big enough, or when it has
+ * not grown since the last tick, and merges it a batch at a
+ * time, taking db_latch for each.
+ */
+static void * ingest_merger(void * arg) {
+    struct timespec ts;
+    int64_t last = 0;
+
+    (void)arg;
+    pthread_mutex_lock(&ing_lock);
+    while (!merge_stop) {
+        if (frozen == NULL && (active->cnt >= INGEST_MERGE_AT
+                    || (active->cnt > 0 && active->cnt == last)))
+            freeze();
+        last = active->cnt;
+        if (frozen != NULL) {
+            pthread_mutex_unlock(&ing_lock);
+            pthread_rwlock_wrlock(&db_latch);
+            merge_batch(INGEST_BATCH);
+            pthread_rwlock_unlock(&db_latch);
+            pthread_mutex_lock(&ing_lock);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += INGEST_TICK_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&ing_cond, &ing_lock, &ts);
+    }
+    pthread_mutex_unlock(&ing_lock);
+    return NULL;
+}
+
+
+/* Stops the merge thread and drops the skiplists of the
+ * previous table; the log still holds their entries.  Called
+ * before another table is opened.
+ */
+void ingest_reset(void) {
+    if (merge_running) {
+        pthread_mutex_lock(&ing_lock);
+        merge_stop = true;
+        pthread_cond_signal(&ing_cond);
+        pthread_mutex_unlock(&ing_lock);
+        pthread_join(merge_thread, NULL);
+        merge_running = false;
+    }
+    sl_free(active);
+    sl_free(frozen);
+    active = frozen = NULL;
+    frozen_pos = NULL;
+    ingest_on = false;
+}
+
+
+/* Starts the merge thread if the opened table has the ingest
+ * tier, on; entries recovery put back are merged first.
+ */
+void ingest_open(bool on) {
+    if (active == NULL)
+        active = sl_new();
+    if (!on) {
+        sl_free(active);
+        active = NULL;
+        return;
+    }
+    ingest_on = true;
+    merge_stop = false;
+    if (pthread_create(&merge_thread, NULL, ingest_merger, NULL) != 0) {
+        perror("Ingest merger.");
+        exit(EXIT_FAILURE);
+    }
+    merge_running = true;
+}
+
+
+/* Puts back an entry recovery found committed in the log
+ * at or after lsn.
+ */
+void ingest_replay(const buf_msg * m, uint64_t lsn) {
+    if (active == NULL)
+        active = sl_new();
+    if (active->cnt == 0)
+        active->first_lsn = lsn;
+    sl_put(active, m);
+}
+
+
+/* Waits while the writable skiplist is full.  Called before
+ * a write takes db_latch, which the merge thread needs.
+ */
+void ingest_wait(void) {
+    pthread_mutex_lock(&ing_lock);
+    while (ingest_on && active->cnt >= INGEST_MAX_ENTRIES) {
+        pthread_cond_signal(&ing_cond);
+        pthread_cond_wait(&room_cond, &ing_lock);
+    }
+    pthread_mutex_unlock(&ing_lock);
+}
+
+
+/* Logs a message for key and adds it to the writable skiplist.
+ * value is ignored by deletes.  The caller holds db_latch,
+ * shared or not, and commits.
+ */
+void ingest_put(int key, int op, const char * value) {
+    buf_msg m;
+    uint64_t lsn;
+
+    memset(&m, 0, sizeof(m));
+    m.key = key;
+    m.op = op;
+    if (value != NULL)
+        strcpy(m.value, value);
+    // Log order and skiplist order agree, so a frozen skiplist holds the older entries.
+    pthread_mutex_lock(&ing_lock);
+    lsn = wal_log(&m, sizeof(m));
+    if (active->cnt == 0)
+        active->first_lsn = lsn;
+    sl_put(active, &m);
+    if (active->cnt >= INGEST_MERGE_AT && frozen == NULL)
+        pthread_cond_signal(&ing_cond);
+    pthread_mutex_unlock(&ing_lock);
+}
+
+
+/* Looks key up in the skiplists, newest first, then the tree.
+ * Copies its value to value and returns 0, or returns -1.
+ * Runs under db_latch, shared or not.
+ */
+int ingest_find(int key, char * value) {
+    const buf_msg * m, * ins = NULL;
+    buf_msg found;
+    sl_table * t;
+
+    pthread_mutex_lock(&ing_lock);
+    m = sl_find(active, key);
+    if (m != NULL)
+        found = *m;
+    t = frozen;
+    pthread_mutex_unlock(&ing_lock);
+    if (m != NULL) {
+        if (found.op == MSG_DELETE)
+            return -1;
+        if (found.op == MSG_UPSERT) {
+            strcpy(value, found.value);
+            return 0;
+        }
+        ins = &found;
+    }
+    // An insert is older the lower it is, so the lowest one takes.
+    if (t != NULL && (m = sl_find(t, key)) != NULL) {
+        if (m->op == MSG_DELETE)
+            goto absent;
+        if (m->op == MSG_INSERT)
+            ins = m;
+        else {
+            strcpy(value, m->value);
+            return 0;
+        }
+    }
+    if (find_record(key, value) == 0)
+        return 0;
+absent:
+    if (ins == NULL)
+        return -1;
+    strcpy(value, ins->value);
+    return 0;
+}
+
+
+/* Merges every entry into the tree, the frozen skiplist first.
+ * The caller holds db_latch exclusively.
+ * Returns the number of entries merged.
+ */
+int64_t ingest_drain(void) {
+    int64_t moved = 0;
+    bool left;
+
+    for (;;) {
+        pthread_mutex_lock(&ing_lock);
+        if (frozen == NULL && active->cnt > 0)
+            freeze();
+        left = frozen != NULL;
+        pthread_mutex_unlock(&ing_lock);
+        if (!left)
+            return moved;
+        moved += merge_batch(INGEST_BATCH);
+    }
+}
+
+
+/* Turns the ingest tier on for the opened table.
+ * Returns 0, or -1 if the table is not logged or
+ * keeps subtree counts.
+ */
+int db_enable_ingest(void) {
+    HeaderPage hp;
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&db_latch);
+    if (!ingest_on && (!wal_on || tree_counted))
+        ret = -1;
+    else if (!ingest_on) {
+        file_read_page(0, (page_t *)&hp);
+        hp.flags |= HDR_INGEST;
+        file_write_page(0, (page_t *)&hp);
+        file_commit();
+        ingest_open(true);
+    }
+    pthread_rwlock_unlock(&db_latch);
+    return ret;
+}
+
+
+/* Merges every entry of the ingest tier into the tree.
+ * Returns 0.
+ */
+int db_flush_ingest(void) {
+    pthread_rwlock_wrlock(&db_latch);
+    if (ingest_on)
+        ingest_drain();
+    pthread_rwlock_unlock(&db_latch);
+    return 0;
+}
@@ -1,78 +1,187 @@
 #include "bpt.h"
 //#include "../include/bpt.h"
 #include "file.h"
+#include "stats.h"
+#include "hist.h"
+#include "trace.h"
+#include "batch.h"
+#include "server.h"
+#include "bulk.h"
+#include "scan.h"
+#include "ost.h"
+#include "ahi.h"
+#include "shadow.h"
+#include "wal.h"
+#include "buf.h"
+#include "ingest.h"
+#include "compact.h"
 
 // Get global variable of file pointer of datafile.
 extern FILE * fp_db;
 
+static int export_record(int key, const char * value, void * arg) {
+    fprintf((FILE *)arg, "%d %s\n", key, value);
+    return 0;
+}
+
 // MAIN
 
 int main( int argc, char ** argv ) {
 
-    char * input_file;
     FILE * fp;
     node * root;
-    int input, range2;
+    int input, range2, ret;
     char instruction;
-    char license_part;
     char input_val[120];
+    db_stats st;
+    db_agg agg;
+    db_snapshot * snap = NULL;
+    uint32_t psz = DEFAULT_PAGE_SIZE;
 
     root = NULL;
     verbose_output = false;
 
-    if (argc > 1) {
-        order = atoi(argv[1]);
-        if (order < MIN_ORDER || order > MAX_ORDER) {
-            fprintf(stderr, "Invalid order: %d .\n\n", order);
+    /* Headless batch mode:
+     * bpt -b|-B <page_size> <tablefile> [<commandfile>]
+     * reads text (-b) or binary (-B) commands from the file or stdin.
+     */
+    if (argc > 1 && (strcmp(argv[1], "-b") == 0 || strcmp(argv[1], "-B") == 0)) {
+        if (argc < 4 || !file_valid_page_size((uint32_t)atoi(argv[2]))) {
             usage_3();
             exit(EXIT_FAILURE);
         }
+        if (open_table_with_page_size(argv[3], (uint32_t)atoi(argv[2])) == -1) {
+            fprintf(stderr, "Cannot load file %s \n\n", argv[3]);
+            exit(EXIT_FAILURE);
+        }
+        fp = stdin;
+        if (argc > 4 && strcmp(argv[4], "-") != 0 && (fp = fopen(argv[4], "rb")) == NULL) {
+            perror("Failure  open command file.");
+            exit(EXIT_FAILURE);
+        }
+        if (run_batch(fp, argv[1][1] == 'B') != 0)
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
     }
 
-    license_notice();
-    usage_1();  
-    usage_2();
+    /* Bulk build mode:
+     * bpt -L <page_size> <tablefile> <sortedfile> [<threads>]
+     * builds an empty table from "key value" lines sorted by key.
+     */
+    if (argc > 1 && strcmp(argv[1], "-L") == 0) {
+        int n = 0, cap = 1 << 16;
+        int * keys = malloc(cap * sizeof(int));
+        char (* values)[120] = malloc(cap * sizeof(*values));
 
-    if (argc > 2) {
-        if (open_table(argv[2]) == -1) {
-            fprintf(stderr, "Cannot load file %s \n\n", argv[2]);
+        if (argc < 5 || !file_valid_page_size((uint32_t)atoi(argv[2]))) {
+            usage_3();
             exit(EXIT_FAILURE);
         }
-        while (!feof(fp)) {
-            fscanf(fp, "%d %s\n", &input, input_val);
-            if(db_insert(input, input_val) != 0) {
-                fprintf(stderr, "Cannot write file %s \n\n", argv[2]);
-                exit(EXIT_FAILURE);
+        if ((fp = fopen(argv[4], "r")) == NULL) {
+            perror("Failure  open input file.");
+            exit(EXIT_FAILURE);
+        }
+        while (keys != NULL && values != NULL
+                && fscanf(fp, "%d %119s", &keys[n], values[n]) == 2) {
+            if (++n == cap) {
+                cap *= 2;
+                keys = realloc(keys, cap * sizeof(int));
+                values = realloc(values, cap * sizeof(*values));
             }
         }
         fclose(fp);
-        print_tree(root);
+        if (keys == NULL || values == NULL) {
+            perror("Bulk input.");
+            exit(EXIT_FAILURE);
+        }
+        if (open_table_with_page_size(argv[3], (uint32_t)atoi(argv[2])) == -1) {
+            fprintf(stderr, "Cannot load file %s \n\n", argv[3]);
+            exit(EXIT_FAILURE);
+        }
+        if (db_bulk_load(n, keys, values, argc > 5 ? atoi(argv[5]) : 1,
+                    BULK_DEFAULT_FILL) != 0) {
+            fprintf(stderr, "Cannot bulk load %s: table not empty or input "
+                    "not sorted \n\n", argv[4]);
+            exit(EXIT_FAILURE);
+        }
+        free(keys);
+        free(values);
+        return EXIT_SUCCESS;
     }
 
-    /*  
-    if (argc > 2) {
-        input_file = argv[2];
-        fp = fopen(input_file, "r");
-        if (fp == NULL) {
-            perror("Failure  open input file.");
+    /* Export mode:
+     * bpt -E <page_size> <tablefile> [<threads>]
+     * prints every record as a "key value" line, in key order.
+     */
+    if (argc > 1 && strcmp(argv[1], "-E") == 0) {
+        if (argc < 4 || !file_valid_page_size((uint32_t)atoi(argv[2]))) {
+            usage_3();
             exit(EXIT_FAILURE);
         }
-        while (!feof(fp)) {
-            fscanf(fp, "%d\n", &input);
-            root = insert(root, input, input);
+        if (open_table_with_page_size(argv[3], (uint32_t)atoi(argv[2])) == -1) {
+            fprintf(stderr, "Cannot load file %s \n\n", argv[3]);
+            exit(EXIT_FAILURE);
         }
-        fclose(fp);
-        print_tree(root);
+        db_scan_parallel(INT32_MIN, INT32_MAX, argc > 4 ? atoi(argv[4]) : 1,
+                true, export_record, stdout);
+        return EXIT_SUCCESS;
+    }
+
+    /* Server mode:
+     * bpt -S <page_size> <tablefile> <socketpath> [<tcp_port> [<workers>]]
+     */
+    if (argc > 1 && strcmp(argv[1], "-S") == 0) {
+        if (argc < 5 || !file_valid_page_size((uint32_t)atoi(argv[2]))) {
+            usage_3();
+            exit(EXIT_FAILURE);
+        }
+        if (open_table_with_page_size(argv[3], (uint32_t)atoi(argv[2])) == -1) {
+            fprintf(stderr, "Cannot load file %s \n\n", argv[3]);
+            exit(EXIT_FAILURE);
+        }
+        if (server_run(argv[4], argc > 5 ? atoi(argv[5]) : 0,
+                    argc > 6 ? atoi(argv[6]) : SRV_DEFAULT_WORKERS) != 0)
+            return EXIT_FAILURE;
+        return EXIT_SUCCESS;
+    }
+
+    // Page size only matters when the table is created.
+    if (argc > 1) {
+        psz = (uint32_t)atoi(argv[1]);
+        if (!file_valid_page_size(psz)) {
+            fprintf(stderr, "Invalid page size: %u .\n\n", psz);
+            usage_3();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    license_notice();
+    usage_1();  
+    usage_2();
+
+    if (argc > 2 && open_table_with_page_size(argv[2], psz) == -1) {
+        fprintf(stderr, "Cannot load file %s \n\n", argv[2]);
+        exit(EXIT_FAILURE);
     }
-    */
+    if (fp_db == NULL)
+        printf("No table is open: only q is accepted.\n");
 
     printf("> ");
     while (scanf("%c", &instruction) != EOF) {
+        if (fp_db == NULL && instruction != 'q') {
+            if (instruction != '\n') {
+                printf("No table is open.  Start again with  "
+                        "bpt <page_size> <tablefile> .\n");
+                while (getchar() != (int)'\n');
+            }
+            printf("> ");
+            continue;
+        }
         switch (instruction) {
         case 'd':
             scanf("%d", &input);
-            root = delete(root, input);
-            print_tree(root);
+            if (db_delete(input) != 0)
+                printf("Record not found under key %d.\n", input);
             break;
         case 'i':
             scanf("%d %s", &input, input_val);
@@ -80,12 +189,21 @@ int main( int argc, char ** argv ) {
                 fprintf(stderr, "Cannot write input %d %s \n\n", input, input_val);
                 exit(EXIT_FAILURE);
             }
-            print_tree(root);
+            break;
+        case 'u':
+            scanf("%d %s", &input, input_val);
+            ret = db_upsert(input, input_val);
+            if (ret == DB_UPDATED)
+                printf("Updated key %d.\n", input);
+            else if (ret == DB_BUFFERED)
+                printf("Buffered key %d.\n", input);
+            else
+                printf("Inserted key %d.\n", input);
             break;
         case 'f':
         case 'p':
             scanf("%d", &input);
-            find_and_print(root, input, instruction == 'p');
+            find_and_print(input, instruction == 'p');
             break;
         case 'r':
             scanf("%d %d", &input, &range2);
@@ -94,7 +212,80 @@ int main( int argc, char ** argv ) {
                 range2 = input;
                 input = tmp;
             }
-            find_and_print_range(root, input, range2, instruction == 'p');
+            find_and_print_range(input, range2, instruction == 'p');
+            break;
+        case 'a':
+            scanf("%d %d", &input, &range2);
+            db_aggregate_range(input, range2, SCAN_DEFAULT_THREADS, true, &agg);
+            db_agg_print(stdout, &agg);
+            break;
+        case 'c':
+            scanf("%d %d", &input, &range2);
+            printf("%lld\n", (long long)db_count_range(input, range2));
+            break;
+        case 'k':
+            scanf("%d", &input);
+            printf("%lld\n", (long long)db_rank(input));
+            break;
+        case 'K':
+            scanf("%d", &input);
+            if (db_select(input, &range2, input_val) != 0)
+                printf("None found.\n");
+            else
+                printf("Key: %d   Value: %s\n", range2, input_val);
+            break;
+        case 'C':
+            if (db_enable_counts() != 0)
+                printf("The table is buffered.\n");
+            break;
+        case 'A':
+            scanf("%d", &input);
+            db_ahi_enable(input != 0);
+            break;
+        case 'W':
+            if (db_enable_shadow() != 0)
+                printf("The table is logged.\n");
+            break;
+        case 'w':
+            if (db_enable_wal() != 0)
+                printf("The table is shadow paged.\n");
+            break;
+        case 'P':
+            if (db_checkpoint() != 0)
+                printf("The table is not logged.\n");
+            break;
+        case 'b':
+            if (db_enable_buffers() != 0)
+                printf("The table has internal pages or counts.\n");
+            break;
+        case 'F':
+            db_flush_buffers();
+            break;
+        case 'e':
+            if (db_enable_ingest() != 0)
+                printf("The table is not logged, or keeps counts.\n");
+            break;
+        case 'E':
+            db_flush_ingest();
+            break;
+        case 'M':
+            scanf("%d", &input);
+            db_compact_start(input < 0 ? 0 : input);
+            break;
+        case 'm':
+            printf("%lld leaves merged away.\n", (long long)db_compact());
+            break;
+        case 'n':
+            db_snapshot_close(snap);
+            if ((snap = db_snapshot_open()) == NULL)
+                printf("Not shadow paged.\n");
+            break;
+        case 'N':
+            scanf("%d", &input);
+            if (snap == NULL || db_snapshot_find(snap, input, input_val) != 0)
+                printf("Record not found under key %d.\n", input);
+            else
+                printf("Record -- key %d, value %s.\n", input, input_val);
             break;
         case 'l':
             print_leaves(root);
@@ -103,6 +294,21 @@ int main( int argc, char ** argv ) {
             while (getchar() != (int)'\n');
             return EXIT_SUCCESS;
             break;
+        case 's':
+            db_stats_snapshot(&st);
+            db_stats_print(stdout, &st);
+            break;
+        case 'h':
+        case 'H':
+            db_hist_print(stdout, instruction == 'H');
+            break;
+        case 'g':
+            scanf("%d", &input);
+            db_trace_enable(input > 0 ? (uint32_t)input : 0);
+            break;
+        case 'G':
+            db_trace_dump(stdout);
+            break;
         case 't':
             print_tree(root);
             break;
@@ -0,0 +1,216 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  ost.c
+ *
+ *    Description:  Order-statistic augmentation: subtree record counts
+ *                  in internal entries, kept up to date by the insert
+ *                  path, and count_range / rank / select over them.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <limits.h>
+#include <string.h>
+#include "ost.h"
+#include "bpt.h"
+#include "scan.h"
+#include "buf.h"
+#include "ingest.h"
+
+bool tree_counted = false;
+
+
+// Records under a page already in memory.
+uint32_t ost_page_count(page_t * page) {
+    InternalPage * ip = (InternalPage *)page;
+    uint32_t * cnt = INTL_COUNTS(ip);
+    uint32_t sum = 0;
+    int i;
+
+    if (ip->is_leaf)
+        return ((LeafPage *)page)->kcnt;
+    for (i = 0; i <= ip->kcnt; i++)
+        sum += cnt[i];
+    return sum;
+}
+
+
+uint32_t ost_subtree_count(pagenum_t pn) {
+    page_t page;
+    file_read_page(pn, &page);
+    return ost_page_count(&page);
+}
+
+
+/* Recomputes the counts on path d from pn, the page at
+ * its end, up to the root, after the records under pn changed.
+ */
+void ost_fix_path(const descent * d, pagenum_t pn) {
+    page_t page;
+    uint32_t cnt;
+    int h;
+
+    cnt = ost_subtree_count(pn);
+    for (h = d->depth - 1; h >= 0; h--) {
+        file_read_page(d->pn[h], &page);
+        INTL_COUNTS((InternalPage *)&page)[d->idx[h]] = cnt;
+        file_write_page(d->pn[h], &page);
+        cnt = ost_page_count(&page);
+    }
+}
+
+
+// Fills in the counts of every internal page under pn.
+static uint32_t ost_build(pagenum_t pn) {
+    page_t page;
+    InternalPage * ip = (InternalPage *)&page;
+    uint32_t * cnt = INTL_COUNTS(ip);
+    int i;
+
+    file_read_page(pn, &page);
+    if (ip->is_leaf)
+        return ((LeafPage *)&page)->kcnt;
+    for (i = 0; i <= ip->kcnt; i++)
+        cnt[i] = ost_build(i == 0 ? ip->lspn : ip->records[i - 1].pn);
+    file_write_page(pn, &page);
+    return ost_page_count(&page);
+}
+
+
+/* Turns subtree counts on for the opened table,
+ * counting the existing tree once.  Returns 0, or -1
+ * if the table is buffered or has the ingest tier.
+ */
+int db_enable_counts(void) {
+    HeaderPage hp;
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&db_latch);
+    if (tree_buffered || ingest_on)
+        ret = -1;
+    else if (!tree_counted) {
+        file_read_page(0, (page_t *)&hp);
+        if (hp.rpn != 0)
+            ost_build(hp.rpn);
+        hp.flags |= HDR_COUNTED;
+        file_write_page(0, (page_t *)&hp);
+        tree_counted = true;
+        file_commit();
+    }
+    pthread_rwlock_unlock(&db_latch);
+    return ret;
+}
+
+
+// Number of keys below key, in one descent.
+static int64_t rank_below(int64_t key) {
+    HeaderPage hp;
+    page_t page;
+    InternalPage * ip = (InternalPage *)&page;
+    LeafPage * lp = (LeafPage *)&page;
+    int64_t rank = 0;
+    int i, c;
+
+    file_read_page(0, (page_t *)&hp);
+    if (hp.rpn == 0)
+        return 0;
+    file_read_page(hp.rpn, &page);
+    while (!ip->is_leaf) {
+        if (key > INT_MAX)
+            c = ip->kcnt;
+        else if (key < INT_MIN)
+            c = 0;
+        else
+            c = intl_child_index(ip, (int)key);
+        for (i = 0; i < c; i++)
+            rank += INTL_COUNTS(ip)[i];
+        file_read_page(c == 0 ? ip->lspn : ip->records[c - 1].pn, &page);
+    }
+    for (i = 0; i < lp->kcnt && lp->records[i].key < key; i++)
+        rank++;
+    return rank;
+}
+
+
+/* Returns the number of keys in [key_start, key_end].
+ */
+int64_t db_count_range(int key_start, int key_end) {
+    db_agg agg;
+    int64_t cnt;
+
+    if (key_start > key_end)
+        return 0;
+    if (!tree_counted) {
+        db_aggregate_range(key_start, key_end, 1, false, &agg);
+        return agg.count;
+    }
+    pthread_rwlock_rdlock(&db_latch);
+    cnt = rank_below((int64_t)key_end + 1) - rank_below(key_start);
+    pthread_rwlock_unlock(&db_latch);
+    return cnt;
+}
+
+
+/* Returns the rank of key: the number of keys below it,
+ * which is its position when present.
+ */
+int64_t db_rank(int key) {
+    int64_t rank;
+
+    if (!tree_counted)
+        return key == INT_MIN ? 0 : db_count_range(INT_MIN, key - 1);
+    pthread_rwlock_rdlock(&db_latch);
+    rank = rank_below(key);
+    pthread_rwlock_unlock(&db_latch);
+    return rank;
+}
+
+
+/* Finds the k-th key, counting from 0, and copies it and its
+ * value to key and value.  Returns 0, or -1 if there are
+ * no more than k keys.
+ */
+int db_select(int64_t k, int * key, char * value) {
+    HeaderPage hp;
+    page_t page;
+    InternalPage * ip = (InternalPage *)&page;
+    LeafPage * lp = (LeafPage *)&page;
+    pagenum_t pn;
+    int c, ret = -1;
+
+    if (k < 0)
+        return -1;
+    buf_scan_lock();
+    file_read_page(0, (page_t *)&hp);
+    pn = hp.rpn;
+    if (pn != 0)
+        file_read_page(pn, &page);
+    if (pn != 0 && tree_counted) {
+        while (!ip->is_leaf) {
+            for (c = 0; c < ip->kcnt && k >= INTL_COUNTS(ip)[c]; c++)
+                k -= INTL_COUNTS(ip)[c];
+            file_read_page(c == 0 ? ip->lspn : ip->records[c - 1].pn, &page);
+        }
+    } else if (pn != 0) {
+        // Without counts, walk the leaves from the leftmost one.
+        file_read_page(find_leaf(INT_MIN, false), &page);
+        while (k >= lp->kcnt && lp->rspn != 0) {
+            k -= lp->kcnt;
+            file_read_page(lp->rspn, &page);
+        }
+    }
+    if (pn != 0 && k < lp->kcnt) {
+        *key = lp->records[k].key;
+        memcpy(value, lp->records[k].value, 120);
+        ret = 0;
+    }
+    pthread_rwlock_unlock(&db_latch);
+    return ret;
+}
@@ -0,0 +1,401 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  pin.c
+ *
+ *    Description:  Resident internal pages.
+ *
+ *                  Frames are only added, changed or dropped by page
+ *                  writes, which happen under the exclusive db_latch,
+ *                  so readers walk them without locking.  pin_lock
+ *                  only orders writers that share the exclusive latch,
+ *                  like the workers of a bulk build.  SWZ_LEAF entries
+ *                  are also swizzled by readers, under the latch of
+ *                  the cache shard of the leaf.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <pthread.h>
+#include <string.h>
+#include "pin.h"
+#include "cache.h"
+#include "bpt.h"
+#include "stats.h"
+#include "hist.h"
+#include "trace.h"
+
+typedef struct pin_chunk {
+    pin_frame frames[PIN_CHUNK];
+    char * mem;                 // page images
+} pin_chunk;
+
+pagenum_t pin_rpn = 0;
+uint64_t pin_epoch = 0;
+
+static pthread_mutex_t pin_lock = PTHREAD_MUTEX_INITIALIZER;
+static pin_chunk ** pin_dir = NULL;    // chunk i holds frames i * PIN_CHUNK...
+static uint32_t pin_chunks = 0;
+static pin_frame * pin_free = NULL;
+static pin_frame ** pin_hash = NULL;
+static int pin_bits = 0;
+static uint64_t pin_cnt = 0;
+
+
+static inline uint64_t pin_slot(pagenum_t pn) {
+    return (pn * 0x9E3779B97F4A7C15ull) >> (64 - pin_bits);
+}
+
+
+// Adds PIN_CHUNK free frames to the region.
+static void pin_grow(void) {
+    pin_chunk * c = malloc(sizeof(pin_chunk));
+    pin_chunk ** dir = realloc(pin_dir, (pin_chunks + 1) * sizeof(pin_chunk *));
+    int i;
+
+    if (c == NULL || dir == NULL
+            || (c->mem = malloc((size_t)PIN_CHUNK * page_size)) == NULL) {
+        perror("Pinned page region.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = PIN_CHUNK - 1; i >= 0; i--) {
+        c->frames[i].pn = 0;
+        c->frames[i].idx = pin_chunks * PIN_CHUNK + i;
+        c->frames[i].page = (InternalPage *)(c->mem + (size_t)i * page_size);
+        c->frames[i].swz_parent = NULL;
+        c->frames[i].hnext = pin_free;
+        pin_free = &c->frames[i];
+    }
+    pin_dir = dir;
+    pin_dir[pin_chunks++] = c;
+}
+
+
+// Doubles the hash table, keeping one bucket per frame or more.
+static void pin_rehash(void) {
+    pin_frame ** old = pin_hash, * f, * next;
+    uint64_t i, old_size = pin_hash ? (uint64_t)1 << pin_bits : 0;
+
+    pin_bits = pin_bits ? pin_bits + 1 : 8;
+    pin_hash = calloc((size_t)1 << pin_bits, sizeof(pin_frame *));
+    if (pin_hash == NULL) {
+        perror("Pinned page table.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < old_size; i++)
+        for (f = old[i]; f != NULL; f = next) {
+            next = f->hnext;
+            f->hnext = pin_hash[pin_slot(f->pn)];
+            pin_hash[pin_slot(f->pn)] = f;
+        }
+    free(old);
+}
+
+
+pin_frame * pin_lookup(pagenum_t pn) {
+    pin_frame * f;
+    if (pin_hash == NULL)
+        return NULL;
+    for (f = pin_hash[pin_slot(pn)]; f != NULL; f = f->hnext)
+        if (f->pn == pn)
+            return f;
+    return NULL;
+}
+
+
+pin_frame * pin_frame_at(uint32_t idx) {
+    return &pin_dir[idx / PIN_CHUNK]->frames[idx % PIN_CHUNK];
+}
+
+
+/* Page number behind entry i of a live frame image.
+ * A SWZ_LEAF entry is read again after its frame, which
+ * unswizzles it before it takes another page.
+ */
+static pagenum_t entry_pn(InternalPage * ip, int i) {
+    uint32_t e = __atomic_load_n(pin_entry(ip, i), __ATOMIC_RELAXED);
+    pagenum_t pn;
+
+    if (e & SWZ_PIN)
+        return pin_frame_at(e & SWZ_MASK)->pn;
+    while (e & SWZ_LEAF) {
+        pn = cache_frame_pn(e & SWZ_MASK);
+        if (__atomic_load_n(pin_entry(ip, i), __ATOMIC_RELAXED) == e)
+            return pn;
+        e = __atomic_load_n(pin_entry(ip, i), __ATOMIC_RELAXED);
+    }
+    return e;
+}
+
+
+// Copies a frame image to dest with every entry unswizzled.
+void pin_copy(pin_frame * f, page_t * dest) {
+    InternalPage * ip = (InternalPage *)dest;
+    int i;
+
+    memcpy(dest, f->page, page_size);
+    for (i = 0; i <= ip->kcnt; i++)
+        *pin_entry(ip, i) = (uint32_t)entry_pn(f->page, i);
+}
+
+
+// Puts the page number back into the parent entry holding f.
+static void pin_unswizzle(pin_frame * f) {
+    InternalPage * ip;
+    int i;
+
+    if (f->swz_parent == NULL)
+        return;
+    ip = f->swz_parent->page;
+    for (i = 0; i <= ip->kcnt; i++)
+        if (*pin_entry(ip, i) == (SWZ_PIN | f->idx)) {
+            *pin_entry(ip, i) = (uint32_t)f->pn;
+            break;
+        }
+    f->swz_parent = NULL;
+}
+
+
+// Moves the single tagged entry of f to entry e of parent.
+static void pin_adopt(pin_frame * f, pin_frame * parent, uint32_t * e) {
+    if (f->swz_parent != parent)
+        pin_unswizzle(f);
+    f->swz_parent = parent;
+    *e = SWZ_PIN | f->idx;
+}
+
+
+/* Swizzles the entries of a fresh image whose children are
+ * resident.  Pages know no parent, so a child gets its entry
+ * tagged when the parent is written after it; every path
+ * that makes an internal page writes its parent afterwards.
+ * The caller holds every cache shard latch.
+ */
+static void pin_swizzle(pin_frame * f) {
+    pin_frame * c;
+    uint32_t * e;
+    int64_t idx;
+    int i;
+
+    for (i = 0; i <= f->page->kcnt; i++) {
+        e = pin_entry(f->page, i);
+        if (*e & (SWZ_PIN | SWZ_LEAF))
+            continue;
+        if ((c = pin_lookup(*e)) != NULL)
+            pin_adopt(c, f, e);
+        else if ((idx = cache_index(*e, f)) >= 0)
+            *e = SWZ_LEAF | (uint32_t)idx;
+    }
+}
+
+
+/* Writes a page through to its frame.  Internal pages get
+ * a frame if they have none; pages that are no longer
+ * internal lose theirs.
+ */
+void pin_update(pagenum_t pn, const page_t * src) {
+    pin_frame * f;
+
+    if (((const InternalPage *)src)->is_leaf) {
+        pin_drop(pn);
+        return;
+    }
+    pthread_mutex_lock(&pin_lock);
+    if ((f = pin_lookup(pn)) == NULL) {
+        if (pin_free == NULL)
+            pin_grow();
+        f = pin_free;
+        pin_free = f->hnext;
+        f->pn = pn;
+        f->swz_parent = NULL;
+        if (++pin_cnt > ((uint64_t)1 << pin_bits) || pin_hash == NULL)
+            pin_rehash();
+        f->hnext = pin_hash[pin_slot(pn)];
+        pin_hash[pin_slot(pn)] = f;
+    }
+    cache_lock_all();
+    memcpy(f->page, src, page_size);
+    pin_swizzle(f);
+    cache_unlock_all();
+    pin_epoch++;
+    pthread_mutex_unlock(&pin_lock);
+}
+
+
+void pin_drop(pagenum_t pn) {
+    pin_frame ** pp, * f;
+
+    pthread_mutex_lock(&pin_lock);
+    for (pp = pin_hash ? &pin_hash[pin_slot(pn)] : NULL; pp && *pp; pp = &(*pp)->hnext)
+        if ((*pp)->pn == pn) {
+            f = *pp;
+            *pp = f->hnext;
+            pin_unswizzle(f);
+            f->pn = 0;
+            f->hnext = pin_free;
+            pin_free = f;
+            pin_cnt--;
+            pin_epoch++;
+            break;
+        }
+    pthread_mutex_unlock(&pin_lock);
+}
+
+
+/* Swizzles the entries of every frame, after writers that
+ * may have written parents before their children, like the
+ * workers of a bulk build.  The caller holds db_latch
+ * exclusively.
+ */
+void pin_link(void) {
+    pin_frame * f;
+    uint32_t i;
+
+    pthread_mutex_lock(&pin_lock);
+    cache_lock_all();
+    for (i = 0; i < pin_chunks * PIN_CHUNK; i++)
+        if ((f = pin_frame_at(i))->pn != 0)
+            pin_swizzle(f);
+    cache_unlock_all();
+    pthread_mutex_unlock(&pin_lock);
+}
+
+
+// Forgets every frame, before another table is opened.
+void pin_reset(void) {
+    uint32_t i;
+
+    for (i = 0; i < pin_chunks; i++) {
+        free(pin_dir[i]->mem);
+        free(pin_dir[i]);
+    }
+    free(pin_dir);
+    free(pin_hash);
+    pin_dir = NULL;
+    pin_chunks = 0;
+    pin_free = NULL;
+    pin_hash = NULL;
+    pin_bits = 0;
+    pin_cnt = 0;
+    pin_rpn = 0;
+    pin_epoch++;
+}
+
+
+/* Loads page pn, height levels above the leaves, and its subtree.
+ * Children go first, so the page swizzles them when it is added.
+ */
+static void pin_load_page(pagenum_t pn, int height) {
+    page_t page;
+    InternalPage * ip = (InternalPage *)&page;
+    int i;
+
+    file_read_page(pn, &page);
+    if (height > 1)
+        for (i = 0; i <= ip->kcnt; i++)
+            pin_load_page(*pin_entry(ip, i), height - 1);
+    pin_update(pn, &page);
+}
+
+
+/* Loads the internal pages of the tree under rpn.
+ * Leaves are not read, but for the leftmost one.
+ */
+void pin_load(pagenum_t rpn) {
+    page_t page;
+    InternalPage * ip = (InternalPage *)&page;
+    int height = 0;
+
+    pin_rpn = rpn;
+    if (rpn == 0)
+        return;
+    file_read_page(rpn, &page);
+    while (!ip->is_leaf) {
+        file_read_page(ip->lspn, &page);
+        height++;
+    }
+    if (height > 0)
+        pin_load_page(rpn, height);
+}
+
+
+/* Descends from the root through the resident frames,
+ * following swizzled entries.  Returns the last frame and
+ * sets *slot to the entry of the leaf for key, or returns
+ * NULL when the root is a leaf (or the tree is empty).
+ * The path is recorded in d unless it is NULL.
+ */
+static pin_frame * pin_descend(int key, int * slot, descent * d) {
+    pin_frame * f;
+    uint32_t e;
+    uint64_t t;
+    int i;
+
+    if (pin_rpn == 0 || (f = pin_lookup(pin_rpn)) == NULL)
+        return NULL;
+    for (;;) {
+        stats_inc(STAT_CACHE_HIT);
+        if (trace_active) {
+            t = hist_now();
+            trace_page(TRACE_PAGE_READ, f->pn, TRACE_CACHE, t, t);
+        }
+        i = intl_child_index(f->page, key);
+        if (d != NULL) {
+            d->pn[d->depth] = f->pn;
+            d->idx[d->depth++] = i;
+        }
+        e = __atomic_load_n(pin_entry(f->page, i), __ATOMIC_RELAXED);
+        if (e & SWZ_PIN) {
+            f = pin_frame_at(e & SWZ_MASK);
+            continue;
+        }
+        // Every internal page is resident, so the rest are leaves.
+        *slot = i;
+        return f;
+    }
+}
+
+
+/* Returns the leaf for key, or 0 if the tree is empty,
+ * recording the path to it in d unless d is NULL.
+ */
+pagenum_t pin_find_leaf(int key, descent * d) {
+    pin_frame * f;
+    int i;
+
+    if (d != NULL)
+        d->depth = 0;
+    if ((f = pin_descend(key, &i, d)) == NULL)
+        return pin_rpn;
+    return entry_pn(f->page, i);
+}
+
+
+/* Copies the leaf for key to dest, from its cache frame when
+ * the parent entry is swizzled.  Returns the leaf page number,
+ * or 0 if the tree is empty.
+ */
+pagenum_t pin_read_leaf(int key, page_t * dest) {
+    pin_frame * f;
+    pagenum_t pn;
+    int i;
+
+    if ((f = pin_descend(key, &i, NULL)) == NULL) {
+        if (pin_rpn != 0)
+            file_read_page(pin_rpn, dest);
+        return pin_rpn;
+    }
+    if ((pn = cache_read_child(f, i, dest)) != 0)
+        return pn;
+    // A miss reads the leaf into the cache, then swizzles the entry.
+    pn = entry_pn(f->page, i);
+    file_read_page(pn, dest);
+    cache_swizzle(f, i, pn);
+    return pn;
+}
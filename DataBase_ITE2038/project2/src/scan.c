@@ -0,0 +1,370 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  scan.c
+ *
+ *    Description:  Parallel range scans split on internal separators,
+ *                  and range aggregates folded inside the scan loop.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <pthread.h>
+#include <string.h>
+#include "scan.h"
+#include "bpt.h"
+#include "hist.h"
+#include "trace.h"
+#include "buf.h"
+#include "cache.h"
+
+typedef struct scan_ctx {
+    bool ordered;
+    bool aggregate;     // fold records into db_agg, no callback
+    bool sum;
+    scan_cb cb;
+    void * arg;
+    int stop;
+    int turn;           // part whose records an ordered scan delivers now
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} scan_ctx;
+
+typedef struct scan_part {
+    pthread_t tid;
+    scan_ctx * ctx;
+    int idx;
+    int lo, hi;
+    bool streaming;     // records go straight to the callback
+    int found;
+    db_agg agg;
+    // Records an ordered scan holds back until the part's turn.
+    int nq;
+    int * keys;
+    char (* values)[120];
+} scan_part;
+
+
+/* Cuts [key_start, key_end] at the separators of the highest
+ * level holding at least want subtrees of the range (or of the
+ * leaves).  Returns the number of subtrees, and in *out the
+ * smallest key of the range each one covers, in key order.
+ */
+static int cut_range(int key_start, int key_end, int want, int ** out) {
+    HeaderPage hp;
+    InternalPage ip;
+    pagenum_t * pns, * next_pns;
+    int * mins, * next_mins;
+    int i, c, n, m;
+
+    *out = NULL;
+    file_read_page(0, (page_t *)&hp);
+    if (hp.rpn == 0)
+        return 0;
+    pns = malloc(sizeof(pagenum_t));
+    mins = malloc(sizeof(int));
+    if (pns == NULL || mins == NULL) {
+        perror("Scan cut.");
+        exit(EXIT_FAILURE);
+    }
+    pns[0] = hp.rpn;
+    mins[0] = key_start;
+    n = 1;
+
+    while (n < want) {
+        file_read_page(pns[0], (page_t *)&ip);
+        if (ip.is_leaf)
+            break;
+        next_pns = malloc((size_t)n * intl_order * sizeof(pagenum_t));
+        next_mins = malloc((size_t)n * intl_order * sizeof(int));
+        if (next_pns == NULL || next_mins == NULL) {
+            perror("Scan cut.");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0, m = 0; i < n; i++) {
+            if (i > 0)
+                file_read_page(pns[i], (page_t *)&ip);
+            c = intl_child_index(&ip, mins[i]);
+            next_pns[m] = c == 0 ? ip.lspn : ip.records[c - 1].pn;
+            next_mins[m++] = mins[i];
+            for (c++; c <= ip.kcnt && ip.records[c - 1].key <= key_end; c++) {
+                next_pns[m] = ip.records[c - 1].pn;
+                next_mins[m++] = ip.records[c - 1].key;
+            }
+        }
+        free(pns);
+        free(mins);
+        pns = next_pns;
+        mins = next_mins;
+        n = m;
+    }
+    free(pns);
+    *out = mins;
+    return n;
+}
+
+
+static void deliver(scan_part * p, int key, const char * value) {
+    scan_ctx * ctx = p->ctx;
+
+    if (__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED))
+        return;
+    p->found++;
+    if (ctx->cb(key, value, ctx->arg) != 0)
+        __atomic_store_n(&ctx->stop, 1, __ATOMIC_RELAXED);
+}
+
+
+/* Waits until the parts before p have delivered their records,
+ * then delivers the ones p holds back.  From here on p streams.
+ */
+static void take_turn(scan_part * p) {
+    scan_ctx * ctx = p->ctx;
+    int i;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->turn != p->idx)
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+    pthread_mutex_unlock(&ctx->lock);
+    for (i = 0; i < p->nq; i++)
+        deliver(p, p->keys[i], p->values[i]);
+    p->nq = 0;
+    p->streaming = true;
+}
+
+
+static void emit(scan_part * p, int key, const char * value) {
+    if (!p->streaming && p->nq == SCAN_QUEUE_RECORDS)
+        take_turn(p);
+    if (p->streaming) {
+        deliver(p, key, value);
+        return;
+    }
+    p->keys[p->nq] = key;
+    memcpy(p->values[p->nq], value, 120);
+    p->nq++;
+}
+
+
+/* Folds the records of a leaf from slot i up to key hi into agg,
+ * without copying them out.  Returns the first slot past hi.
+ */
+static int agg_leaf(db_agg * agg, LeafPage * n, int i, int hi, bool sum) {
+    int e, lo, mid;
+    char * end;
+    double v;
+
+    if (i < n->kcnt && n->records[n->kcnt - 1].key <= hi)
+        e = n->kcnt;
+    else {
+        for (lo = i, e = n->kcnt; lo < e; ) {
+            mid = (lo + e) / 2;
+            if (n->records[mid].key <= hi)
+                lo = mid + 1;
+            else
+                e = mid;
+        }
+    }
+    if (e == i)
+        return e;
+    if (agg->count == 0)
+        agg->min_key = n->records[i].key;
+    agg->max_key = n->records[e - 1].key;
+    agg->count += e - i;
+    for ( ; sum && i < e; i++) {
+        v = strtod(n->records[i].value, &end);
+        if (end != n->records[i].value) {
+            agg->sum += v;
+            agg->nvalues++;
+        }
+    }
+    return e;
+}
+
+
+/* Scans [lo, hi] of one part along the rspn chain.
+ * Runs under the db_latch held by db_scan_parallel.
+ */
+static void * scan_worker(void * arg) {
+    scan_part * p = (scan_part *)arg;
+    scan_ctx * ctx = p->ctx;
+    pagenum_t lpn;
+    LeafPage n;
+    int i;
+
+    // Leaves read by the scan stay probationary in the cache.
+    cache_scan = true;
+    lpn = find_leaf(p->lo, false);
+    if (lpn != 0)
+        file_read_page(lpn, (page_t *)&n);
+    for (i = 0; lpn != 0 && i < n.kcnt && n.records[i].key < p->lo; i++) ;
+    while (lpn != 0 && !__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED)) {
+        if (ctx->aggregate)
+            i = agg_leaf(&p->agg, &n, i, p->hi, ctx->sum);
+        else
+            for ( ; i < n.kcnt && n.records[i].key <= p->hi
+                    && !__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED); i++)
+                emit(p, n.records[i].key, n.records[i].value);
+        if (i < n.kcnt)
+            break;
+        lpn = n.rspn;
+        if (lpn != 0)
+            file_read_page(lpn, (page_t *)&n);
+        i = 0;
+    }
+
+    // Pass the turn on, once the records held back are delivered.
+    if (ctx->ordered) {
+        if (!p->streaming)
+            take_turn(p);
+        pthread_mutex_lock(&ctx->lock);
+        ctx->turn++;
+        pthread_cond_broadcast(&ctx->cond);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+    return NULL;
+}
+
+
+/* Cuts [key_start, key_end] into parts, scans them with up to
+ * threads workers and delivers or folds their records.
+ * Returns the number of records delivered.
+ */
+static int scan_run(scan_ctx * ctx, int key_start, int key_end, int threads,
+        db_agg * agg) {
+    scan_part * parts;
+    int * mins = NULL;
+    int i, j, n, nparts, total = 0;
+
+    if (threads < 1)
+        threads = 1;
+    ctx->stop = 0;
+    ctx->turn = 0;
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+
+    buf_scan_lock();
+    n = key_start <= key_end
+        ? cut_range(key_start, key_end, threads * SCAN_SPLIT_FANOUT, &mins) : 0;
+    nparts = n < threads ? n : threads;
+    parts = calloc(nparts > 0 ? nparts : 1, sizeof(scan_part));
+    if (parts == NULL) {
+        perror("Scan parts.");
+        exit(EXIT_FAILURE);
+    }
+
+    // Part i takes an equal share of the subtrees.
+    for (i = 0; i < nparts; i++) {
+        j = (int)((int64_t)(i + 1) * n / nparts);
+        parts[i].ctx = ctx;
+        parts[i].idx = i;
+        // The first part of an ordered scan never waits for its turn.
+        parts[i].streaming = !ctx->ordered || i == 0;
+        if (!parts[i].streaming) {
+            parts[i].keys = malloc(SCAN_QUEUE_RECORDS * sizeof(int));
+            parts[i].values = malloc(SCAN_QUEUE_RECORDS * sizeof(*parts[i].values));
+            if (parts[i].keys == NULL || parts[i].values == NULL) {
+                perror("Scan buffer.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        parts[i].lo = mins[(int64_t)i * n / nparts];
+        parts[i].hi = j < n ? mins[j] - 1 : key_end;
+        pthread_create(&parts[i].tid, NULL, scan_worker, &parts[i]);
+    }
+
+    for (i = 0; i < nparts; i++) {
+        pthread_join(parts[i].tid, NULL);
+        free(parts[i].keys);
+        free(parts[i].values);
+        total += parts[i].found;
+        // Parts come in key order, so the first one found has the min.
+        if (ctx->aggregate && parts[i].agg.count > 0) {
+            if (agg->count == 0)
+                agg->min_key = parts[i].agg.min_key;
+            agg->max_key = parts[i].agg.max_key;
+            agg->count += parts[i].agg.count;
+            agg->nvalues += parts[i].agg.nvalues;
+            agg->sum += parts[i].agg.sum;
+        }
+    }
+    pthread_rwlock_unlock(&db_latch);
+
+    free(parts);
+    free(mins);
+    pthread_mutex_destroy(&ctx->lock);
+    pthread_cond_destroy(&ctx->cond);
+    return total;
+}
+
+
+/* Calls cb for every record with a key in [key_start, key_end],
+ * scanning with up to threads workers.  An ordered scan delivers
+ * the records in key order, one worker at a time: the first part
+ * streams them as it reads, and every later part holds back at
+ * most SCAN_QUEUE_RECORDS until the parts before it are done.
+ * An unordered one delivers them from the workers as they are read.
+ * Returns the number of records delivered.
+ */
+int db_scan_parallel(int key_start, int key_end, int threads, bool ordered,
+        scan_cb cb, void * arg) {
+    scan_ctx ctx;
+    int total;
+    uint64_t t0 = hist_start();
+
+    ctx.ordered = ordered;
+    ctx.aggregate = false;
+    ctx.sum = false;
+    ctx.cb = cb;
+    ctx.arg = arg;
+    trace_op_begin("pscan", key_start);
+    total = scan_run(&ctx, key_start, key_end, threads, NULL);
+    trace_op_end();
+    hist_end(HIST_SCAN, t0);
+    return total;
+}
+
+
+/* Computes COUNT and MIN/MAX key of [key_start, key_end] into out,
+ * and SUM of the numeric values when sum is set.
+ * Returns 0.
+ */
+int db_aggregate_range(int key_start, int key_end, int threads, bool sum,
+        db_agg * out) {
+    scan_ctx ctx;
+    uint64_t t0 = hist_start();
+
+    memset(out, 0, sizeof(db_agg));
+    ctx.ordered = false;
+    ctx.aggregate = true;
+    ctx.sum = sum;
+    ctx.cb = NULL;
+    ctx.arg = NULL;
+    trace_op_begin("agg", key_start);
+    scan_run(&ctx, key_start, key_end, threads, out);
+    trace_op_end();
+    hist_end(HIST_SCAN, t0);
+    return 0;
+}
+
+
+double db_agg_avg(const db_agg * agg) {
+    return agg->nvalues ? agg->sum / agg->nvalues : 0;
+}
+
+
+void db_agg_print(FILE * out, const db_agg * agg) {
+    if (agg->count == 0) {
+        fprintf(out, "count 0\n");
+        return;
+    }
+    fprintf(out, "count %lld min %d max %d sum %.17g avg %.17g\n",
+            (long long)agg->count, agg->min_key, agg->max_key, agg->sum,
+            db_agg_avg(agg));
+}
@@ -0,0 +1,479 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  server.c
+ *
+ *    Description:  Table server over a Unix domain socket and, optionally,
+ *                  TCP.  Worker threads share one epoll instance; every
+ *                  socket is armed one-shot, so a connection is served by
+ *                  one worker at a time and its responses stay in order.
+ *                  A worker drains everything a connection has sent,
+ *                  runs the whole batch of requests and writes all the
+ *                  responses back in one go.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "server.h"
+#include "bpt.h"
+
+#define SRV_LISTENER 0
+#define SRV_CONN 1
+
+// Stop reading from a connection while this much output is unsent.
+#define SRV_OUT_HIGH (1 << 20)
+#define SRV_EVENTS 64
+
+typedef struct srv_sock {
+    int type;           // SRV_LISTENER or SRV_CONN
+    int fd;
+} srv_sock;
+
+typedef struct srv_conn {
+    srv_sock sock;
+    char * in;
+    size_t in_len, in_cap;
+    char * out;
+    size_t out_len, out_off, out_cap;
+    bool closed;        // peer closed or the connection failed
+} srv_conn;
+
+static int srv_epfd = -1;
+static volatile sig_atomic_t srv_stop = 0;
+
+// Scan results of the calling worker.
+static __thread int * scan_keys;
+static __thread char (* scan_values)[120];
+
+
+static void put32(char * p, uint32_t v) {
+    int i;
+    for (i = 0; i < 4; i++)
+        p[i] = (char)(v >> (8 * i));
+}
+
+
+static void put64(char * p, uint64_t v) {
+    int i;
+    for (i = 0; i < 8; i++)
+        p[i] = (char)(v >> (8 * i));
+}
+
+
+static uint32_t get32(const char * p) {
+    uint32_t v = 0;
+    int i;
+    for (i = 3; i >= 0; i--)
+        v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+
+static uint64_t get64(const char * p) {
+    uint64_t v = 0;
+    int i;
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | (unsigned char)p[i];
+    return v;
+}
+
+
+static void srv_on_signal(int sig) {
+    (void)sig;
+    srv_stop = 1;
+}
+
+
+static int set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+static void arm(srv_sock * s, uint32_t events) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = s;
+    epoll_ctl(srv_epfd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+
+static void reserve(char ** buf, size_t * cap, size_t need) {
+    size_t n = *cap ? *cap : 4096;
+    if (need <= *cap)
+        return;
+    while (n < need)
+        n *= 2;
+    *buf = realloc(*buf, n);
+    if (*buf == NULL) {
+        perror("Connection buffer.");
+        exit(EXIT_FAILURE);
+    }
+    *cap = n;
+}
+
+
+// Appends a response header and leaves room for a body of blen bytes.
+static char * respond(srv_conn * c, uint8_t op, uint8_t status, uint32_t id,
+        uint32_t blen) {
+    char * p;
+    reserve(&c->out, &c->out_cap, c->out_len + SRV_HDR_SIZE + blen);
+    p = c->out + c->out_len;
+    memset(p, 0, SRV_HDR_SIZE);
+    put32(p, blen);
+    p[4] = (char)op;
+    p[5] = (char)status;
+    put32(p + 8, id);
+    c->out_len += SRV_HDR_SIZE + blen;
+    return p + SRV_HDR_SIZE;
+}
+
+
+static void do_scan(srv_conn * c, uint32_t id, const char * body) {
+    int64_t k1 = (int64_t)get64(body), k2 = (int64_t)get64(body + 8);
+    uint32_t limit = get32(body + 16);
+    uint32_t blen = 4;
+    int i, n;
+    size_t vlen;
+    char * p;
+
+    if (scan_keys == NULL) {
+        scan_keys = malloc(SRV_MAX_SCAN * sizeof(int));
+        scan_values = malloc(SRV_MAX_SCAN * sizeof(*scan_values));
+        if (scan_keys == NULL || scan_values == NULL) {
+            perror("Scan buffers.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (limit == 0 || limit > SRV_MAX_SCAN)
+        limit = SRV_MAX_SCAN;
+    // Keys are ints, so only the part of the range within int is looked at.
+    if (k1 > k2 || k1 > INT_MAX || k2 < INT_MIN)
+        n = 0;
+    else
+        n = find_range(k1 < INT_MIN ? INT_MIN : (int)k1,
+                k2 > INT_MAX ? INT_MAX : (int)k2,
+                false, scan_keys, scan_values, (int)limit);
+
+    for (i = 0; i < n; i++)
+        blen += 9 + strnlen(scan_values[i], 119);
+    p = respond(c, SRV_SCAN, SRV_OK, id, blen);
+    put32(p, (uint32_t)n);
+    p += 4;
+    for (i = 0; i < n; i++) {
+        vlen = strnlen(scan_values[i], 119);
+        put64(p, (uint64_t)(int64_t)scan_keys[i]);
+        p[8] = (char)vlen;
+        memcpy(p + 9, scan_values[i], vlen);
+        p += 9 + vlen;
+    }
+}
+
+
+/* Runs one request and appends its response.
+ */
+static void execute(srv_conn * c, uint8_t op, uint32_t id, const char * body,
+        uint32_t blen) {
+    char value[120];
+    int64_t key;
+    size_t vlen;
+
+    if (blen < 8 || (op == SRV_SCAN && blen < 20)) {
+        respond(c, op, SRV_BAD_REQUEST, id, 0);
+        return;
+    }
+    key = (int64_t)get64(body);
+
+    switch (op) {
+    case SRV_FIND:
+        if (db_find(key, value) != 0) {
+            respond(c, op, SRV_NOT_FOUND, id, 0);
+            break;
+        }
+        vlen = strnlen(value, 119);
+        memcpy(respond(c, op, SRV_OK, id, (uint32_t)vlen), value, vlen);
+        break;
+    case SRV_INSERT:
+        vlen = blen - 8;
+        if (vlen > 119) {
+            respond(c, op, SRV_BAD_REQUEST, id, 0);
+            break;
+        }
+        memcpy(value, body + 8, vlen);
+        value[vlen] = '\0';
+        switch (db_insert_if_absent(key, value)) {
+        case DB_INSERTED:
+            respond(c, op, SRV_OK, id, 0);
+            break;
+        case DB_EXISTS:
+            respond(c, op, SRV_EXISTS, id, 0);
+            break;
+        default:
+            respond(c, op, SRV_ERROR, id, 0);
+            break;
+        }
+        break;
+    case SRV_DELETE:
+        respond(c, op, db_delete(key) == 0 ? SRV_OK : SRV_NOT_FOUND, id, 0);
+        break;
+    case SRV_SCAN:
+        do_scan(c, id, body);
+        break;
+    default:
+        respond(c, op, SRV_BAD_REQUEST, id, 0);
+        break;
+    }
+}
+
+
+/* Runs every complete request in the input buffer,
+ * that is the whole pipelined batch read so far.
+ */
+static void run_requests(srv_conn * c) {
+    size_t off = 0;
+    uint32_t blen;
+
+    while (c->in_len - off >= SRV_HDR_SIZE) {
+        blen = get32(c->in + off);
+        if (blen > SRV_MAX_BODY) {
+            c->closed = true;
+            break;
+        }
+        if (c->in_len - off < SRV_HDR_SIZE + blen)
+            break;
+        execute(c, (uint8_t)c->in[off + 4], get32(c->in + off + 8),
+                c->in + off + SRV_HDR_SIZE, blen);
+        off += SRV_HDR_SIZE + blen;
+    }
+    memmove(c->in, c->in + off, c->in_len - off);
+    c->in_len -= off;
+}
+
+
+static void flush_out(srv_conn * c) {
+    ssize_t n;
+    while (c->out_off < c->out_len) {
+        n = send(c->sock.fd, c->out + c->out_off, c->out_len - c->out_off,
+                MSG_NOSIGNAL);
+        if (n > 0) {
+            c->out_off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        c->closed = true;
+        return;
+    }
+    c->out_off = c->out_len = 0;
+}
+
+
+static void close_conn(srv_conn * c) {
+    epoll_ctl(srv_epfd, EPOLL_CTL_DEL, c->sock.fd, NULL);
+    close(c->sock.fd);
+    free(c->in);
+    free(c->out);
+    free(c);
+}
+
+
+static void serve_conn(srv_conn * c) {
+    ssize_t n;
+
+    flush_out(c);
+    while (!c->closed && c->out_len - c->out_off < SRV_OUT_HIGH) {
+        reserve(&c->in, &c->in_cap, c->in_len + 4096);
+        n = recv(c->sock.fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+        if (n > 0) {
+            c->in_len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        c->closed = true;
+    }
+    run_requests(c);
+    flush_out(c);
+
+    if (c->closed) {
+        close_conn(c);
+        return;
+    }
+    if (c->out_off < c->out_len)
+        arm(&c->sock, c->out_len - c->out_off < SRV_OUT_HIGH
+                ? EPOLLIN | EPOLLOUT : EPOLLOUT);
+    else
+        arm(&c->sock, EPOLLIN | EPOLLRDHUP);
+}
+
+
+static void accept_conns(srv_sock * l) {
+    struct epoll_event ev;
+    srv_conn * c;
+    int fd, one = 1;
+
+    while ((fd = accept(l->fd, NULL, NULL)) != -1) {
+        set_nonblock(fd);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c = calloc(1, sizeof(srv_conn));
+        if (c == NULL) {
+            perror("Connection.");
+            exit(EXIT_FAILURE);
+        }
+        c->sock.type = SRV_CONN;
+        c->sock.fd = fd;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        ev.data.ptr = c;
+        epoll_ctl(srv_epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    arm(l, EPOLLIN);
+}
+
+
+static void * worker(void * arg) {
+    struct epoll_event events[SRV_EVENTS];
+    srv_sock * s;
+    int i, n;
+
+    (void)arg;
+    while (!srv_stop) {
+        n = epoll_wait(srv_epfd, events, SRV_EVENTS, 500);
+        for (i = 0; i < n; i++) {
+            s = (srv_sock *)events[i].data.ptr;
+            if (s->type == SRV_LISTENER)
+                accept_conns(s);
+            else
+                serve_conn((srv_conn *)s);
+        }
+    }
+    return NULL;
+}
+
+
+static int listen_unix(const char * path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+            || listen(fd, 128) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+static int listen_tcp(int port) {
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+            || listen(fd, 128) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/* Serves the opened table on unix_path and, if tcp_port
+ * is not 0, on that TCP port, with workers threads.
+ * Returns when SIGINT or SIGTERM arrives, 0 on a clean stop.
+ */
+int server_run(const char * unix_path, int tcp_port, int workers) {
+    srv_sock listeners[2];
+    struct epoll_event ev;
+    struct sigaction sa;
+    pthread_t * tids;
+    int i, nl = 0;
+
+    if (workers < 1)
+        workers = SRV_DEFAULT_WORKERS;
+    if ((srv_epfd = epoll_create1(0)) == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    if (unix_path != NULL) {
+        if ((listeners[nl].fd = listen_unix(unix_path)) == -1) {
+            perror("Unix socket");
+            return -1;
+        }
+        nl++;
+    }
+    if (tcp_port != 0) {
+        if ((listeners[nl].fd = listen_tcp(tcp_port)) == -1) {
+            perror("TCP socket");
+            return -1;
+        }
+        nl++;
+    }
+    for (i = 0; i < nl; i++) {
+        listeners[i].type = SRV_LISTENER;
+        set_nonblock(listeners[i].fd);
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = &listeners[i];
+        epoll_ctl(srv_epfd, EPOLL_CTL_ADD, listeners[i].fd, &ev);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = srv_on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    tids = malloc(workers * sizeof(pthread_t));
+    if (tids == NULL) {
+        perror("Worker threads.");
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < workers; i++)
+        pthread_create(&tids[i], NULL, worker, NULL);
+    for (i = 0; i < workers; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+
+    for (i = 0; i < nl; i++)
+        close(listeners[i].fd);
+    if (unix_path != NULL)
+        unlink(unix_path);
+    close(srv_epfd);
+    return 0;
+}
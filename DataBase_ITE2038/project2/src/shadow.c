@@ -0,0 +1,474 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  shadow.c
+ *
+ *    Description:  Copy-on-write shadow paging: the page map, commits
+ *                  by header swap, recycling of superseded pages and
+ *                  point-in-time snapshots.
+ *
+ *                  Writers run under the exclusive db_latch, but the
+ *                  workers of a bulk build share it, so the map and
+ *                  the physical page states are changed under
+ *                  shadow_lock.  Map pages are never moved once
+ *                  allocated, so readers locate pages without it.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "shadow.h"
+#include "wal.h"
+#include "bpt.h"
+#include "buf.h"
+#include "stats.h"
+
+// States of a physical page.
+enum {
+    PHYS_FREE,
+    PHYS_LIVE,          // part of the last commit
+    PHYS_NEW,           // written since the last commit
+    PHYS_RETIRED        // superseded, kept for older snapshots
+};
+
+typedef struct retired_page {
+    uint32_t pn;
+    uint64_t epoch;     // commit that superseded the page
+} retired_page;
+
+typedef struct page_list {
+    uint32_t * pn;
+    uint32_t cnt, cap;
+} page_list;
+
+struct db_snapshot {
+    uint64_t epoch;
+    pagenum_t rpn;
+    uint32_t * dir;             // map root of the commit
+    uint32_t * map;             // last map page read
+    int64_t map_idx;
+    struct db_snapshot * next;
+};
+
+bool shadow_on = false;
+
+static pthread_mutex_t shadow_lock = PTHREAD_MUTEX_INITIALIZER;
+static HeaderPage shadow_hdr;   // header of the open commit
+static bool shadow_dirty = false;
+
+static uint32_t ** map_pages = NULL;    // map page j covers logical pages
+                                        // j * SHADOW_MAP_ENTRIES...
+static uint32_t * map_phys = NULL;      // image of the map root
+static bool * map_dirty = NULL;
+static uint32_t map_cnt = 0;
+static uint32_t map_root = 0;
+
+static uint8_t * phys_state = NULL;
+static uint32_t phys_cnt = 0, phys_cap = 0;
+static page_list free_pages, txn_new, txn_old;
+static retired_page * retired = NULL;
+static uint32_t retired_cnt = 0, retired_cap = 0;
+
+static uint64_t shadow_epoch = 0;
+static db_snapshot * snapshots = NULL;
+
+
+static void * shadow_alloc(void * p, size_t size) {
+    if ((p = realloc(p, size)) == NULL) {
+        perror("Shadow paging.");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+
+static void list_push(page_list * l, uint32_t pn) {
+    if (l->cnt == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 64;
+        l->pn = shadow_alloc(l->pn, l->cap * sizeof(uint32_t));
+    }
+    l->pn[l->cnt++] = pn;
+}
+
+
+static void phys_read(pagenum_t pn, void * dest) {
+    pread(fileno(fp_db), dest, page_size, (off_t)(pn * page_size));
+    stats_inc(STAT_PAGE_READ);
+}
+
+
+static void phys_write(pagenum_t pn, const void * src) {
+    pwrite(fileno(fp_db), src, page_size, (off_t)(pn * page_size));
+    stats_inc(STAT_PAGE_WRITE);
+}
+
+
+// Grows the page states to cover the first cnt physical pages.
+static void phys_reserve(uint32_t cnt) {
+    uint32_t cap = phys_cap ? phys_cap : 1024;
+
+    while (cap < cnt)
+        cap *= 2;
+    if (cap != phys_cap) {
+        phys_state = shadow_alloc(phys_state, cap);
+        memset(phys_state + phys_cap, PHYS_FREE, cap - phys_cap);
+        phys_cap = cap;
+    }
+}
+
+
+// A free physical page, the file growing when there is none.
+static uint32_t phys_alloc(void) {
+    uint32_t pn;
+
+    if (free_pages.cnt > 0)
+        pn = free_pages.pn[--free_pages.cnt];
+    else {
+        pn = phys_cnt++;
+        phys_reserve(phys_cnt);
+    }
+    phys_state[pn] = PHYS_NEW;
+    list_push(&txn_new, pn);
+    return pn;
+}
+
+
+// Supersedes a committed page at the next commit.
+static void phys_retire(uint32_t pn) {
+    if (pn != 0 && phys_state[pn] == PHYS_LIVE)
+        list_push(&txn_old, pn);
+}
+
+
+/* Frees the pages superseded by commits no snapshot predates.
+ * The caller holds shadow_lock.
+ */
+static void shadow_reclaim(void) {
+    uint64_t oldest = UINT64_MAX;
+    db_snapshot * s;
+    uint32_t i, keep = 0;
+
+    for (s = snapshots; s != NULL; s = s->next)
+        if (s->epoch < oldest)
+            oldest = s->epoch;
+    for (i = 0; i < retired_cnt; i++)
+        if (retired[i].epoch <= oldest) {
+            phys_state[retired[i].pn] = PHYS_FREE;
+            list_push(&free_pages, retired[i].pn);
+            stats_inc(STAT_PAGE_RECYCLE);
+        } else
+            retired[keep++] = retired[i];
+    retired_cnt = keep;
+}
+
+
+// Map entry of logical page pn, its map page made if need be.
+static uint32_t * map_entry(pagenum_t pn) {
+    uint64_t j = pn / SHADOW_MAP_ENTRIES;
+
+    if (j >= SHADOW_MAP_ENTRIES) {
+        fprintf(stderr, "Page map full at page %llu.\n", (unsigned long long)pn);
+        exit(EXIT_FAILURE);
+    }
+    if (map_pages[j] == NULL) {
+        map_pages[j] = shadow_alloc(NULL, page_size);
+        memset(map_pages[j], 0, page_size);
+        map_dirty[j] = true;
+        if (j >= map_cnt)
+            map_cnt = j + 1;
+    }
+    return &map_pages[j][pn % SHADOW_MAP_ENTRIES];
+}
+
+
+// Drops the state of the previous table.  Its snapshots must be closed.
+void shadow_reset(void) {
+    uint32_t j;
+
+    for (j = 0; j < map_cnt; j++)
+        free(map_pages[j]);
+    free(map_pages);
+    free(map_phys);
+    free(map_dirty);
+    free(phys_state);
+    free(free_pages.pn);
+    free(txn_new.pn);
+    free(txn_old.pn);
+    free(retired);
+    map_pages = NULL;
+    map_phys = NULL;
+    map_dirty = NULL;
+    map_cnt = map_root = 0;
+    phys_state = NULL;
+    phys_cnt = phys_cap = 0;
+    memset(&free_pages, 0, sizeof(page_list));
+    memset(&txn_new, 0, sizeof(page_list));
+    memset(&txn_old, 0, sizeof(page_list));
+    retired = NULL;
+    retired_cnt = retired_cap = 0;
+    shadow_epoch = 0;
+    snapshots = NULL;
+    shadow_dirty = false;
+    shadow_on = false;
+}
+
+
+static void shadow_tables(void) {
+    map_pages = shadow_alloc(NULL, SHADOW_MAP_ENTRIES * sizeof(uint32_t *));
+    map_phys = shadow_alloc(NULL, page_size);
+    map_dirty = shadow_alloc(NULL, SHADOW_MAP_ENTRIES * sizeof(bool));
+    memset(map_pages, 0, SHADOW_MAP_ENTRIES * sizeof(uint32_t *));
+    memset(map_phys, 0, page_size);
+    memset(map_dirty, 0, SHADOW_MAP_ENTRIES * sizeof(bool));
+}
+
+
+/* Loads the page map of the last commit of the opened table.
+ * Physical pages it does not reach, left by a commit that
+ * did not finish or superseded before, are free.
+ */
+void shadow_load(void) {
+    struct stat st;
+    uint32_t i, j;
+    int64_t pn;
+
+    phys_read(0, &shadow_hdr);
+    shadow_tables();
+    fstat(fileno(fp_db), &st);
+    phys_cnt = (uint32_t)(st.st_size / page_size);
+    phys_reserve(phys_cnt);
+    phys_state[0] = PHYS_LIVE;
+
+    map_root = shadow_hdr.mpn;
+    phys_read(map_root, map_phys);
+    phys_state[map_root] = PHYS_LIVE;
+    for (j = 0; j < SHADOW_MAP_ENTRIES; j++) {
+        if (map_phys[j] == 0)
+            continue;
+        map_pages[j] = shadow_alloc(NULL, page_size);
+        phys_read(map_phys[j], map_pages[j]);
+        phys_state[map_phys[j]] = PHYS_LIVE;
+        for (i = 0; i < SHADOW_MAP_ENTRIES; i++)
+            if (map_pages[j][i] != 0)
+                phys_state[map_pages[j][i]] = PHYS_LIVE;
+        map_cnt = j + 1;
+    }
+    // Low pages are handed out first.
+    for (pn = (int64_t)phys_cnt - 1; pn > 0; pn--)
+        if (phys_state[pn] == PHYS_FREE)
+            list_push(&free_pages, (uint32_t)pn);
+    shadow_on = true;
+}
+
+
+void shadow_read_header(page_t * dest) {
+    memcpy(dest, &shadow_hdr, page_size);
+}
+
+
+void shadow_write_header(const page_t * src) {
+    memcpy(&shadow_hdr, src, page_size);
+    shadow_dirty = true;
+}
+
+
+// Physical page of logical page pn.
+pagenum_t shadow_locate(pagenum_t pn) {
+    uint32_t * map = map_pages[pn / SHADOW_MAP_ENTRIES];
+    return map == NULL ? 0 : map[pn % SHADOW_MAP_ENTRIES];
+}
+
+
+/* Physical page the next version of logical page pn goes to.
+ * A page already written since the last commit is overwritten,
+ * any other gets a free page.
+ */
+pagenum_t shadow_place(pagenum_t pn) {
+    uint32_t * e, ppn;
+
+    pthread_mutex_lock(&shadow_lock);
+    e = map_entry(pn);
+    if (*e == 0 || phys_state[*e] != PHYS_NEW) {
+        phys_retire(*e);
+        *e = phys_alloc();
+        map_dirty[pn / SHADOW_MAP_ENTRIES] = true;
+    }
+    ppn = *e;
+    shadow_dirty = true;
+    pthread_mutex_unlock(&shadow_lock);
+    return ppn;
+}
+
+
+/* Makes the writes since the last commit part of the table.
+ * The map pages that changed and the map root go to free pages,
+ * and once they and the tree pages are on disk the header page
+ * is swapped.  Called by every write operation, db_latch held.
+ */
+void shadow_commit(void) {
+    uint32_t i, j;
+
+    if (!shadow_on)
+        return;
+    pthread_mutex_lock(&shadow_lock);
+    if (!shadow_dirty) {
+        pthread_mutex_unlock(&shadow_lock);
+        return;
+    }
+    for (j = 0; j < map_cnt; j++)
+        if (map_dirty[j]) {
+            phys_retire(map_phys[j]);
+            map_phys[j] = phys_alloc();
+            phys_write(map_phys[j], map_pages[j]);
+            map_dirty[j] = false;
+        }
+    phys_retire(map_root);
+    map_root = phys_alloc();
+    phys_write(map_root, map_phys);
+    fdatasync(fileno(fp_db));
+
+    shadow_hdr.mpn = (int)map_root;
+    phys_write(0, &shadow_hdr);
+    fdatasync(fileno(fp_db));
+
+    shadow_epoch++;
+    for (i = 0; i < txn_new.cnt; i++)
+        phys_state[txn_new.pn[i]] = PHYS_LIVE;
+    for (i = 0; i < txn_old.cnt; i++) {
+        phys_state[txn_old.pn[i]] = PHYS_RETIRED;
+        if (retired_cnt == retired_cap) {
+            retired_cap = retired_cap ? retired_cap * 2 : 64;
+            retired = shadow_alloc(retired, retired_cap * sizeof(retired_page));
+        }
+        retired[retired_cnt].pn = txn_old.pn[i];
+        retired[retired_cnt++].epoch = shadow_epoch;
+    }
+    txn_new.cnt = txn_old.cnt = 0;
+    shadow_dirty = false;
+    shadow_reclaim();
+    pthread_mutex_unlock(&shadow_lock);
+    stats_inc(STAT_COMMIT);
+}
+
+
+/* Turns shadow paging on for the opened table.  Every page
+ * starts out mapped to itself; the first commit writes the
+ * map.  Returns 0, or -1 if the table is logged.
+ */
+int db_enable_shadow(void) {
+    HeaderPage hp;
+    uint32_t pn;
+
+    if (wal_on)
+        return -1;
+    pthread_rwlock_wrlock(&db_latch);
+    if (!shadow_on) {
+        file_read_page(0, (page_t *)&hp);
+        shadow_tables();
+        phys_cnt = hp.pcnt;
+        phys_reserve(phys_cnt);
+        for (pn = 0; pn < phys_cnt; pn++)
+            phys_state[pn] = PHYS_LIVE;
+        for (pn = 1; pn < phys_cnt; pn++)
+            *map_entry(pn) = pn;
+        hp.flags |= HDR_SHADOW;
+        shadow_write_header((page_t *)&hp);
+        shadow_on = true;
+        shadow_commit();
+    }
+    pthread_rwlock_unlock(&db_latch);
+    return 0;
+}
+
+
+/* Opens a snapshot of the table as of the last commit.
+ * Returns NULL if the table is not shadow paged.
+ */
+db_snapshot * db_snapshot_open(void) {
+    db_snapshot * snap;
+
+    if (!shadow_on)
+        return NULL;
+    snap = shadow_alloc(NULL, sizeof(db_snapshot));
+    snap->dir = shadow_alloc(NULL, page_size);
+    snap->map = shadow_alloc(NULL, page_size);
+    snap->map_idx = -1;
+
+    // Snapshots read leaves only, so buffers are flushed first.
+    buf_scan_lock();
+    pthread_mutex_lock(&shadow_lock);
+    snap->epoch = shadow_epoch;
+    snap->rpn = shadow_hdr.rpn;
+    memcpy(snap->dir, map_phys, page_size);
+    snap->next = snapshots;
+    snapshots = snap;
+    pthread_mutex_unlock(&shadow_lock);
+    pthread_rwlock_unlock(&db_latch);
+    return snap;
+}
+
+
+// Reads logical page pn as of the snapshot.
+static void snapshot_read(db_snapshot * snap, pagenum_t pn, page_t * dest) {
+    int64_t j = pn / SHADOW_MAP_ENTRIES;
+
+    if (snap->map_idx != j) {
+        phys_read(snap->dir[j], snap->map);
+        snap->map_idx = j;
+    }
+    phys_read(snap->map[pn % SHADOW_MAP_ENTRIES], dest);
+}
+
+
+/* Looks key up as of the snapshot, without taking db_latch.
+ * A snapshot is used by one thread at a time.
+ * Copies its value to value and returns 0, or returns -1.
+ */
+int db_snapshot_find(db_snapshot * snap, int64_t key, char * value) {
+    page_t page;
+    InternalPage * ip = (InternalPage *)&page;
+    LeafPage * lp = (LeafPage *)&page;
+    int i;
+
+    if (snap->rpn == 0 || key < INT_MIN || key > INT_MAX)
+        return -1;
+    snapshot_read(snap, snap->rpn, &page);
+    while (!ip->is_leaf) {
+        i = intl_child_index(ip, (int)key);
+        snapshot_read(snap, i == 0 ? ip->lspn : ip->records[i - 1].pn, &page);
+    }
+    if ((i = leaf_key_index(lp, (int)key)) < 0)
+        return -1;
+    strcpy(value, lp->records[i].value);
+    return 0;
+}
+
+
+// Closes a snapshot, letting the pages only it reached be reused.
+void db_snapshot_close(db_snapshot * snap) {
+    db_snapshot ** pp;
+
+    if (snap == NULL)
+        return;
+    pthread_mutex_lock(&shadow_lock);
+    for (pp = &snapshots; *pp != NULL; pp = &(*pp)->next)
+        if (*pp == snap) {
+            *pp = snap->next;
+            break;
+        }
+    shadow_reclaim();
+    pthread_mutex_unlock(&shadow_lock);
+    free(snap->dir);
+    free(snap->map);
+    free(snap);
+}
@@ -0,0 +1,178 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  stats.c
+ *
+ *    Description:  Engine statistics counters.
+ *                  Counters are kept per thread and summed on demand.
+ *                  A reset records the current sums as a baseline, so
+ *                  it never races with the threads that count.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <pthread.h>
+#include <string.h>
+#include "stats.h"
+
+__thread stats_block * stats_tls = NULL;
+
+// Every block ever registered. Blocks of exited threads are reused.
+static stats_block * stats_blocks = NULL;
+static pthread_mutex_t stats_latch = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+// Sums at the last reset.
+static db_stats stats_base;
+
+static int stats_height = -1;
+
+static const char * stats_names[STAT_COUNT] = {
+    "page_read", "page_write", "cache_hit", "cache_miss",
+    "page_alloc", "page_free", "freelist_hit", "file_extend",
+    "leaf_split", "intl_split", "new_root", "merge", "redistribute",
+    "find", "insert", "delete", "ahi_hit", "ahi_promote",
+    "commit", "page_recycle", "log_record", "checkpoint", "update",
+    "buf_flush", "ingest_merge", "append_fast", "compact_merge",
+    "compact_even", "leaf_hit", "leaf_miss", "cache_promote"
+};
+
+
+// Called when a thread exits. Its counts stay in the block.
+static void stats_release(void * arg) {
+    stats_block * b = (stats_block *)arg;
+    pthread_mutex_lock(&stats_latch);
+    b->in_use = false;
+    pthread_mutex_unlock(&stats_latch);
+}
+
+
+static void stats_init(void) {
+    pthread_key_create(&stats_key, stats_release);
+}
+
+
+/* Gives the calling thread a block, reusing the
+ * block of an exited thread when there is one.
+ */
+stats_block * stats_register(void) {
+    stats_block * b;
+
+    pthread_once(&stats_once, stats_init);
+    pthread_mutex_lock(&stats_latch);
+    for (b = stats_blocks; b != NULL; b = b->next)
+        if (!b->in_use) break;
+    if (b == NULL) {
+        b = calloc(1, sizeof(stats_block));
+        if (b == NULL) {
+            perror("Statistics block.");
+            exit(EXIT_FAILURE);
+        }
+        b->next = stats_blocks;
+        stats_blocks = b;
+    }
+    b->in_use = true;
+    b->cascade = 0;
+    pthread_mutex_unlock(&stats_latch);
+
+    pthread_setspecific(stats_key, b);
+    stats_tls = b;
+    return b;
+}
+
+
+/* Counts a split.  A split cascade always starts
+ * at a leaf and goes up one level per internal split,
+ * so the level is tracked without reading any page.
+ */
+void stats_split(bool is_leaf) {
+    stats_block * b = stats_tls;
+    int level;
+
+    if (b == NULL)
+        b = stats_register();
+    level = is_leaf ? 0 : b->cascade + 1;
+    b->cascade = level;
+    b->c[is_leaf ? STAT_LEAF_SPLIT : STAT_INTL_SPLIT]++;
+    b->split[level < STATS_MAX_LEVEL ? level : STATS_MAX_LEVEL - 1]++;
+}
+
+
+void stats_set_height(int height) {
+    stats_height = height;
+}
+
+
+// Sums every block, without the baseline.
+static void stats_sum(db_stats * st) {
+    stats_block * b;
+    int i;
+
+    memset(st, 0, sizeof(db_stats));
+    pthread_mutex_lock(&stats_latch);
+    for (b = stats_blocks; b != NULL; b = b->next) {
+        for (i = 0; i < STAT_COUNT; i++)
+            st->c[i] += b->c[i];
+        for (i = 0; i < STATS_MAX_LEVEL; i++)
+            st->split[i] += b->split[i];
+    }
+    pthread_mutex_unlock(&stats_latch);
+}
+
+
+/* Fills st with the counts since the last reset.
+ */
+void db_stats_snapshot(db_stats * st) {
+    int i;
+
+    stats_sum(st);
+    pthread_mutex_lock(&stats_latch);
+    for (i = 0; i < STAT_COUNT; i++)
+        st->c[i] -= stats_base.c[i];
+    for (i = 0; i < STATS_MAX_LEVEL; i++)
+        st->split[i] -= stats_base.split[i];
+    pthread_mutex_unlock(&stats_latch);
+    st->height = stats_height;
+}
+
+
+void db_stats_reset(void) {
+    db_stats now;
+    stats_sum(&now);
+    pthread_mutex_lock(&stats_latch);
+    stats_base = now;
+    pthread_mutex_unlock(&stats_latch);
+}
+
+
+const char * db_stats_name(enum stats_counter c) {
+    return c < STAT_COUNT ? stats_names[c] : "unknown";
+}
+
+
+void db_stats_print(FILE * out, const db_stats * st) {
+    uint64_t lookups;
+    int i;
+
+    for (i = 0; i < STAT_COUNT; i++)
+        fprintf(out, "%-14s %llu\n", stats_names[i], (unsigned long long)st->c[i]);
+    lookups = st->c[STAT_CACHE_HIT] + st->c[STAT_CACHE_MISS];
+    if (lookups)
+        fprintf(out, "%-14s %.2f%%\n", "cache_hit_pct",
+                st->c[STAT_CACHE_HIT] * 100.0 / lookups);
+    lookups = st->c[STAT_LEAF_HIT] + st->c[STAT_LEAF_MISS];
+    if (lookups)
+        fprintf(out, "%-14s %.2f%%\n", "leaf_hit_pct",
+                st->c[STAT_LEAF_HIT] * 100.0 / lookups);
+    fprintf(out, "%-14s", "split_level");
+    for (i = 0; i < STATS_MAX_LEVEL; i++)
+        fprintf(out, " %llu", (unsigned long long)st->split[i]);
+    fprintf(out, "\n%-14s %d\n", "height", st->height);
+}
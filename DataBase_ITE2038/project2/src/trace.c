@@ -0,0 +1,185 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  trace.c
+ *
+ *    Description:  Sampled per-query I/O tracing into a lock-free
+ *                  ring buffer, dumped in Chrome trace event format.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <string.h>
+#include "trace.h"
+#include "hist.h"
+
+typedef struct trace_rec {
+    uint64_t seq;           // slot index + 1 once the record is complete
+    uint64_t ts;            // ns, monotonic
+    uint64_t dur;           // ns, 0 for instant events
+    int64_t key;
+    uint32_t op_id;
+    uint32_t tid;
+    uint8_t type;
+    uint8_t src;
+    const char * name;      // operation name, static storage
+} trace_rec;
+
+uint32_t trace_sample = 0;
+__thread bool trace_active = false;
+
+static trace_rec trace_ring[TRACE_RING];
+static uint64_t trace_head = 0;
+static uint32_t trace_next_op = 0;
+static uint32_t trace_next_tid = 0;
+
+// State of the operation the calling thread is running.
+static __thread uint32_t trace_tid = 0;
+static __thread uint32_t trace_calls = 0;
+static __thread int trace_depth = 0;
+static __thread uint32_t trace_op_id;
+static __thread uint64_t trace_op_t0;
+static __thread int64_t trace_op_key;
+static __thread const char * trace_op_name;
+
+static const char * trace_names[] = {
+    "op", "read", "write", "split", "merge", "new_root"
+};
+
+
+/* Claims a slot and fills it.  The slot is marked
+ * incomplete while it is written so a concurrent dump
+ * skips it instead of printing a torn record.
+ */
+static void trace_put(enum trace_type type, const char * name, int64_t key,
+        enum trace_src src, uint64_t ts, uint64_t dur) {
+    uint64_t idx = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    trace_rec * r = &trace_ring[idx % TRACE_RING];
+
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->ts = ts;
+    r->dur = dur;
+    r->key = key;
+    r->op_id = trace_op_id;
+    r->tid = trace_tid;
+    r->type = type;
+    r->src = src;
+    r->name = name;
+    __atomic_store_n(&r->seq, idx + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Starts an operation.  Nested calls (db_insert runs
+ * db_find) belong to the outermost operation.
+ */
+void trace_op_begin(const char * name, int64_t key) {
+    uint32_t every = trace_sample;
+
+    if (trace_depth++ > 0 || every == 0)
+        return;
+    if (++trace_calls % every != 0)
+        return;
+    if (trace_tid == 0)
+        trace_tid = __atomic_add_fetch(&trace_next_tid, 1, __ATOMIC_RELAXED);
+    trace_op_id = __atomic_add_fetch(&trace_next_op, 1, __ATOMIC_RELAXED);
+    trace_op_name = name;
+    trace_op_key = key;
+    trace_op_t0 = hist_now();
+    trace_active = true;
+}
+
+
+void trace_op_end(void) {
+    if (--trace_depth > 0 || !trace_active)
+        return;
+    trace_put(TRACE_OP, trace_op_name, trace_op_key, TRACE_DISK,
+            trace_op_t0, hist_now() - trace_op_t0);
+    trace_active = false;
+}
+
+
+// Records a page access of the running sampled operation.
+void trace_page(enum trace_type type, uint64_t pn, enum trace_src src,
+        uint64_t t0, uint64_t t1) {
+    if (!trace_active)
+        return;
+    trace_put(type, trace_names[type], (int64_t)pn, src, t0, t1 - t0);
+}
+
+
+// Records a structural change made by the running sampled operation.
+void trace_event(enum trace_type type, uint64_t pn) {
+    if (!trace_active)
+        return;
+    trace_put(type, trace_names[type], (int64_t)pn, TRACE_DISK, hist_now(), 0);
+}
+
+
+void db_trace_enable(uint32_t sample_every) {
+    trace_sample = sample_every;
+}
+
+
+void db_trace_clear(void) {
+    int i;
+    for (i = 0; i < TRACE_RING; i++)
+        __atomic_store_n(&trace_ring[i].seq, 0, __ATOMIC_RELAXED);
+}
+
+
+/* Writes the buffered events, oldest first, as a
+ * Chrome trace JSON object.  Operations and page accesses
+ * are complete ("X") events, splits and merges instant
+ * ("i") events; all carry the operation id in args.
+ */
+void db_trace_dump(FILE * out) {
+    uint64_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint64_t idx, start, base = 0;
+    trace_rec r;
+    bool first = true;
+
+    start = head > TRACE_RING ? head - TRACE_RING : 0;
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    for (idx = start; idx < head; idx++) {
+        r = trace_ring[idx % TRACE_RING];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&trace_ring[idx % TRACE_RING].seq, __ATOMIC_RELAXED) != idx + 1
+                || r.seq != idx + 1)
+            continue;
+        if (base == 0 || r.ts < base)
+            base = r.ts;
+    }
+    for (idx = start; idx < head; idx++) {
+        r = trace_ring[idx % TRACE_RING];
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&trace_ring[idx % TRACE_RING].seq, __ATOMIC_RELAXED) != idx + 1
+                || r.seq != idx + 1)
+            continue;
+        fprintf(out, "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"%s\", "
+                "\"ts\": %.3f, ", first ? "" : ",", r.name,
+                r.type == TRACE_OP ? "op" : "page",
+                r.type <= TRACE_PAGE_WRITE ? "X" : "i", (r.ts - base) / 1e3);
+        if (r.type <= TRACE_PAGE_WRITE)
+            fprintf(out, "\"dur\": %.3f, ", r.dur / 1e3);
+        else
+            fprintf(out, "\"s\": \"t\", ");
+        fprintf(out, "\"pid\": 1, \"tid\": %u, \"args\": {\"op\": %u, ",
+                r.tid, r.op_id);
+        if (r.type == TRACE_OP)
+            fprintf(out, "\"key\": %lld}}", (long long)r.key);
+        else if (r.type == TRACE_PAGE_READ || r.type == TRACE_PAGE_WRITE)
+            fprintf(out, "\"pn\": %lld, \"src\": \"%s\"}}", (long long)r.key,
+                    r.src == TRACE_CACHE ? "cache" : "disk");
+        else
+            fprintf(out, "\"pn\": %lld}}", (long long)r.key);
+        first = false;
+    }
+    fprintf(out, "\n]}\n");
+}
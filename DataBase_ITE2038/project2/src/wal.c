@@ -0,0 +1,696 @@
+/*
+ * =====================================================================================
+ *
+ *       Filename:  wal.c
+ *
+ *    Description:  Page image write-ahead log, the dirty page table,
+ *                  the background checkpointer and recovery.
+ *
+ *                  wal_lock guards the log buffer, the LSNs and the
+ *                  dirty page table.  ckpt_lock lets one checkpoint
+ *                  run at a time.  The checkpointer takes the shared
+ *                  db_latch while copying pages out, so the copies
+ *                  only hold committed writes.
+ *
+ *        Version:  1.0
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Joonho Wohn
+ *   Organization:
+ *
+ * =====================================================================================
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "wal.h"
+#include "bpt.h"
+#include "shadow.h"
+#include "stats.h"
+#include "ingest.h"
+
+// Log record header.  A page image of len bytes follows.
+typedef struct wal_rec {
+    uint64_t lsn;           // byte position in the log
+    uint32_t pn;            // page, or WAL_COMMIT / WAL_SKIP / WAL_INGEST
+    uint32_t len;
+    uint32_t sum;
+    uint32_t rsvd;
+} wal_rec;
+
+#define WAL_COMMIT 0xffffffffu
+#define WAL_SKIP   0xfffffffeu     // rest of the segment is unused
+#define WAL_INGEST 0xfffffffdu     // an ingest tier entry, a buf_msg
+
+typedef struct dirty_page {
+    pagenum_t pn;
+    char * page;
+    uint64_t rec_lsn;           // first record since the page was clean
+    uint64_t lsn;               // last record
+    uint64_t next_rec_lsn;      // first record since the copy being written
+    bool flushing;
+    struct dirty_page * hnext;
+} dirty_page;
+
+typedef struct ckpt_cand {
+    pagenum_t pn;
+    uint64_t rec_lsn;
+} ckpt_cand;
+
+bool wal_on = false;
+
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t ckpt_thread;
+static bool ckpt_running = false;
+static bool ckpt_stop = false;
+
+static char wal_path[4096];
+static int seg_fd = -1;
+static uint64_t seg_no = 0;
+
+static char * log_buf = NULL;
+static size_t log_len = 0, log_cap = 0;
+static uint64_t next_lsn = 0;       // position of the next record
+static uint64_t durable_lsn = 0;    // end of the last commit
+static uint64_t ckpt_lsn = 0;       // HeaderPage.clsn on disk
+static uint64_t hold_lsn = UINT64_MAX;  // oldest entry the ingest tier keeps
+
+static dirty_page ** dirty_hash = NULL;
+static int dirty_bits = 0;
+static uint64_t dirty_cnt = 0;
+
+static double recovery_secs = WAL_DEFAULT_RECOVERY_SECS;
+static double write_rate = WAL_DEFAULT_WRITE_RATE;
+
+
+static uint32_t wal_sum(const wal_rec * h, const void * image) {
+    const unsigned char * p = image;
+    uint32_t s = 2166136261u;
+    uint32_t i;
+
+    s = (s ^ (uint32_t)h->lsn) * 16777619u;
+    s = (s ^ (uint32_t)(h->lsn >> 32)) * 16777619u;
+    s = (s ^ h->pn) * 16777619u;
+    s = (s ^ h->len) * 16777619u;
+    for (i = 0; i < h->len; i++)
+        s = (s ^ p[i]) * 16777619u;
+    return s;
+}
+
+
+static void seg_name(char * buf, uint64_t no) {
+    snprintf(buf, 4200, "%s.wal.%06llu", wal_path, (unsigned long long)no);
+}
+
+
+// Descriptor of segment no for appending.
+static int seg_open(uint64_t no) {
+    char path[4200];
+
+    if (seg_fd >= 0 && seg_no == no)
+        return seg_fd;
+    if (seg_fd >= 0) {
+        fdatasync(seg_fd);
+        close(seg_fd);
+    }
+    seg_name(path, no);
+    if ((seg_fd = open(path, O_RDWR | O_CREAT, 0644)) < 0) {
+        perror("Log segment.");
+        exit(EXIT_FAILURE);
+    }
+    seg_no = no;
+    return seg_fd;
+}
+
+
+// Removes the segments numbered from first up to, not including, last.
+static void seg_remove(uint64_t first, uint64_t last) {
+    char path[4200];
+
+    for (; first < last; first++) {
+        seg_name(path, first);
+        unlink(path);
+    }
+}
+
+
+// Removes every segment at the table path, whatever its number.
+static void seg_remove_all(void) {
+    char dir[4096], base[4096], path[8200];
+    struct dirent * e;
+    size_t len;
+    DIR * dp;
+
+    snprintf(dir, sizeof(dir), "%s", wal_path);
+    snprintf(base, sizeof(base), "%s.wal.", basename(dir));
+    snprintf(dir, sizeof(dir), "%s", wal_path);
+    if ((dp = opendir(dirname(dir))) == NULL)
+        return;
+    len = strlen(base);
+    while ((e = readdir(dp)) != NULL)
+        if (strncmp(e->d_name, base, len) == 0) {
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+            unlink(path);
+        }
+    closedir(dp);
+}
+
+
+static uint64_t wal_budget(void) {
+    return (uint64_t)(recovery_secs * write_rate);
+}
+
+
+static void log_put(uint64_t lsn, uint32_t pn, const void * image, uint32_t len) {
+    wal_rec h;
+
+    if (log_len + sizeof(wal_rec) + len > log_cap) {
+        log_cap = log_cap ? log_cap * 2 : (size_t)16 * MAX_PAGE_SIZE;
+        while (log_len + sizeof(wal_rec) + len > log_cap)
+            log_cap *= 2;
+        if ((log_buf = realloc(log_buf, log_cap)) == NULL) {
+            perror("Log buffer.");
+            exit(EXIT_FAILURE);
+        }
+    }
+    h.lsn = lsn;
+    h.pn = pn;
+    h.len = len;
+    h.rsvd = 0;
+    h.sum = wal_sum(&h, image);
+    memcpy(log_buf + log_len, &h, sizeof(wal_rec));
+    if (len > 0)
+        memcpy(log_buf + log_len + sizeof(wal_rec), image, len);
+    log_len += sizeof(wal_rec) + len;
+}
+
+
+/* Appends a record to the log buffer.  Records do not cross
+ * segments.  Returns its LSN.  The caller holds wal_lock.
+ */
+static uint64_t log_append(uint32_t pn, const void * image, uint32_t len) {
+    uint64_t room = WAL_SEGMENT_SIZE - next_lsn % WAL_SEGMENT_SIZE, lsn;
+
+    if (sizeof(wal_rec) + len > room) {
+        if (room >= sizeof(wal_rec))
+            log_put(next_lsn, WAL_SKIP, NULL, 0);
+        next_lsn += room;
+    }
+    lsn = next_lsn;
+    log_put(lsn, pn, image, len);
+    next_lsn += sizeof(wal_rec) + len;
+    stats_inc(STAT_LOG_RECORD);
+    return lsn;
+}
+
+
+// Writes the log buffer out and syncs it.  The caller holds wal_lock.
+static void log_flush(void) {
+    size_t off = 0, size;
+    wal_rec * h;
+
+    while (off < log_len) {
+        h = (wal_rec *)(log_buf + off);
+        size = sizeof(wal_rec) + h->len;
+        pwrite(seg_open(h->lsn / WAL_SEGMENT_SIZE), h, size,
+                (off_t)(h->lsn % WAL_SEGMENT_SIZE));
+        off += size;
+    }
+    fdatasync(seg_fd);
+    log_len = 0;
+}
+
+
+static inline uint64_t dirty_slot(pagenum_t pn) {
+    return (pn * 0x9E3779B97F4A7C15ull) >> (64 - dirty_bits);
+}
+
+
+static dirty_page * dirty_lookup(pagenum_t pn) {
+    dirty_page * d;
+    if (dirty_hash == NULL)
+        return NULL;
+    for (d = dirty_hash[dirty_slot(pn)]; d != NULL; d = d->hnext)
+        if (d->pn == pn)
+            return d;
+    return NULL;
+}
+
+
+static dirty_page * dirty_add(pagenum_t pn) {
+    dirty_page ** old = dirty_hash, * d, * next;
+    uint64_t i, old_size = dirty_hash ? (uint64_t)1 << dirty_bits : 0;
+
+    if (dirty_hash == NULL || dirty_cnt >= old_size) {
+        dirty_bits = dirty_bits ? dirty_bits + 1 : 8;
+        if ((dirty_hash = calloc((size_t)1 << dirty_bits, sizeof(dirty_page *))) == NULL) {
+            perror("Dirty page table.");
+            exit(EXIT_FAILURE);
+        }
+        for (i = 0; i < old_size; i++)
+            for (d = old[i]; d != NULL; d = next) {
+                next = d->hnext;
+                d->hnext = dirty_hash[dirty_slot(d->pn)];
+                dirty_hash[dirty_slot(d->pn)] = d;
+            }
+        free(old);
+    }
+    if ((d = calloc(1, sizeof(dirty_page))) == NULL
+            || (d->page = malloc(page_size)) == NULL) {
+        perror("Dirty page table.");
+        exit(EXIT_FAILURE);
+    }
+    d->pn = pn;
+    d->hnext = dirty_hash[dirty_slot(pn)];
+    dirty_hash[dirty_slot(pn)] = d;
+    dirty_cnt++;
+    return d;
+}
+
+
+static void dirty_remove(dirty_page * d) {
+    dirty_page ** pp;
+
+    for (pp = &dirty_hash[dirty_slot(d->pn)]; *pp != NULL; pp = &(*pp)->hnext)
+        if (*pp == d) {
+            *pp = d->hnext;
+            break;
+        }
+    free(d->page);
+    free(d);
+    dirty_cnt--;
+}
+
+
+// Copies page pn to dest if it is dirty.
+bool wal_read(pagenum_t pn, page_t * dest) {
+    dirty_page * d;
+
+    pthread_mutex_lock(&wal_lock);
+    if ((d = dirty_lookup(pn)) != NULL)
+        memcpy(dest, d->page, page_size);
+    pthread_mutex_unlock(&wal_lock);
+    return d != NULL;
+}
+
+
+// Logs a page image and keeps the page dirty.
+void wal_write(pagenum_t pn, const page_t * src) {
+    dirty_page * d;
+    uint64_t lsn;
+
+    pthread_mutex_lock(&wal_lock);
+    lsn = log_append((uint32_t)pn, src, page_size);
+    if ((d = dirty_lookup(pn)) == NULL) {
+        d = dirty_add(pn);
+        d->rec_lsn = lsn;
+    } else if (d->flushing && d->next_rec_lsn == 0)
+        d->next_rec_lsn = lsn;
+    memcpy(d->page, src, page_size);
+    d->lsn = lsn;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+
+/* Logs an ingest tier entry of len bytes, to be committed by
+ * the caller, and returns its LSN.  The first entry after the
+ * tier went empty holds the log from its LSN on.
+ */
+uint64_t wal_log(const void * rec, uint32_t len) {
+    uint64_t lsn;
+
+    pthread_mutex_lock(&wal_lock);
+    lsn = log_append(WAL_INGEST, rec, len);
+    if (hold_lsn == UINT64_MAX)
+        hold_lsn = lsn;
+    pthread_mutex_unlock(&wal_lock);
+    return lsn;
+}
+
+
+/* Keeps the log from lsn on, for the entries of the ingest
+ * tier still unmerged; UINT64_MAX keeps nothing.
+ */
+void wal_hold(uint64_t lsn) {
+    pthread_mutex_lock(&wal_lock);
+    hold_lsn = lsn;
+    pthread_mutex_unlock(&wal_lock);
+}
+
+
+/* Ends a write operation with a commit record and syncs the log.
+ * Wakes the checkpointer once the log runs past half the budget.
+ */
+void wal_commit(void) {
+    pthread_mutex_lock(&wal_lock);
+    if (log_len > 0) {
+        log_append(WAL_COMMIT, NULL, 0);
+        log_flush();
+        durable_lsn = next_lsn;
+        if (durable_lsn - ckpt_lsn > wal_budget() / 2)
+            pthread_cond_signal(&wal_cond);
+        stats_inc(STAT_COMMIT);
+    }
+    pthread_mutex_unlock(&wal_lock);
+}
+
+
+static int cand_cmp(const void * a, const void * b) {
+    uint64_t x = ((const ckpt_cand *)a)->rec_lsn, y = ((const ckpt_cand *)b)->rec_lsn;
+    return x < y ? -1 : x > y;
+}
+
+
+static double wal_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Writes back the dirty pages first dirtied below the point the
+ * budget allows, or all of them when full, then moves clsn up to
+ * the oldest record still needed, a page's or an unmerged ingest
+ * entry's, and removes older segments.
+ */
+static void wal_checkpoint(bool full) {
+    ckpt_cand * cand = NULL;
+    pagenum_t pns[WAL_CKPT_BATCH];
+    uint64_t lsns[WAL_CKPT_BATCH], limit, clsn, i, n = 0, cap = 0, bytes = 0;
+    char * buf;
+    dirty_page * d;
+    double t0 = wal_now(), t;
+    int j, m;
+
+    if ((buf = malloc((size_t)WAL_CKPT_BATCH * page_size)) == NULL) {
+        perror("Checkpoint.");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_lock(&ckpt_lock);
+    pthread_mutex_lock(&wal_lock);
+    limit = full ? UINT64_MAX
+        : durable_lsn > wal_budget() / 2 ? durable_lsn - wal_budget() / 2 : 0;
+    for (i = 0; dirty_hash != NULL && i < ((uint64_t)1 << dirty_bits); i++)
+        for (d = dirty_hash[i]; d != NULL; d = d->hnext)
+            if (d->rec_lsn < limit) {
+                if (n == cap) {
+                    cap = cap ? cap * 2 : 256;
+                    if ((cand = realloc(cand, cap * sizeof(ckpt_cand))) == NULL) {
+                        perror("Checkpoint.");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                cand[n].pn = d->pn;
+                cand[n++].rec_lsn = d->rec_lsn;
+            }
+    pthread_mutex_unlock(&wal_lock);
+    if (n > 1)
+        qsort(cand, n, sizeof(ckpt_cand), cand_cmp);
+
+    for (i = 0; i < n; i += WAL_CKPT_BATCH) {
+        // Copy a batch out between write operations.
+        pthread_rwlock_rdlock(&db_latch);
+        pthread_mutex_lock(&wal_lock);
+        for (m = 0, j = 0; j < WAL_CKPT_BATCH && i + j < n; j++) {
+            if ((d = dirty_lookup(cand[i + j].pn)) == NULL)
+                continue;
+            memcpy(buf + (size_t)m * page_size, d->page, page_size);
+            // The header page on disk keeps its checkpoint LSN.
+            if (d->pn == 0)
+                ((HeaderPage *)(buf + (size_t)m * page_size))->clsn = ckpt_lsn;
+            d->flushing = true;
+            d->next_rec_lsn = 0;
+            pns[m] = d->pn;
+            lsns[m++] = d->lsn;
+        }
+        pthread_mutex_unlock(&wal_lock);
+        pthread_rwlock_unlock(&db_latch);
+
+        for (j = 0; j < m; j++)
+            pwrite(fileno(fp_db), buf + (size_t)j * page_size, page_size,
+                    (off_t)(pns[j] * page_size));
+        stats_add(STAT_PAGE_WRITE, m);
+        bytes += (uint64_t)m * page_size;
+
+        pthread_mutex_lock(&wal_lock);
+        for (j = 0; j < m; j++) {
+            d = dirty_lookup(pns[j]);
+            if (d->lsn == lsns[j])
+                dirty_remove(d);
+            else {
+                d->rec_lsn = d->next_rec_lsn;
+                d->flushing = false;
+                d->next_rec_lsn = 0;
+            }
+        }
+        pthread_mutex_unlock(&wal_lock);
+    }
+    fdatasync(fileno(fp_db));
+    if (bytes > 0 && (t = wal_now() - t0) > 0)
+        write_rate = 0.8 * write_rate + 0.2 * (bytes / t);
+
+    pthread_mutex_lock(&wal_lock);
+    clsn = hold_lsn < durable_lsn ? hold_lsn : durable_lsn;
+    for (i = 0; dirty_hash != NULL && i < ((uint64_t)1 << dirty_bits); i++)
+        for (d = dirty_hash[i]; d != NULL; d = d->hnext)
+            if (d->rec_lsn < clsn)
+                clsn = d->rec_lsn;
+    pthread_mutex_unlock(&wal_lock);
+
+    if (clsn > ckpt_lsn) {
+        pwrite(fileno(fp_db), &clsn, sizeof(uint64_t), offsetof(HeaderPage, clsn));
+        fdatasync(fileno(fp_db));
+        seg_remove(ckpt_lsn / WAL_SEGMENT_SIZE, clsn / WAL_SEGMENT_SIZE);
+        pthread_mutex_lock(&wal_lock);
+        ckpt_lsn = clsn;
+        pthread_mutex_unlock(&wal_lock);
+        stats_inc(STAT_CHECKPOINT);
+    }
+    pthread_mutex_unlock(&ckpt_lock);
+    free(cand);
+    free(buf);
+}
+
+
+static void * wal_checkpointer(void * arg) {
+    struct timespec ts;
+
+    (void)arg;
+    pthread_mutex_lock(&wal_lock);
+    while (!ckpt_stop) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += WAL_CKPT_TICK_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&wal_cond, &wal_lock, &ts);
+        if (ckpt_stop)
+            break;
+        pthread_mutex_unlock(&wal_lock);
+        wal_checkpoint(false);
+        pthread_mutex_lock(&wal_lock);
+    }
+    pthread_mutex_unlock(&wal_lock);
+    return NULL;
+}
+
+
+static void wal_start(void) {
+    ckpt_stop = false;
+    if (pthread_create(&ckpt_thread, NULL, wal_checkpointer, NULL) != 0) {
+        perror("Checkpointer.");
+        exit(EXIT_FAILURE);
+    }
+    ckpt_running = true;
+}
+
+
+/* Replays the committed records from HeaderPage.clsn, drops
+ * whatever follows the last commit and checkpoints the result.
+ * Committed ingest entries go back to the ingest tier, and the
+ * log is kept from the operation of the first one on.
+ */
+static void wal_recover(void) {
+    char path[4200];
+    wal_rec h;
+    char * images = NULL;
+    pagenum_t * pns = NULL;
+    uint64_t lsn, end, room, no, fd_no = UINT64_MAX, op_lsn, keep = UINT64_MAX;
+    size_t n = 0, cap = 0, i;
+    int fd = -1;
+
+    pread(fileno(fp_db), &lsn, sizeof(uint64_t), offsetof(HeaderPage, clsn));
+    ckpt_lsn = end = op_lsn = lsn;
+    for (;;) {
+        room = WAL_SEGMENT_SIZE - lsn % WAL_SEGMENT_SIZE;
+        if (room < sizeof(wal_rec)) {
+            lsn += room;
+            continue;
+        }
+        if ((no = lsn / WAL_SEGMENT_SIZE) != fd_no) {
+            if (fd >= 0)
+                close(fd);
+            seg_name(path, no);
+            fd_no = no;
+            if ((fd = open(path, O_RDONLY)) < 0)
+                break;
+        }
+        if (pread(fd, &h, sizeof(wal_rec), (off_t)(lsn % WAL_SEGMENT_SIZE)) != sizeof(wal_rec)
+                || h.lsn != lsn || h.len > page_size || sizeof(wal_rec) + h.len > room)
+            break;
+        if (h.pn == WAL_SKIP) {
+            lsn += room;
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            pns = realloc(pns, cap * sizeof(pagenum_t));
+            images = realloc(images, cap * page_size);
+            if (pns == NULL || images == NULL) {
+                perror("Recovery.");
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (pread(fd, images + n * page_size, h.len,
+                    (off_t)(lsn % WAL_SEGMENT_SIZE + sizeof(wal_rec))) != h.len
+                || wal_sum(&h, images + n * page_size) != h.sum)
+            break;
+        lsn += sizeof(wal_rec) + h.len;
+        if (h.pn == WAL_COMMIT) {
+            for (i = 0; i < n; i++)
+                if (pns[i] != WAL_INGEST) {
+                    pwrite(fileno(fp_db), images + i * page_size, page_size,
+                            (off_t)(pns[i] * page_size));
+                    stats_inc(STAT_PAGE_WRITE);
+                } else {
+                    ingest_replay((buf_msg *)(images + i * page_size), op_lsn);
+                    if (keep == UINT64_MAX)
+                        keep = op_lsn;
+                }
+            n = 0;
+            end = op_lsn = lsn;
+        } else
+            pns[n++] = h.pn;
+    }
+    if (fd >= 0)
+        close(fd);
+    free(images);
+    free(pns);
+    fdatasync(fileno(fp_db));
+
+    // Records of an operation that did not commit are dropped.
+    no = end / WAL_SEGMENT_SIZE;
+    seg_name(path, no);
+    truncate(path, (off_t)(end % WAL_SEGMENT_SIZE));
+    for (no++; seg_name(path, no), unlink(path) == 0; no++)
+        ;
+    hold_lsn = keep;
+    if (keep > end)
+        keep = end;
+    pwrite(fileno(fp_db), &keep, sizeof(uint64_t), offsetof(HeaderPage, clsn));
+    fdatasync(fileno(fp_db));
+    seg_remove(ckpt_lsn / WAL_SEGMENT_SIZE, keep / WAL_SEGMENT_SIZE);
+    next_lsn = durable_lsn = end;
+    ckpt_lsn = keep;
+}
+
+
+/* Stops the checkpointer after a last checkpoint, and drops the
+ * state of the previous table.  Called before another is opened.
+ */
+void wal_reset(void) {
+    uint64_t i;
+    dirty_page * d, * next;
+
+    if (ckpt_running) {
+        wal_checkpoint(true);
+        pthread_mutex_lock(&wal_lock);
+        ckpt_stop = true;
+        pthread_cond_signal(&wal_cond);
+        pthread_mutex_unlock(&wal_lock);
+        pthread_join(ckpt_thread, NULL);
+        ckpt_running = false;
+    }
+    for (i = 0; dirty_hash != NULL && i < ((uint64_t)1 << dirty_bits); i++)
+        for (d = dirty_hash[i]; d != NULL; d = next) {
+            next = d->hnext;
+            free(d->page);
+            free(d);
+        }
+    free(dirty_hash);
+    dirty_hash = NULL;
+    dirty_bits = 0;
+    dirty_cnt = 0;
+    if (seg_fd >= 0)
+        close(seg_fd);
+    seg_fd = -1;
+    log_len = 0;
+    next_lsn = durable_lsn = ckpt_lsn = 0;
+    hold_lsn = UINT64_MAX;
+    wal_on = false;
+}
+
+
+/* Remembers the path of the opened table, and recovers it and
+ * starts the checkpointer if it is logged.
+ */
+void wal_open(const char * pathname, bool logged) {
+    snprintf(wal_path, sizeof(wal_path), "%s", pathname);
+    if (!logged)
+        return;
+    wal_recover();
+    wal_on = true;
+    wal_start();
+}
+
+
+/* Turns write-ahead logging on for the opened table.
+ * Returns 0, or -1 if the table is shadow paged.
+ */
+int db_enable_wal(void) {
+    HeaderPage hp;
+
+    if (shadow_on)
+        return -1;
+    pthread_rwlock_wrlock(&db_latch);
+    if (!wal_on) {
+        // Segments of an earlier table at this path must not be replayed.
+        seg_remove_all();
+        file_read_page(0, (page_t *)&hp);
+        hp.flags |= HDR_LOGGED;
+        hp.clsn = 0;
+        file_write_page(0, (page_t *)&hp);
+        fdatasync(fileno(fp_db));
+        next_lsn = durable_lsn = ckpt_lsn = 0;
+        wal_on = true;
+        wal_start();
+    }
+    pthread_rwlock_unlock(&db_latch);
+    return 0;
+}
+
+
+/* Writes every dirty page back and moves clsn to the end of
+ * the log.  Returns 0, or -1 if the table is not logged.
+ */
+int db_checkpoint(void) {
+    if (!wal_on)
+        return -1;
+    wal_checkpoint(true);
+    return 0;
+}
+
+
+// Sets the recovery time the checkpointer aims for.
+void db_wal_set_recovery_target(double seconds) {
+    pthread_mutex_lock(&wal_lock);
+    recovery_secs = seconds > 0 ? seconds : WAL_DEFAULT_RECOVERY_SECS;
+    pthread_mutex_unlock(&wal_lock);
+}